@@ -0,0 +1,570 @@
+/**
+ * @file aot.cpp
+ * @brief Ahead-of-time translator. Finds the basic blocks of a ROM by
+ * following its control flow from ROM_START and writes them as C++, one
+ * function per block, for Chip8Aot to run once the file is compiled and
+ * linked in. See chip8_aot.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "chip8_aot.h"
+#include "rom_library.h"
+
+// How the translator treats an opcode. The same instructions as the JIT's
+// are translated, everything else runs on the interpreter.
+#define OP_INTERPRET 0  // Ends the block before it
+#define OP_STRAIGHT 1  // Execution continues with the next opcode
+#define OP_TERMINATOR 2  // Ends the block
+
+static void usage() {
+    std::cerr << "Usage: chip8-aot [-q quirks] [-o output.cpp] romfile.rom" << std::endl;
+    std::cerr << "quirks: none, cosmac, schip or a comma separated list of "
+        "shift_vy, memory_i, jump_vx, clip, vf_reset" << std::endl;
+}
+
+static int classify(unsigned short opcode) {
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            return opcode == 0x00EE ? OP_TERMINATOR : OP_INTERPRET;
+
+        case 0x1000:
+        case 0x2000:
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+        case 0xB000:
+            return OP_TERMINATOR;
+
+        case 0x6000:
+        case 0x7000:
+        case 0xA000:
+            return OP_STRAIGHT;
+
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0: case 0x1: case 0x2: case 0x3:
+                case 0x4: case 0x5: case 0x6: case 0x7:
+                case 0xE:
+                    return OP_STRAIGHT;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        case 0xE000:
+            switch (opcode & 0x00FF) {
+                case 0x9E:
+                case 0xA1:
+                    return OP_TERMINATOR;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x1E:
+                case 0x29:
+                case 0x65:
+                    return OP_STRAIGHT;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        default:
+            return OP_INTERPRET;
+    }
+}
+
+// Machine code calls and 00FD never continue with the next instruction
+static bool fallsThrough(unsigned short opcode) {
+    if ((opcode & 0xF000) != 0x0000) {
+        return true;
+    }
+    return opcode == 0x00E0 || (opcode & 0xFFF0) == 0x00C0 || opcode == 0x00FB ||
+        opcode == 0x00FC || opcode == 0x00FE || opcode == 0x00FF;
+}
+
+namespace {
+
+struct Block {
+    unsigned short address;
+    unsigned short length;
+};
+
+/**
+ * @brief Writes the translation of one ROM
+ */
+class Translator {
+private:
+    const RomImage &rom;
+    unsigned int quirks;
+    FILE *out;
+
+    bool inRom(unsigned int address) const {
+        return address >= ROM_START && address + 1 < ROM_START + rom.size;
+    }
+
+    unsigned short word(unsigned short address) const {
+        return rom.data[address - ROM_START] << 8 | rom.data[address - ROM_START + 1];
+    }
+
+    std::vector<Block> findBlocks() const;
+    void writeBlock(const Block &block) const;
+
+public:
+    Translator(const RomImage &rom, unsigned int quirks, FILE *out) :
+        rom(rom), quirks(quirks), out(out) {}
+
+    void write(const std::string &name) const;
+};
+
+std::vector<Block> Translator::findBlocks() const {
+    // Every address execution can reach from ROM_START through fixed jumps,
+    // calls, returns to a call and skips. Computed jumps (BNNN) cannot be
+    // followed, their targets are left to the interpreter.
+    std::vector<bool> seen(MEMORY, false);
+    std::vector<unsigned short> pending;
+    std::vector<Block> blocks;
+
+    auto follow = [&](unsigned int address) {
+        if (inRom(address) && !seen[address]) {
+            seen[address] = true;
+            pending.push_back(address);
+        }
+    };
+
+    follow(ROM_START);
+    while (!pending.empty()) {
+        unsigned short address = pending.back();
+        pending.pop_back();
+
+        unsigned short opcode = word(address);
+        if (classify(opcode) == OP_INTERPRET) {
+            if (fallsThrough(opcode)) {
+                follow(address + 2);
+            }
+            continue;
+        }
+
+        Block block = { address, 0 };
+        bool terminated = false;
+        while (block.length < AOT_MAX_BLOCK && inRom(address)) {
+            opcode = word(address);
+            int kind = classify(opcode);
+            if (kind == OP_INTERPRET) {
+                break;
+            }
+
+            block.length++;
+            if (kind == OP_TERMINATOR) {
+                terminated = true;
+                break;
+            }
+            address += 2;
+        }
+        blocks.push_back(block);
+
+        if (!terminated) {
+            follow(address);
+            continue;
+        }
+        switch (opcode & 0xF000) {
+            case 0x0000:
+            case 0xB000:
+                break;
+
+            case 0x1000:
+                follow(opcode & 0x0FFF);
+                break;
+
+            case 0x2000:
+                // The return comes back after the call
+                follow(opcode & 0x0FFF);
+                follow(address + 2);
+                break;
+
+            default:
+                // Skips
+                follow(address + 2);
+                follow(address + 4);
+                break;
+        }
+    }
+
+    std::sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) {
+        return a.address < b.address;
+    });
+    return blocks;
+}
+
+void Translator::writeBlock(const Block &block) const {
+    // The registers live in locals for the whole block, so the compiler keeps
+    // them in host registers and folds constants across instructions. They
+    // are loaded on entry and the ones written are stored on exit.
+    std::vector<std::string> lines;
+    bool used[REGISTERS] = { false };
+    bool written[REGISTERS] = { false };
+    bool usesI = false;
+    bool writesI = false;
+    bool stackError = false;
+
+    // Adds a statement, commented with the instruction on its first line
+    auto add = [&](unsigned short address, unsigned short opcode, const char *format, ...) {
+        char text[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+
+        char comment[32];
+        snprintf(comment, sizeof(comment), "  // %03X: %04X", address, opcode);
+        std::string statement = text;
+        statement.insert(std::min(statement.find('\n'), statement.size()), comment);
+        lines.push_back(statement);
+    };
+    auto reads = [&](int r) {
+        used[r] = true;
+    };
+    auto writes = [&](int r) {
+        used[r] = true;
+        written[r] = true;
+    };
+
+    unsigned short address = block.address;
+    unsigned short last = block.address + 2 * (block.length - 1);
+    for (; address <= last; address += 2) {
+        unsigned short opcode = word(address);
+        unsigned short NNN = opcode & 0x0FFF;
+        unsigned char NN = opcode & 0x00FF;
+        int X = (opcode & 0x0F00) >> 8;
+        int Y = (opcode & 0x00F0) >> 4;
+        int shiftSource = quirks & CHIP8_QUIRK_SHIFT_VY ? Y : X;
+
+        switch (opcode & 0xF000) {
+            case 0x0000:
+                // 00EE
+                stackError = true;
+                add(address, opcode, "if (*c.sp == 0) {\n"
+                    "        pc = 0x%03X;\n"
+                    "        count--;\n"
+                    "    } else {\n"
+                    "        pc = c.stack[--*c.sp] + 2;\n"
+                    "    }", address);
+                break;
+
+            case 0x1000:
+                add(address, opcode, "pc = 0x%03X;", NNN);
+                break;
+
+            case 0x2000:
+                stackError = true;
+                add(address, opcode, "if (*c.sp >= STACK) {\n"
+                    "        pc = 0x%03X;\n"
+                    "        count--;\n"
+                    "    } else {\n"
+                    "        c.stack[(*c.sp)++] = 0x%03X;\n"
+                    "        pc = 0x%03X;\n"
+                    "    }", address, address, NNN);
+                break;
+
+            case 0x3000:
+                reads(X);
+                add(address, opcode, "pc = v%X == 0x%02X ? 0x%03X : 0x%03X;", X, NN,
+                    address + 4, address + 2);
+                break;
+
+            case 0x4000:
+                reads(X);
+                add(address, opcode, "pc = v%X != 0x%02X ? 0x%03X : 0x%03X;", X, NN,
+                    address + 4, address + 2);
+                break;
+
+            case 0x5000:
+                reads(X);
+                reads(Y);
+                add(address, opcode, "pc = v%X == v%X ? 0x%03X : 0x%03X;", X, Y,
+                    address + 4, address + 2);
+                break;
+
+            case 0x6000:
+                writes(X);
+                add(address, opcode, "v%X = 0x%02X;", X, NN);
+                break;
+
+            case 0x7000:
+                writes(X);
+                add(address, opcode, "v%X += 0x%02X;", X, NN);
+                break;
+
+            case 0x8000:
+                // Shifts only read VY with CHIP8_QUIRK_SHIFT_VY
+                if ((opcode & 0x000F) != 0x6 && (opcode & 0x000F) != 0xE) {
+                    reads(Y);
+                }
+                writes(X);
+                switch (opcode & 0x000F) {
+                    case 0x0:
+                        add(address, opcode, "v%X = v%X;", X, Y);
+                        break;
+
+                    case 0x1:
+                    case 0x2:
+                    case 0x3: {
+                        static const char *const ops[] = { "|", "&", "^" };
+                        add(address, opcode, "v%X %s= v%X;", X, ops[(opcode & 0x000F) - 1], Y);
+                        if (quirks & CHIP8_QUIRK_VF_RESET) {
+                            writes(0xF);
+                            add(address, opcode, "vF = 0;");
+                        }
+                        break;
+                    }
+
+                    // VF is set before VX, like the interpreter does, which
+                    // matters when X or Y is F
+                    case 0x4:
+                        writes(0xF);
+                        add(address, opcode, "vF = v%X > 0xFF - v%X;", X, Y);
+                        add(address, opcode, "v%X += v%X;", X, Y);
+                        break;
+
+                    case 0x5:
+                        writes(0xF);
+                        add(address, opcode, "vF = v%X <= v%X;", Y, X);
+                        add(address, opcode, "v%X -= v%X;", X, Y);
+                        break;
+
+                    case 0x6:
+                        reads(shiftSource);
+                        writes(0xF);
+                        add(address, opcode, "vF = v%X & 1;", shiftSource);
+                        add(address, opcode, "v%X = v%X >> 1;", X, shiftSource);
+                        break;
+
+                    case 0x7:
+                        writes(0xF);
+                        add(address, opcode, "vF = v%X <= v%X;", X, Y);
+                        add(address, opcode, "v%X = v%X - v%X;", X, Y, X);
+                        break;
+
+                    case 0xE:
+                        reads(shiftSource);
+                        writes(0xF);
+                        add(address, opcode, "vF = v%X >> 7;", shiftSource);
+                        add(address, opcode, "v%X = v%X << 1;", X, shiftSource);
+                        break;
+                }
+                break;
+
+            case 0x9000:
+                reads(X);
+                reads(Y);
+                add(address, opcode, "pc = v%X != v%X ? 0x%03X : 0x%03X;", X, Y,
+                    address + 4, address + 2);
+                break;
+
+            case 0xA000:
+                writesI = true;
+                add(address, opcode, "i = 0x%03X;", NNN);
+                break;
+
+            case 0xB000: {
+                int offset = quirks & CHIP8_QUIRK_JUMP_VX ? X : 0;
+                reads(offset);
+                add(address, opcode, "pc = 0x%03X + v%X;", NNN, offset);
+                break;
+            }
+
+            case 0xE000:
+                reads(X);
+                add(address, opcode, "pc = c.key[v%X & KEY_MASK] ? 0x%03X : 0x%03X;", X,
+                    NN == 0x9E ? address + 4 : address + 2,
+                    NN == 0x9E ? address + 2 : address + 4);
+                break;
+
+            case 0xF000:
+                switch (NN) {
+                    case 0x1E:
+                        reads(X);
+                        usesI = writesI = true;
+                        add(address, opcode, "i += v%X;", X);
+                        break;
+
+                    case 0x29:
+                        reads(X);
+                        writesI = true;
+                        add(address, opcode, "i = v%X * 5;", X);
+                        break;
+
+                    case 0x65:
+                        usesI = true;
+                        for (int r = 0; r <= X; r++) {
+                            writes(r);
+                            add(address, opcode, "v%X = c.read((i + %d) & ADDRESS_MASK);", r, r);
+                        }
+                        if (quirks & CHIP8_QUIRK_MEMORY_I) {
+                            writesI = true;
+                            add(address, opcode, "i += %d;", X + 1);
+                        }
+                        break;
+                }
+                break;
+        }
+    }
+
+    if (classify(word(last)) != OP_TERMINATOR) {
+        // Continues with an instruction that is interpreted or starts
+        // another block
+        char text[32];
+        snprintf(text, sizeof(text), "pc = 0x%03X;", last + 2);
+        lines.push_back(text);
+    }
+
+    fprintf(out, "// %03X to %03X\n", block.address, last + 1);
+    fprintf(out, "unsigned int block%03X(const Chip8AotContext &c) {\n", block.address);
+    for (int r = 0; r < REGISTERS; r++) {
+        if (used[r]) {
+            fprintf(out, "    unsigned char v%X = c.V[0x%X];\n", r, r);
+        }
+    }
+    if (usesI || writesI) {
+        fprintf(out, "    unsigned short i = *c.I;\n");
+    }
+    fprintf(out, "    unsigned short pc;\n");
+    if (stackError) {
+        fprintf(out, "    unsigned int count = %u;\n", block.length);
+    }
+    fprintf(out, "\n");
+    for (const std::string &text : lines) {
+        fprintf(out, "    %s\n", text.c_str());
+    }
+    fprintf(out, "\n");
+    for (int r = 0; r < REGISTERS; r++) {
+        if (written[r]) {
+            fprintf(out, "    c.V[0x%X] = v%X;\n", r, r);
+        }
+    }
+    if (writesI) {
+        fprintf(out, "    *c.I = i;\n");
+    }
+    fprintf(out, "    *c.pc = pc;\n");
+    fprintf(out, "    *c.opcode = 0x%04X;\n", word(last));
+    if (stackError) {
+        fprintf(out, "    return count;\n");
+    } else {
+        fprintf(out, "    return %u;\n", block.length);
+    }
+    fprintf(out, "}\n\n");
+}
+
+void Translator::write(const std::string &name) const {
+    std::vector<Block> blocks = findBlocks();
+
+    fprintf(out, "// Translated from %s by chip8-aot, do not edit\n\n", rom.path.c_str());
+    fprintf(out, "#include \"chip8_aot.h\"\n\n");
+    fprintf(out, "namespace {\n\n");
+
+    fprintf(out, "const unsigned char rom[] = {");
+    for (size_t i = 0; i < rom.size; i++) {
+        fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ", rom.data[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    for (const Block &block : blocks) {
+        writeBlock(block);
+    }
+
+    fprintf(out, "const Chip8AotBlock blocks[] = {\n");
+    for (const Block &block : blocks) {
+        fprintf(out, "    { 0x%03X, %u, block%03X },\n", block.address, block.length,
+            block.address);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "const Chip8AotProgram program = {\n");
+    fprintf(out, "    \"%s\", rom, sizeof(rom), 0x%X, blocks, sizeof(blocks) / sizeof(blocks[0])\n",
+        name.c_str(), quirks);
+    fprintf(out, "};\n\n");
+    fprintf(out, "Chip8AotRegistration registration(program);\n\n");
+    fprintf(out, "}\n");
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+    unsigned int quirks = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "o:q:")) != -1) {
+        switch (option) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'q':
+                if (!chip8ParseQuirks(optarg, &quirks)) {
+                    usage();
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
+    const char *path = argv[optind];
+
+    // File name without directory and extension, only characters that are
+    // safe in a string literal
+    std::string name = path;
+    name = name.substr(name.find_last_of('/') + 1);
+    name = name.substr(0, name.find_last_of('.'));
+    for (char &c : name) {
+        if (c == '"' || c == '\\') {
+            c = '_';
+        }
+    }
+
+    RomLibrary library;
+    FILE *out = stdout;
+    try {
+        const RomImage &rom = library.load(path);
+        if (rom.size < 2) {
+            throw FormattedException("No instructions in ROM file: %s\n", path);
+        }
+        if (output != NULL) {
+            out = fopen(output, "w");
+            if (out == NULL) {
+                throw FormattedException("Could not open %s\n", output);
+            }
+        }
+        Translator(rom, quirks, out).write(name);
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        if (out != stdout && out != NULL) {
+            fclose(out);
+            unlink(output);
+        }
+        return -1;
+    }
+
+    if (out != stdout && fclose(out) != 0) {
+        std::cerr << "Could not write " << output << std::endl;
+        unlink(output);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+/**
+ * @file audio.cpp
+ * @brief Implementation of the buzzer generator and the file sink
+ */
+
+#include <algorithm>
+
+#include "audio.h"
+
+// Samples rendered or copied at a time
+#define AUDIO_CHUNK 256
+
+// RIFF header of a 16 bit mono PCM file
+#define WAV_HEADER_SIZE 44
+
+static void putBytes(std::string &out, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out += (char) (value >> (8 * i));
+    }
+}
+
+static std::string wavHeader(unsigned long long samples) {
+    unsigned long long dataSize = samples * 2;
+    std::string header("RIFF");
+    putBytes(header, WAV_HEADER_SIZE - 8 + dataSize, 4);
+    header += "WAVEfmt ";
+    putBytes(header, 16, 4);  // Format chunk size
+    putBytes(header, 1, 2);  // PCM
+    putBytes(header, 1, 2);  // Mono
+    putBytes(header, AUDIO_SAMPLE_RATE, 4);
+    putBytes(header, AUDIO_SAMPLE_RATE * 2, 4);  // Bytes per second
+    putBytes(header, 2, 2);  // Bytes per sample
+    putBytes(header, 16, 2);  // Bits per sample
+    header += "data";
+    putBytes(header, dataSize, 4);
+    return header;
+}
+
+AudioSink::AudioSink() {
+    ring = NULL;
+    consumed = 0;
+    pendingMark = false;
+    skipped = 0;
+    underruns = 0;
+    starts = 0;
+    latencySum = 0;
+    latencyMax = 0;
+}
+
+void AudioSink::start(AudioRing *ring) {
+    this->ring = ring;
+}
+
+unsigned int AudioSink::bufferSamples() const {
+    return 0;
+}
+
+size_t AudioSink::read(int16_t *out, size_t count, double delay, bool realtime) {
+    // Nothing to take, and skipping would never make progress
+    if (count == 0) {
+        return 0;
+    }
+
+    if (realtime) {
+        // Samples queued beyond a short backlog would only make the buzzer
+        // late, drop the oldest
+        size_t queued = ring->samples.size();
+        while (queued > AUDIO_MAX_QUEUED) {
+            size_t excess = ring->samples.pop(out, std::min(count, queued - AUDIO_MAX_QUEUED));
+            skipped += excess;
+            consumed += excess;
+            queued -= excess;
+        }
+    }
+
+    size_t taken = ring->samples.pop(out, count);
+    if (realtime && taken < count) {
+        std::fill(out + taken, out + count, 0);
+        underruns += count - taken;
+    }
+
+    // Buzzer starts among the samples taken. Marks are pushed after their
+    // samples, so a mark ahead of them is kept for a later read.
+    auto now = std::chrono::steady_clock::now();
+    while (pendingMark || ring->marks.pop(mark)) {
+        pendingMark = true;
+        if (mark.sample >= consumed + taken) {
+            break;
+        }
+        if (mark.sample >= consumed) {
+            // Played after the samples before it in this read
+            double latency = std::chrono::duration<double>(now - mark.time).count() + delay;
+            if (realtime) {
+                latency += (double) (mark.sample - consumed) / AUDIO_SAMPLE_RATE;
+            }
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, latency);
+            starts++;
+        }
+        pendingMark = false;
+    }
+
+    consumed += taken;
+    return taken;
+}
+
+void AudioSink::addStats(AudioStats &stats) const {
+    stats.skipped += skipped;
+    stats.underruns += underruns;
+    stats.starts += starts;
+    stats.latencyMean = starts > 0 ? latencySum / starts : 0;
+    stats.latencyMax = latencyMax;
+}
+
+WavSink::WavSink(const char *path) : path(path) {
+    written = 0;
+}
+
+void WavSink::start(AudioRing *ring) {
+    AudioSink::start(ring);
+
+    file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    // The sizes are filled in by stop()
+    std::string header = wavHeader(0);
+    file.write(header.data(), header.size());
+    if (!file) {
+        throw FormattedException("Could not write audio: %s\n", path.c_str());
+    }
+}
+
+void WavSink::update() {
+    drain();
+}
+
+void WavSink::drain() {
+    int16_t samples[AUDIO_CHUNK];
+    char bytes[2 * AUDIO_CHUNK];
+    size_t count;
+    while ((count = read(samples, AUDIO_CHUNK, 0, false)) > 0) {
+        // Little endian regardless of the host
+        for (size_t i = 0; i < count; i++) {
+            bytes[2 * i] = (char) (samples[i] & 0xFF);
+            bytes[2 * i + 1] = (char) ((uint16_t) samples[i] >> 8);
+        }
+        file.write(bytes, 2 * count);
+        written += count;
+    }
+}
+
+void WavSink::stop() {
+    drain();
+
+    std::string header = wavHeader(written);
+    file.seekp(0);
+    file.write(header.data(), header.size());
+    file.close();
+    if (!file) {
+        throw FormattedException("Could not write audio: %s\n", path.c_str());
+    }
+}
+
+Chip8Audio::Chip8Audio(Chip8 &chip8, AudioSink *sink) {
+    this->sink = sink;
+    sink->start(&ring);
+    running = true;
+
+    phase = 0;
+    rendered = 0;
+    dropped = 0;
+    pushed = 0;
+    reset(chip8);
+}
+
+Chip8Audio::~Chip8Audio() {
+    if (running) {
+        // Errors can only be reported by an explicit stop()
+        try {
+            stop();
+        } catch (const std::exception &) {
+        }
+    }
+}
+
+void Chip8Audio::reset(Chip8 &chip8) {
+    Chip8SoundEvent events[CHIP8_SOUND_EVENTS];
+    chip8.takeSoundEvents(events);
+
+    frameStart = chip8.getCycles();
+    remainder = 0;
+    level = chip8.isSoundOn();
+}
+
+void Chip8Audio::renderFrame(Chip8 &chip8) {
+    Chip8SoundEvent events[CHIP8_SOUND_EVENTS];
+    unsigned int count = chip8.takeSoundEvents(events);
+
+    unsigned long long end = chip8.getCycles();
+    if (end < frameStart) {
+        // The system went back in time without a reset()
+        reset(chip8);
+        return;
+    }
+
+    // Samples of the instructions since the last frame, and the sample each
+    // buzzer change falls on
+    unsigned long long cyclesPerTick = chip8.getCyclesPerTick();
+    unsigned long long total = (end - frameStart) * AUDIO_SAMPLES_PER_TICK + remainder;
+    unsigned long long samples = total / cyclesPerTick;
+    unsigned long long offsets[CHIP8_SOUND_EVENTS];
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned long long cycle = std::max(events[i].cycle, frameStart);
+        offsets[i] = std::min(samples,
+                ((cycle - frameStart) * AUDIO_SAMPLES_PER_TICK + remainder) / cyclesPerTick);
+    }
+    remainder = total % cyclesPerTick;
+    frameStart = end;
+
+    auto now = std::chrono::steady_clock::now();
+    int16_t chunk[AUDIO_CHUNK];
+    unsigned long long starts[CHIP8_SOUND_EVENTS];
+    unsigned int next = 0;
+
+    for (unsigned long long first = 0; first < samples; first += AUDIO_CHUNK) {
+        size_t size = std::min<unsigned long long>(AUDIO_CHUNK, samples - first);
+        unsigned int startCount = 0;
+
+        // Square wave while the buzzer is on, silence otherwise
+        for (size_t i = 0; i < size; i++) {
+            while (next < count && offsets[next] <= first + i) {
+                if (events[next].on && !level) {
+                    phase = 0;
+                    starts[startCount++] = i;
+                }
+                level = events[next].on;
+                next++;
+            }
+
+            if (level) {
+                chunk[i] = phase < AUDIO_SAMPLE_RATE / 2 ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+                phase += AUDIO_TONE_HZ;
+                if (phase >= AUDIO_SAMPLE_RATE) {
+                    phase -= AUDIO_SAMPLE_RATE;
+                }
+            } else {
+                chunk[i] = 0;
+            }
+        }
+
+        // Never wait for the sink, drop what does not fit
+        size_t taken = ring.samples.push(chunk, size);
+        for (unsigned int i = 0; i < startCount; i++) {
+            if (starts[i] < taken) {
+                ring.marks.push({ pushed + starts[i], now });
+            }
+        }
+        rendered += size;
+        dropped += size - taken;
+        pushed += taken;
+    }
+
+    // Changes at the very end of the frame
+    for (; next < count; next++) {
+        if (events[next].on && !level) {
+            phase = 0;
+        }
+        level = events[next].on;
+    }
+
+    sink->update();
+}
+
+void Chip8Audio::stop() {
+    running = false;
+    sink->stop();
+}
+
+AudioStats Chip8Audio::getStats() const {
+    AudioStats stats = {};
+    stats.sampleRate = AUDIO_SAMPLE_RATE;
+    stats.ringSamples = AUDIO_RING_SIZE;
+    stats.sinkSamples = sink->bufferSamples();
+    stats.rendered = rendered;
+    stats.dropped = dropped;
+    if (!running) {
+        sink->addStats(stats);
+    }
+    return stats;
+}
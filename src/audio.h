@@ -0,0 +1,227 @@
+/**
+ * @file audio.h
+ * @brief Buzzer audio: a square wave generator feeding a lock-free sample
+ * ring that a pluggable sink plays or writes out
+ */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#include "chip8.h"
+#include "spsc_queue.h"
+
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_SAMPLES_PER_TICK ((unsigned int) (AUDIO_SAMPLE_RATE / CLOCK_HZ + 0.5))
+#define AUDIO_TONE_HZ 440
+#define AUDIO_AMPLITUDE 6000
+
+// Samples between the generator and the sink, about 93ms. A power of 2.
+#define AUDIO_RING_SIZE 4096
+// Buzzer starts in flight between the generator and the sink
+#define AUDIO_MARKS 64
+// Samples a real time sink lets queue up before it skips the oldest to
+// catch up, two frames
+#define AUDIO_MAX_QUEUED (2 * AUDIO_SAMPLES_PER_TICK)
+
+/**
+ * @brief Sample at which the buzzer started and when it was rendered
+ */
+struct AudioMark {
+    unsigned long long sample;  // Index among all samples put in the ring
+    std::chrono::steady_clock::time_point time;
+};
+
+/**
+ * @brief Samples and buzzer start marks passed from the generator to a sink
+ */
+struct AudioRing {
+    SpscQueue<int16_t, AUDIO_RING_SIZE> samples;
+    SpscQueue<AudioMark, AUDIO_MARKS> marks;
+};
+
+/**
+ * @brief Buffer sizes and counters of an audio pipeline, see
+ * Chip8Audio::getStats()
+ */
+struct AudioStats {
+    unsigned int sampleRate;
+    unsigned int ringSamples;  // Capacity of the ring
+    unsigned int sinkSamples;  // Buffer of the sink or device, 0 for files
+    unsigned long long rendered;  // Samples generated
+    unsigned long long dropped;  // Samples lost because the ring was full
+    unsigned long long skipped;  // Samples the sink skipped to catch up
+    unsigned long long underruns;  // Silent samples the sink played for lack of data
+    unsigned long long starts;  // Buzzer starts that reached the output
+    double latencyMean;  // Seconds from FX18 to its first sample being output
+    double latencyMax;
+};
+
+/**
+ * @class AudioSink
+ * @brief Consumer of the sample ring. Real time sinks pull samples on their
+ * own thread as their device needs them, file sinks are drained by the
+ * generator after every frame. read() measures how long each buzzer start
+ * took to reach the output.
+ */
+class AudioSink {
+private:
+    AudioRing *ring;
+    unsigned long long consumed;  // Samples taken from the ring
+    AudioMark mark;  // Next buzzer start, valid if pendingMark
+    bool pendingMark;
+
+    // Owned by the consumer thread, read once the sink is stopped
+    unsigned long long skipped;
+    unsigned long long underruns;
+    unsigned long long starts;
+    double latencySum;
+    double latencyMax;
+
+protected:
+    /**
+     * @brief Takes samples from the ring. Consumer thread only.
+     *
+     * @param out : Buffer for count samples
+     * @param count : Samples wanted, nothing is done for 0
+     * @param delay : Seconds until the first sample is heard, 0 for files
+     * @param realtime : Pads with silence if the ring runs dry and skips
+     * samples queued beyond AUDIO_MAX_QUEUED
+     * @return Number of samples taken from the ring
+     */
+    size_t read(int16_t *out, size_t count, double delay, bool realtime);
+
+public:
+    AudioSink();
+    virtual ~AudioSink() {}
+
+    /**
+     * @brief Starts consuming a ring. Overrides must call this first.
+     *
+     * @throws FormattedException if the output cannot be opened
+     */
+    virtual void start(AudioRing *ring);
+
+    /**
+     * @brief Called by the generator after each rendered frame
+     */
+    virtual void update() {}
+
+    /**
+     * @brief Stops consuming and flushes the output. No samples are read
+     * afterwards.
+     *
+     * @throws FormattedException if the output cannot be written
+     */
+    virtual void stop() {}
+
+    /**
+     * @brief Returns the size of the output buffer in samples, 0 if none
+     */
+    virtual unsigned int bufferSamples() const;
+
+    /**
+     * @brief Adds the counters of the sink to stats. Only valid once stopped.
+     */
+    void addStats(AudioStats &stats) const;
+};
+
+/**
+ * @class WavSink
+ * @brief Writes the samples to a 16 bit mono WAV file, for headless runs.
+ * Everything rendered is written, output is not paced.
+ */
+class WavSink : public AudioSink {
+private:
+    std::ofstream file;
+    std::string path;
+    unsigned long long written;  // Samples
+
+    void drain();
+
+public:
+    /**
+     * @param path : Path of the file to create or overwrite when started
+     */
+    WavSink(const char *path);
+
+    void start(AudioRing *ring) override;
+    void update() override;
+    void stop() override;
+};
+
+/**
+ * @class Chip8Audio
+ * @brief Renders the buzzer of a system on the virtual clock into a sink.
+ *
+ * Call renderFrame() after running the system. It renders the samples of the
+ * instructions executed since the previous call, AUDIO_SAMPLES_PER_TICK per
+ * 60Hz tick, and places each buzzer change at the sample of the instruction
+ * that made it. The generator never waits: samples that do not fit in the
+ * ring are dropped and counted.
+ */
+class Chip8Audio {
+private:
+    AudioRing ring;
+    AudioSink *sink;
+    bool running;
+
+    unsigned long long frameStart;  // Cycle of the first unrendered sample
+    unsigned long long remainder;  // Fraction of a sample carried over, in 1 / cycles per tick
+    bool level;  // Buzzer state at frameStart
+    unsigned int phase;  // Position in the square wave period, in AUDIO_SAMPLE_RATE units
+
+    unsigned long long rendered;
+    unsigned long long dropped;
+    unsigned long long pushed;  // Samples put in the ring
+
+public:
+    /**
+     * @brief Starts a sink, rendering from the current state of a system
+     *
+     * @param chip8 : System to render
+     * @param sink : Started here and stopped by stop(), must outlive this
+     * @throws FormattedException if the sink cannot be started
+     */
+    Chip8Audio(Chip8 &chip8, AudioSink *sink);
+
+    /**
+     * @brief Stops the sink if stop() was not called. Errors are ignored.
+     */
+    ~Chip8Audio();
+
+    Chip8Audio(const Chip8Audio &) = delete;
+    Chip8Audio &operator=(const Chip8Audio &) = delete;
+
+    /**
+     * @brief Renders the buzzer up to the current instruction of the system
+     * and hands the samples to the sink
+     */
+    void renderFrame(Chip8 &chip8);
+
+    /**
+     * @brief Continues from the current state of the system without
+     * rendering the instructions since the last frame. Call after loading a
+     * state, rewinding or skipping time that should stay silent.
+     */
+    void reset(Chip8 &chip8);
+
+    /**
+     * @brief Stops the sink and flushes its output
+     *
+     * @throws FormattedException if the sink cannot write its output
+     */
+    void stop();
+
+    /**
+     * @brief Returns buffer sizes and counters. Sink counters are only
+     * included once stopped.
+     */
+    AudioStats getStats() const;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * @file batch.cpp
+ * @brief Implementation of batch manifests, input scripts and batch jobs
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "batch.h"
+
+// Returns false for blank and comment lines
+static bool isContent(const std::string &line) {
+    size_t start = line.find_first_not_of(" \t\r");
+    return start != std::string::npos && line[start] != '#';
+}
+
+std::vector<BatchJob> loadManifest(const char *path, unsigned int quirks) {
+    std::ifstream infile(path);
+    if (!infile) {
+        throw FormattedException("Could not open manifest: %s\n", path);
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(infile, line)) {
+        lineNumber++;
+        if (!isContent(line)) {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        BatchJob job;
+        job.quirks = quirks;
+        if (!(fields >> job.rom >> job.seed >> job.cycles)) {
+            throw FormattedException("%s:%d: expected \"rom seed cycles [input [quirks]]\"\n",
+                    path, lineNumber);
+        }
+        fields >> job.input;
+        if (job.input == "-") {
+            job.input.clear();
+        }
+        std::string jobQuirks;
+        if (fields >> jobQuirks && !chip8ParseQuirks(jobQuirks.c_str(), &job.quirks)) {
+            throw FormattedException("%s:%d: unknown quirks \"%s\"\n", path, lineNumber,
+                    jobQuirks.c_str());
+        }
+        jobs.push_back(job);
+    }
+
+    return jobs;
+}
+
+std::vector<KeyEvent> loadInputScript(const char *path) {
+    if (isMovieFile(path)) {
+        return loadMovie(path).events;
+    }
+
+    std::ifstream infile(path);
+    if (!infile) {
+        throw FormattedException("Could not open input script: %s\n", path);
+    }
+
+    std::vector<KeyEvent> events;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(infile, line)) {
+        lineNumber++;
+        if (!isContent(line)) {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        KeyEvent event;
+        unsigned int key;
+        int pressed;
+        if (!(fields >> event.cycle >> std::hex >> key >> std::dec >> pressed) ||
+                key >= KEYS) {
+            throw FormattedException("%s:%d: expected \"cycle key pressed\"\n",
+                    path, lineNumber);
+        }
+        event.key = key;
+        event.pressed = pressed != 0;
+        events.push_back(event);
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+            [](const KeyEvent &a, const KeyEvent &b) { return a.cycle < b.cycle; });
+    return events;
+}
+
+void runBatchJob(const BatchJob &job, RomLibrary &library, Chip8Core core,
+        unsigned int cyclesPerTick, BatchResult &result) {
+    Chip8 chip8;
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        std::vector<KeyEvent> events;
+        if (!job.input.empty()) {
+            events = loadInputScript(job.input.c_str());
+        }
+
+        chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+        chip8.setCyclesPerTick(cyclesPerTick);
+        chip8.setSeed(job.seed);
+        chip8.setCore(core);
+        const RomImage &rom = library.load(job.rom.c_str());
+        chip8.setMode(rom.platform);
+        chip8.setQuirks(job.quirks);
+        chip8.loadRom(rom.data, rom.size);
+        runWithInput(chip8, events, job.cycles);
+    } catch (const std::exception &e) {
+        result.error = e.what();
+        // Messages end with a newline, keep the report one line per job
+        result.error.erase(result.error.find_last_not_of("\n") + 1);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.cycles = chip8.getCycles();
+    result.gfxHash = chip8.hashGfx();
+}
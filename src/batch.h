@@ -0,0 +1,75 @@
+/**
+ * @file batch.h
+ * @brief Batch jobs for the headless runner: manifests, input scripts and
+ * running a single job to completion
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "movie.h"
+#include "rom_library.h"
+
+/**
+ * @brief One line of a batch manifest
+ */
+struct BatchJob {
+    std::string rom;
+    unsigned int seed;
+    unsigned long long cycles;
+    std::string input;  // Input script path, empty for no input
+    unsigned int quirks;  // Chip8Quirk flags, see Chip8::setQuirks()
+};
+
+/**
+ * @brief Outcome of a batch job
+ */
+struct BatchResult {
+    unsigned long long cycles;  // Instructions actually executed
+    unsigned long long gfxHash;
+    double seconds;  // Wall time of the job
+    std::string error;  // Empty if the job ran to completion
+};
+
+/**
+ * @brief Reads a batch manifest. Each line is "rom seed cycles [input
+ * [quirks]]", where input is - for no input and quirks is as given to
+ * chip8ParseQuirks(); blank lines and lines starting with # are ignored.
+ *
+ * @param path : Path to the manifest
+ * @param quirks : Chip8Quirk flags of the jobs whose line has none
+ * @throws FormattedException if the file cannot be read or a line is invalid
+ */
+std::vector<BatchJob> loadManifest(const char *path, unsigned int quirks = 0);
+
+/**
+ * @brief Reads an input script. Each line is "cycle key pressed", where key
+ * is a hex digit and pressed is 1 or 0; blank lines and lines starting with #
+ * are ignored. Events are sorted by cycle. A movie file, see saveMovie(), is
+ * read as its events.
+ *
+ * @param path : Path to the input script
+ * @throws FormattedException if the file cannot be read or a line is invalid
+ */
+std::vector<KeyEvent> loadInputScript(const char *path);
+
+/**
+ * @brief Runs a job on a fresh Chip8 instance with the virtual clock, in the
+ * platform detected for its ROM and the quirks of the job. The ROM comes
+ * from the library, so jobs on the same ROM share one mapping and only copy
+ * it. Never throws, errors are reported in the result.
+ *
+ * @param job : Job to run
+ * @param library : Library the ROM is loaded through, shared by all jobs
+ * @param core : Execution engine
+ * @param cyclesPerTick : Instructions per 60Hz tick
+ * @param result : Filled in with the outcome of the job
+ */
+void runBatchJob(const BatchJob &job, RomLibrary &library, Chip8Core core,
+        unsigned int cyclesPerTick, BatchResult &result);
+
+#endif
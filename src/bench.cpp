@@ -0,0 +1,433 @@
+/**
+ * @file bench.cpp
+ * @brief Benchmark suite. Times the opcode handlers one by one and every ROM
+ * of a directory on each execution engine, and writes the results as JSON so
+ * that runs of different versions can be compared.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+#define DEFAULT_REPETITIONS 15
+#define DEFAULT_WARMUP 3
+#define DEFAULT_CYCLES 1000000ULL
+
+// Handler calls per timed sample of a microbenchmark
+#define MICRO_ITERATIONS 65536
+
+// Scripted input of the ROM runs: every key in turn is held for
+// INPUT_HOLD_FRAMES frames, then all keys are released for as long
+#define INPUT_HOLD_FRAMES 4
+
+// Heap allocations made through operator new, counted for the whole program.
+// Kept out of line so the compiler does not pair malloc() and free() with
+// new and delete expressions.
+static unsigned long long allocations = 0;
+static unsigned long long allocatedBytes = 0;
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations++;
+    allocatedBytes += size;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+/**
+ * @brief Summary of the timed samples of a benchmark
+ */
+struct BenchStats {
+    double median;
+    double p99;
+    double min;
+    double mean;
+};
+
+static BenchStats summarize(std::vector<double> samples) {
+    BenchStats stats;
+    std::sort(samples.begin(), samples.end());
+
+    size_t n = samples.size();
+    stats.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    // Nearest rank
+    stats.p99 = samples[(n * 99 + 99) / 100 - 1];
+    stats.min = samples[0];
+    stats.mean = 0;
+    for (double sample : samples) {
+        stats.mean += sample;
+    }
+    stats.mean /= n;
+    return stats;
+}
+
+static void printStats(FILE *out, const char *name, const BenchStats &stats) {
+    fprintf(out, "\"%s\": {\"median\": %.3f, \"p99\": %.3f, \"min\": %.3f, \"mean\": %.3f}",
+            name, stats.median, stats.p99, stats.min, stats.mean);
+}
+
+static std::string jsonString(const std::string &s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * @class Chip8Bench
+ * @brief Microbenchmarks of the opcode handlers. A friend of Chip8 so that
+ * each handler can be called directly on a prepared machine.
+ */
+class Chip8Bench {
+private:
+    // Runs a handler count times in a row
+    struct MicroBench {
+        const char *name;
+        void (*run)(Chip8 &c, unsigned int count);
+    };
+
+    static void prepare(Chip8 &c);
+
+public:
+    /**
+     * @brief Runs every microbenchmark and writes them as a JSON array
+     *
+     * @param out : Destination
+     * @param repetitions : Timed samples per benchmark
+     * @param warmup : Untimed samples run first
+     */
+    static void runMicro(FILE *out, unsigned int repetitions, unsigned int warmup);
+};
+
+void Chip8Bench::prepare(Chip8 &c) {
+    // Distinct register values and a sprite at I, on the virtual clock so
+    // that no handler reads the wall clock
+    c.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    c.pc = ROM_START;
+    c.sp = 0;
+    c.I = 0x300;
+    for (int i = 0; i < REGISTERS; i++) {
+        c.V[i] = i * 17 + 3;
+    }
+    for (int i = 0; i < 16; i++) {
+        c.writeMemory(c.I + i, 0xA5 ^ (i * 0x11));
+    }
+
+    // 0x200: ADD V1, 1; JP 0x200
+    static const unsigned char loop[] = { 0x71, 0x01, 0x12, 0x00 };
+    c.writeMemory(ROM_START, loop, sizeof(loop));
+}
+
+void Chip8Bench::runMicro(FILE *out, unsigned int repetitions, unsigned int warmup) {
+    // Handlers advance the program counter, which they never read back, so
+    // it is only reset between samples
+    static const MicroBench benches[] = {
+        { "op00E0", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op00E0(); } },
+        { "op1NNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op1NNN(0x200); } },
+        { "op2NNN+op00EE", [](Chip8 &c, unsigned int n) {
+            for (unsigned int i = 0; i < n; i++) { c.op2NNN(0x300); c.op00EE(); } } },
+        { "op3XNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op3XNN(1, 0x14); } },
+        { "op6XNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op6XNN(1, i); } },
+        { "op7XNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op7XNN(1, 3); } },
+        { "op8XY0", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XY0(1, 2); } },
+        { "op8XY2", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XY2(1, 2); } },
+        { "op8XY4", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XY4(1, 2); } },
+        { "op8XY5", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XY5(1, 2); } },
+        { "op8XY6", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XY6(1, 2); } },
+        { "op8XYE", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.op8XYE(1, 2); } },
+        { "opANNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opANNN(0x300); } },
+        { "opCXNN", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opCXNN(1, 0xFF); } },
+        { "opDXYN/1", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opDXYN(3, 4, 1); } },
+        { "opDXYN/5", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opDXYN(3, 4, 5); } },
+        { "opDXYN/8", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opDXYN(3, 4, 8); } },
+        { "opDXYN/15", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opDXYN(3, 4, 15); } },
+        { "opDXYN/15/aligned", [](Chip8 &c, unsigned int n) {
+            c.V[5] = 0;
+            for (unsigned int i = 0; i < n; i++) c.opDXYN(5, 4, 15); } },
+        { "opEX9E", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opEX9E(1); } },
+        { "opFX07", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX07(1); } },
+        { "opFX15", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX15(1); } },
+        { "opFX1E", [](Chip8 &c, unsigned int n) {
+            for (unsigned int i = 0; i < n; i++) { c.opFX1E(0); c.I &= ADDRESS_MASK; } } },
+        { "opFX29", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX29(1); } },
+        { "opFX33", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX33(1); } },
+        { "opFX55/0", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX55(0); } },
+        { "opFX55/F", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX55(0xF); } },
+        { "opFX65/F", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.opFX65(0xF); } },
+        // Decoding and dispatch around the handlers
+        { "runOpcode/8XY4", [](Chip8 &c, unsigned int n) {
+            c.opcode = 0x8124;
+            for (unsigned int i = 0; i < n; i++) c.runOpcode(); } },
+        { "emulateCycle", [](Chip8 &c, unsigned int n) { for (unsigned int i = 0; i < n; i++) c.emulateCycle(); } },
+    };
+
+    Chip8 *chip8 = new Chip8();
+
+    fprintf(out, "  \"micro\": [\n");
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    for (size_t b = 0; b < count; b++) {
+        std::vector<double> samples;
+        for (unsigned int r = 0; r < warmup + repetitions; r++) {
+            prepare(*chip8);
+            auto start = std::chrono::steady_clock::now();
+            benches[b].run(*chip8, MICRO_ITERATIONS);
+            auto end = std::chrono::steady_clock::now();
+            if (r >= warmup) {
+                samples.push_back(std::chrono::duration<double, std::nano>(end - start).count()
+                        / MICRO_ITERATIONS);
+            }
+        }
+
+        fprintf(out, "    {\"name\": %s, \"iterations\": %d, ",
+                jsonString(benches[b].name).c_str(), MICRO_ITERATIONS);
+        printStats(out, "ns_per_op", summarize(samples));
+        fprintf(out, "}%s\n", b + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    delete chip8;
+}
+
+/**
+ * @brief Outcome of one timed run of a ROM
+ */
+struct RomRun {
+    double seconds;
+    unsigned long long cycles;
+    unsigned long long allocations;
+    unsigned long long allocatedBytes;
+    unsigned long long gfxHash;
+    std::string error;
+};
+
+static void runRom(const std::string &path, Chip8Core core, unsigned long long cycles,
+        RomRun &run) {
+    Chip8 *chip8 = new Chip8();
+    unsigned long long allocationsBefore = allocations;
+    unsigned long long bytesBefore = allocatedBytes;
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        chip8->setClockMode(CHIP8_CLOCK_VIRTUAL);
+        chip8->setCore(core);
+        chip8->loadRom(path.c_str());
+
+        // Only the run itself is timed and counted, not loading
+        allocationsBefore = allocations;
+        bytesBefore = allocatedBytes;
+        start = std::chrono::steady_clock::now();
+
+        unsigned long long frame = 0;
+        while (chip8->getCycles() < cycles) {
+            unsigned int phase = frame / INPUT_HOLD_FRAMES;
+            for (int k = 0; k < KEYS; k++) {
+                chip8->key[k] = phase % 2 == 0 && k == (int) (phase / 2) % KEYS;
+            }
+            chip8->runCycles(std::min<unsigned long long>(CYCLES_PER_FRAME,
+                    cycles - chip8->getCycles()));
+            frame++;
+        }
+    } catch (const std::exception &e) {
+        run.error = e.what();
+        run.error.erase(run.error.find_last_not_of("\n") + 1);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    run.seconds = std::chrono::duration<double>(end - start).count();
+    run.cycles = chip8->getCycles();
+    run.allocations = allocations - allocationsBefore;
+    run.allocatedBytes = allocatedBytes - bytesBefore;
+    run.gfxHash = chip8->hashGfx();
+    delete chip8;
+}
+
+static std::vector<std::string> listRoms(const char *dir) {
+    std::vector<std::string> roms;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        throw FormattedException("Could not open directory %s\n", dir);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".rom") == 0) {
+            roms.push_back(name);
+        }
+    }
+    closedir(d);
+
+    std::sort(roms.begin(), roms.end());
+    return roms;
+}
+
+static const char *coreName(Chip8Core core) {
+    switch (core) {
+        case CHIP8_CORE_JIT:
+            return "jit";
+        case CHIP8_CORE_THREADED:
+            return "threaded";
+        case CHIP8_CORE_AOT:
+            return "aot";
+        default:
+            return "interpreter";
+    }
+}
+
+static void runMacro(FILE *out, const char *dir, unsigned long long cycles,
+        unsigned int repetitions, unsigned int warmup) {
+    std::vector<std::string> roms = listRoms(dir);
+    std::vector<Chip8Core> cores = { CHIP8_CORE_INTERPRETER, CHIP8_CORE_THREADED };
+    {
+        // Only benchmark the JIT where it runs
+        Chip8 probe;
+        try {
+            probe.setCore(CHIP8_CORE_JIT);
+            cores.push_back(CHIP8_CORE_JIT);
+        } catch (const std::exception &e) {
+            std::cerr << e.what();
+        }
+    }
+
+    fprintf(out, "  \"macro\": [\n");
+    for (size_t i = 0; i < roms.size(); i++) {
+        std::string path = std::string(dir) + "/" + roms[i];
+
+        for (size_t c = 0; c < cores.size(); c++) {
+            std::cerr << roms[i] << " " << coreName(cores[c]) << std::endl;
+
+            std::vector<double> nsPerInstruction;
+            std::vector<double> framesPerSecond;
+            RomRun run;
+            for (unsigned int r = 0; r < warmup + repetitions; r++) {
+                run = RomRun();
+                runRom(path, cores[c], cycles, run);
+                if (r >= warmup && run.cycles > 0 && run.seconds > 0) {
+                    nsPerInstruction.push_back(run.seconds * 1e9 / run.cycles);
+                    framesPerSecond.push_back(run.cycles / (double) CYCLES_PER_FRAME / run.seconds);
+                }
+            }
+            if (nsPerInstruction.empty()) {
+                nsPerInstruction.push_back(0);
+                framesPerSecond.push_back(0);
+            }
+
+            fprintf(out, "    {\"rom\": %s, \"core\": \"%s\", \"cycles\": %llu, ",
+                    jsonString(roms[i]).c_str(),
+                    coreName(cores[c]), run.cycles);
+            printStats(out, "ns_per_instruction", summarize(nsPerInstruction));
+            fprintf(out, ", ");
+            printStats(out, "frames_per_second", summarize(framesPerSecond));
+            fprintf(out, ", \"allocations\": %llu, \"allocated_bytes\": %llu, "
+                    "\"gfx_hash\": \"%016llx\", \"error\": %s}%s\n",
+                    run.allocations, run.allocatedBytes, run.gfxHash,
+                    run.error.empty() ? "null" : jsonString(run.error).c_str(),
+                    i + 1 < roms.size() || c + 1 < cores.size() ? "," : "");
+        }
+    }
+    fprintf(out, "  ]\n");
+}
+
+static void usage() {
+    std::cerr << "Usage: chip8-bench [-r repetitions] [-w warmup] [-c cycles] "
+        "[-o output.json] [rom_directory]" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int repetitions = DEFAULT_REPETITIONS;
+    unsigned int warmup = DEFAULT_WARMUP;
+    unsigned long long cycles = DEFAULT_CYCLES;
+    const char *output = NULL;
+    const char *dir = "roms";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:c:o:")) != -1) {
+        switch (opt) {
+            case 'r':
+                repetitions = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'w':
+                warmup = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'c':
+                cycles = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    if (optind < argc - 1 || repetitions == 0) {
+        usage();
+        return -1;
+    }
+    if (optind == argc - 1) {
+        dir = argv[optind];
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            std::cerr << "Could not open " << output << std::endl;
+            return -1;
+        }
+    }
+
+    int status = 0;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"compiler\": %s,\n", jsonString(__VERSION__).c_str());
+    fprintf(out, "  \"repetitions\": %u,\n", repetitions);
+    fprintf(out, "  \"warmup\": %u,\n", warmup);
+    Chip8Bench::runMicro(out, repetitions, warmup);
+    try {
+        runMacro(out, dir, cycles, repetitions, warmup);
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        fprintf(out, "  \"macro\": []\n");
+        status = 1;
+    }
+    fprintf(out, "}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return status;
+}
@@ -3,10 +3,13 @@
  * @brief Implememntation of the CHIP8 memory and emulation
  */
 
+#include <algorithm>
+
 #include "chip8.h"
+#include "chip8_aot.h"
+#include "jit.h"
 
 // #define DEBUG
-#define WARNING
 
 const unsigned char CHIP8_FONTSET[FONTSET_LEN] = { 
     0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
@@ -27,6 +30,96 @@ const unsigned char CHIP8_FONTSET[FONTSET_LEN] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80   // F
 };
 
+const unsigned char CHIP8_BIG_FONTSET[BIG_FONTSET_LEN] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,  // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,  // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,  // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,  // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,  // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,  // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,  // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,  // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,  // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,  // 9
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,  // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC,  // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C,  // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,  // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF,  // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0   // F
+};
+
+#ifdef CHIP8_PROFILE
+const char *const CHIP8_OPCODE_CLASS_NAMES[CHIP8_OPCODE_CLASSES] = {
+    "0NNN", "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN",
+    "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+    "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "FX07",
+    "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65",
+    // SUPER-CHIP
+    "00CN", "00FB", "00FC", "00FD", "00FE", "00FF", "FX30", "FX75", "FX85",
+    "invalid"
+};
+
+#define OPCODE_CLASS_INVALID (CHIP8_OPCODE_CLASSES - 1)
+
+unsigned int chip8OpcodeClass(unsigned short opcode) {
+    // Classes follow the order of the opcode table, so most are an offset
+    // from the first class of their leading nibble. SUPER-CHIP classes
+    // follow FX65.
+    switch (opcode >> 12) {
+        case 0x0:
+            if ((opcode & 0xFFF0) == 0x00C0) {
+                return 35;
+            }
+            if (opcode >= 0x00FB && opcode <= 0x00FF) {
+                return 36 + opcode - 0x00FB;
+            }
+            return opcode == 0x00E0 ? 1 : opcode == 0x00EE ? 2 : 0;
+
+        case 0x8:
+            if ((opcode & 0xF) <= 0x7) {
+                return 10 + (opcode & 0xF);
+            }
+            return (opcode & 0xF) == 0xE ? 18 : OPCODE_CLASS_INVALID;
+
+        case 0xE:
+            switch (opcode & 0xFF) {
+                case 0x9E: return 24;
+                case 0xA1: return 25;
+                default: return OPCODE_CLASS_INVALID;
+            }
+
+        case 0xF:
+            switch (opcode & 0xFF) {
+                case 0x07: return 26;
+                case 0x0A: return 27;
+                case 0x15: return 28;
+                case 0x18: return 29;
+                case 0x1E: return 30;
+                case 0x29: return 31;
+                case 0x33: return 32;
+                case 0x55: return 33;
+                case 0x65: return 34;
+                case 0x30: return 41;
+                case 0x75: return 42;
+                case 0x85: return 43;
+                default: return OPCODE_CLASS_INVALID;
+            }
+
+        case 0x9:
+        case 0xA:
+        case 0xB:
+        case 0xC:
+        case 0xD:
+            return 19 + (opcode >> 12) - 0x9;
+
+        default:
+            // 1NNN to 7XNN
+            return 3 + (opcode >> 12) - 0x1;
+    }
+}
+#endif
+
 int timediff_ms(struct timeval *end, struct timeval *start) {
     int diff = (end->tv_sec - start->tv_sec) * 1000 + 
                (end->tv_usec - start->tv_usec) / 1000;
@@ -39,8 +132,119 @@ int timediff_us(struct timeval *end, struct timeval *start) {
     return diff;
 }
 
+bool chip8ParseQuirks(const char *text, unsigned int *quirks) {
+    static const struct {
+        const char *name;
+        unsigned int quirks;
+    } names[] = {
+        { "none", 0 },
+        { "cosmac", CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_MEMORY_I | CHIP8_QUIRK_CLIP |
+            CHIP8_QUIRK_VF_RESET },
+        { "schip", CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP },
+        { "shift_vy", CHIP8_QUIRK_SHIFT_VY },
+        { "memory_i", CHIP8_QUIRK_MEMORY_I },
+        { "jump_vx", CHIP8_QUIRK_JUMP_VX },
+        { "clip", CHIP8_QUIRK_CLIP },
+        { "vf_reset", CHIP8_QUIRK_VF_RESET }
+    };
+
+    // Profiles and single quirks are looked up alike, so profiles can be
+    // listed too
+    unsigned int result = 0;
+    const char *start = text;
+    while (true) {
+        const char *end = strchr(start, ',');
+        size_t length = end != NULL ? (size_t) (end - start) : strlen(start);
+
+        bool found = false;
+        for (const auto &entry : names) {
+            if (strlen(entry.name) == length && strncmp(entry.name, start, length) == 0) {
+                result |= entry.quirks;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+
+        if (end == NULL) {
+            break;
+        }
+        start = end + 1;
+    }
+
+    *quirks = result;
+    return true;
+}
+
+// Blocks shared with forks. refs counts the instances holding a block, the
+// last one to release it deletes it.
+template <typename T>
+static T *shareBlock(T *block) {
+    block->refs.fetch_add(1, std::memory_order_relaxed);
+    return block;
+}
+
+template <typename T>
+static void releaseBlock(T *block) {
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete block;
+    }
+}
+
+// Acquire pairs with the release of the other holders, so nothing they still
+// read is written once they let go
+template <typename T>
+static bool isShared(const T *block) {
+    return block->refs.load(std::memory_order_acquire) > 1;
+}
+
+static void releasePageTable(Chip8PageTable *table) {
+    if (table->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (int i = 0; i < CHIP8_PAGES; i++) {
+            releaseBlock(table->pages[i]);
+        }
+        delete table;
+    }
+}
+
+static Chip8Page *newPage(const Chip8Page *source) {
+    Chip8Page *page = new Chip8Page;
+    if (source != NULL) {
+        // Decoded instructions stay valid with the bytes they were decoded from
+        memcpy(page->bytes, source->bytes, sizeof(page->bytes));
+        memcpy(page->ops, source->ops, sizeof(page->ops));
+    } else {
+        memset(page->bytes, 0, sizeof(page->bytes));
+        memset(page->ops, 0, sizeof(page->ops));
+    }
+    page->refs.store(1, std::memory_order_relaxed);
+    return page;
+}
+
+template <int WORDS>
+static Chip8Display<WORDS> *newDisplay(const Chip8Display<WORDS> *source) {
+    Chip8Display<WORDS> *display = new Chip8Display<WORDS>;
+    if (source != NULL) {
+        memcpy(display->words, source->words, sizeof(display->words));
+    } else {
+        memset(display->words, 0, sizeof(display->words));
+    }
+    display->refs.store(1, std::memory_order_relaxed);
+    return display;
+}
+
+// Source of zero bytes for clearing memory
+static const unsigned char ZEROS[MEMORY] = { 0 };
+
 Chip8::Chip8() {
     pc = ROM_START;
+
+    // Interpret until another core is selected
+    core = CHIP8_CORE_INTERPRETER;
+    jit = NULL;
+    aot = NULL;
  
     // Reset variables
     opcode = 0;
@@ -48,110 +252,991 @@ Chip8::Chip8() {
     sp = 0;
 
     // Clear display
-    std::fill(gfx, gfx + sizeof(gfx), 0);
+    gfx = newDisplay<GFX_Y>(NULL);
     drawFlag = true;
 
+    // CHIP-8 instruction set until another mode is selected
+    mode = CHIP8_MODE_CHIP8;
+    quirks = 0;
+    hires = false;
+    schipGfx = newDisplay<SCHIP_GFX_WORDS>(NULL);
+    memset(rplFlags, 0, sizeof(rplFlags));
+
     // Clear stack
-    std::fill(stack, stack + sizeof(stack), 0);
+    std::fill(stack, stack + STACK, 0);
 
     // Clear registers
     std::fill(V, V + sizeof(V), 0);
 
     // Clear memory
-    std::fill(memory, memory + sizeof(memory), 0);
+    pageTable = new Chip8PageTable;
+    pageTable->refs.store(1, std::memory_order_relaxed);
+    for (int i = 0; i < CHIP8_PAGES; i++) {
+        pages[i] = pageTable->pages[i] = newPage(NULL);
+    }
 
     // Load font in memory
-    memcpy(memory, &CHIP8_FONTSET, FONTSET_LEN);
+    writeMemory(0, CHIP8_FONTSET, FONTSET_LEN);
+
+    // Reset clock
+    clockMode = CHIP8_CLOCK_REALTIME;
+    cycles = 0;
+    cyclesPerTick = CYCLES_PER_FRAME;
+    tickBase = 0;
+    cycleBase = 0;
+    ticks = 0;
+    gettimeofday(&clockPrev, NULL);
 
     // Reset timers
-    delayTimer = 0;
-    soundTimer = 0;
-    gettimeofday(&clockPrev, NULL);
+    delayTimerEnd = 0;
+    soundTimerEnd = 0;
+    soundActive = false;
+    soundEventCount = 0;
 
     // Clear keypad
     std::fill(key, key + sizeof(key), 0);
 
     // Set random seed
-    srand(0);
+    setSeed(0);
+
+    std::fill(fusions, fusions + CHIP8_FUSIONS, 0);
+
+#ifdef CHIP8_PROFILE
+    resetProfile();
+#endif
+}
+
+Chip8::Chip8(const Chip8 &parent, ForkTag) {
+    // Registers and clock are copied, memory and displays shared
+    pc = parent.pc;
+    opcode = parent.opcode;
+    memcpy(V, parent.V, sizeof(V));
+    I = parent.I;
+    memcpy(stack, parent.stack, sizeof(stack));
+    sp = parent.sp;
+
+    delayTimerEnd = parent.delayTimerEnd;
+    soundTimerEnd = parent.soundTimerEnd;
+    soundActive = parent.soundActive;
+    soundEventCount = 0;
+
+    clockMode = parent.clockMode;
+    cycles = parent.cycles;
+    cyclesPerTick = parent.cyclesPerTick;
+    tickBase = parent.tickBase;
+    cycleBase = parent.cycleBase;
+    ticks = parent.ticks;
+    clockPrev = parent.clockPrev;
+    rngState = parent.rngState;
+
+    // A JIT or AOT engine per fork would cost more than most branches run
+    core = parent.core == CHIP8_CORE_JIT || parent.core == CHIP8_CORE_AOT ?
+        CHIP8_CORE_INTERPRETER : parent.core;
+    jit = NULL;
+    aot = NULL;
+
+    pageTable = shareBlock(parent.pageTable);
+    memcpy(pages, parent.pages, sizeof(pages));
+    gfx = shareBlock(parent.gfx);
+    drawFlag = parent.drawFlag;
+
+    mode = parent.mode;
+    quirks = parent.quirks;
+    hires = parent.hires;
+    schipGfx = shareBlock(parent.schipGfx);
+    memcpy(rplFlags, parent.rplFlags, sizeof(rplFlags));
+
+    memcpy(key, parent.key, sizeof(key));
+
+    // Counters start over, like the profile
+    std::fill(fusions, fusions + CHIP8_FUSIONS, 0);
+
+#ifdef CHIP8_PROFILE
+    resetProfile();
+#endif
 }
 
 Chip8::~Chip8() {
+    delete jit;
+    delete aot;
 
+    releasePageTable(pageTable);
+    releaseBlock(gfx);
+    releaseBlock(schipGfx);
+}
+
+std::unique_ptr<Chip8> Chip8::fork() const {
+    return std::unique_ptr<Chip8>(new Chip8(*this, ForkTag()));
+}
+
+bool Chip8::ownsPage(const Chip8Page *page) const {
+    return !isShared(pageTable) && !isShared(page);
+}
+
+Chip8Page *Chip8::writablePage(unsigned short address) {
+    if (isShared(pageTable)) {
+        // Copy on write of the table, all pages are now held once more
+        Chip8PageTable *table = new Chip8PageTable;
+        table->refs.store(1, std::memory_order_relaxed);
+        for (int i = 0; i < CHIP8_PAGES; i++) {
+            table->pages[i] = shareBlock(pages[i]);
+        }
+        releasePageTable(pageTable);
+        pageTable = table;
+    }
+
+    int index = address / CHIP8_PAGE_SIZE;
+    if (isShared(pages[index])) {
+        // Copy on write of the page
+        Chip8Page *copy = newPage(pages[index]);
+        releaseBlock(pages[index]);
+        pages[index] = pageTable->pages[index] = copy;
+    }
+    return pages[index];
+}
+
+void Chip8::writeMemory(unsigned short address, unsigned char value) {
+    writablePage(address)->bytes[address % CHIP8_PAGE_SIZE] = value;
+    invalidateCode(address);
+}
+
+void Chip8::writeMemory(unsigned short address, const unsigned char *data, size_t size) {
+    // Page by page. Pages that do not change stay shared and keep their
+    // decoded code.
+    while (size > 0) {
+        unsigned int offset = address % CHIP8_PAGE_SIZE;
+        size_t length = std::min(size, (size_t) (CHIP8_PAGE_SIZE - offset));
+
+        if (memcmp(pages[address / CHIP8_PAGE_SIZE]->bytes + offset, data, length) != 0) {
+            memcpy(writablePage(address)->bytes + offset, data, length);
+            for (size_t i = 0; i < length; i++) {
+                invalidateCode(address + i);
+            }
+        }
+
+        address += length;
+        data += length;
+        size -= length;
+    }
+}
+
+inline uint64_t *Chip8::writableGfx() {
+    if (isShared(gfx)) {
+        Chip8Display<GFX_Y> *copy = newDisplay(gfx);
+        releaseBlock(gfx);
+        gfx = copy;
+    }
+    return gfx->words;
+}
+
+inline uint64_t *Chip8::writableSchipGfx() {
+    if (isShared(schipGfx)) {
+        Chip8Display<SCHIP_GFX_WORDS> *copy = newDisplay(schipGfx);
+        releaseBlock(schipGfx);
+        schipGfx = copy;
+    }
+    return schipGfx->words;
 }
 
 void Chip8::loadRom(const char *path) {
     // Open ROM file in binary mode
     std::ifstream infile(path, std::ios::in | std::ios::binary | std::ios::ate);
- 
+    if (!infile) {
+        throw FormattedException("Could not open ROM file: %s\n", path);
+    }
+
     // Check that ROM file size fits
     int length = infile.tellg();
     infile.seekg(infile.beg);
 
     if (length <= ROM_END - ROM_START) {
-        // Clear previous ROM
-        std::fill(memory + ROM_START, memory + ROM_END, 0);
-        
-        // Write ROM data to memory
-        char *buffer = new char[length];
-        infile.read(buffer, length); 
-        memcpy(memory + ROM_START, buffer, length);
+        // Read into a buffer the size of the ROM region
+        unsigned char buffer[ROM_END - ROM_START];
+        infile.read((char *) buffer, length);
+        loadRom(buffer, length);
     } else {
         // ROM too big
         throw std::invalid_argument("ROM file too big");
     }
 }
 
+void Chip8::loadRom(const unsigned char *data, size_t size) {
+    if (size > ROM_END - ROM_START) {
+        // ROM too big
+        throw std::invalid_argument("ROM file too big");
+    }
+
+    // Clear previous ROM
+    writeMemory(ROM_START, ZEROS, ROM_END - ROM_START);
+
+    // Write ROM data to memory
+    if (size > 0) {
+        writeMemory(ROM_START, data, size);
+    }
+
+    if (aot != NULL) {
+        aot->select();
+    }
+}
+
 void Chip8::emulateCycle() {
+    step(0);
+}
+
+inline void Chip8::step(unsigned long long end) {
     // Make sure program counter is within bounds
     if (pc > ROM_END || pc < ROM_START) {
         throw FormattedException("Program Counter out of range: %X\n", pc);
     }
 
-    // Get opcode
-    // Opcode is 2 bytes at the pc
-    opcode = memory[pc] << 8 | memory[pc + 1];
+#ifdef CHIP8_PROFILE
+    unsigned short address = pc;
+#endif
+
+    if (pc % CHIP8_PAGE_SIZE == CHIP8_PAGE_SIZE - 1) {
+        // An instruction across two pages is not cached, decode on every
+        // execution
+        // Opcode is 2 bytes at the pc
+        opcode = readMemory(pc) << 8 | readMemory(pc + 1);
 
 #ifdef DEBUG
-    printf("PC: %X, Opcode: %X\n", pc, opcode);
+        printf("PC: %X, Opcode: %X\n", pc, opcode);
 #endif
 
-    // Reset drawFlag
-    //drawFlag = false;
+        runOpcode();
+    } else {
+        // Look up the decoded instruction, decoding it on first execution.
+        // Shared pages are read-only, so the decode is only kept once this
+        // instance holds the page alone. The handlers take the operands
+        // before they run, so a write that copies or frees the page while
+        // one runs is fine.
+        Chip8Page *page = pages[pc / CHIP8_PAGE_SIZE];
+        const DecodedOp *cached = &page->ops[pc % CHIP8_PAGE_SIZE];
+        DecodedOp decoded;
+        if (cached->handler == NULL) {
+            unsigned short word = readMemory(pc) << 8 | readMemory(pc + 1);
+            if (ownsPage(page)) {
+                decode(word, quirks, page->ops[pc % CHIP8_PAGE_SIZE]);
+#ifndef CHIP8_NO_FUSION
+                fuse(pc);
+#endif
+            } else {
+                decode(word, quirks, decoded);
+                cached = &decoded;
+            }
+        }
+        const DecodedOp &op = *cached;
 
-    // Execute opcode
-    runOpcode();
+        // Waits start with FX07, FX0A or 00FD, the handler is checked first
+        // so nothing else pays for the test
+        if ((op.handler == execFX07 || op.handler == execFX0A || op.handler == exec00FD) &&
+                skipIdle(end) > 0) {
+            return;
+        }
+        opcode = op.opcode;
+
+#ifdef DEBUG
+        printf("PC: %X, Opcode: %X\n", pc, opcode);
+#endif
+
+        // Execute opcode
+        op.handler(*this, op);
+    }
+
+#ifdef CHIP8_PROFILE
+    profile.addresses[address]++;
+    profile.opcodes[chip8OpcodeClass(opcode)]++;
+#endif
 
+    cycles++;
+    advanceClock();
+}
+
+void Chip8::advanceClock() {
     // Timers
-    struct timeval clockNow;
-    gettimeofday(&clockNow, NULL);
+    if (clockMode == CHIP8_CLOCK_REALTIME) {
+        struct timeval clockNow;
+        gettimeofday(&clockNow, NULL);
 
-    if (timediff_ms(&clockNow, &clockPrev) >= CLOCK_RATE_MS) {
-        // Count down 1 each timer
-        if (delayTimer > 0) {
-            delayTimer--;
+        if (timediff_ms(&clockNow, &clockPrev) >= CLOCK_RATE_MS) {
+            ticks++;
+            clockPrev = clockNow;
         }
+    }
 
-        if (soundTimer > 0) {
-            // Decrement soundTimer and check the value after decrement
-            if (--soundTimer == 0) {
-                // Sound buzzer
-#ifdef WARNING
-                printf("BEEEEEEEEP\n");
+    updateSound();
+}
+
+void Chip8::updateSound() {
+    if (soundActive && currentTick() >= soundTimerEnd) {
+        // Sound timer reached 0. On the virtual clock the instruction at
+        // which that happened is known exactly, even if this runs later.
+        unsigned long long end = cycles;
+        if (clockMode == CHIP8_CLOCK_VIRTUAL && soundTimerEnd >= tickBase) {
+            end = std::min(end, cycleBase + (soundTimerEnd - tickBase) * cyclesPerTick);
+        }
+        soundActive = false;
+        pushSoundEvent(end, false);
+    }
+}
+
+void Chip8::pushSoundEvent(unsigned long long cycle, bool on) {
+    if (soundEventCount == CHIP8_SOUND_EVENTS) {
+        // Nobody is collecting the events quickly enough, keep the newest
+        soundEventCount--;
+    }
+    soundEvents[soundEventCount].cycle = cycle;
+    soundEvents[soundEventCount].on = on;
+    soundEventCount++;
+}
+
+bool Chip8::isSoundOn() const {
+    return soundActive;
+}
+
+unsigned int Chip8::takeSoundEvents(Chip8SoundEvent *events) {
+    unsigned int count = soundEventCount;
+    std::copy(soundEvents, soundEvents + count, events);
+    soundEventCount = 0;
+    return count;
+}
+
+void Chip8::runCycles(unsigned long long cycles) {
+    unsigned long long end = this->cycles + cycles;
+
+#ifndef CHIP8_PROFILE
+    // Translated blocks and the threaded core are not instrumented,
+    // profiling builds interpret
+    if (core == CHIP8_CORE_JIT) {
+        jit->run(cycles);
+        return;
+    }
+    if (core == CHIP8_CORE_THREADED) {
+        runThreaded(end);
+        return;
+    }
+    if (core == CHIP8_CORE_AOT) {
+        aot->run(cycles);
+        return;
+    }
 #endif
+
+    while (this->cycles < end) {
+        step(end);
+    }
+}
+
+bool Chip8::isIdle() const {
+    if (pc < ROM_START || pc > ROM_END || soundActive) {
+        return false;
+    }
+    if (mode == CHIP8_MODE_SCHIP && readMemory(pc) == 0x00 && readMemory(pc + 1) == 0xFD) {
+        // Halted by 00FD for good
+        return true;
+    }
+    if ((readMemory(pc) & 0xF0) != 0xF0 || readMemory(pc + 1) != 0x0A) {
+        return false;
+    }
+    for (int i = 0; i < KEYS; i++) {
+        if (key[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned long long Chip8::skipIdle(unsigned long long end) {
+    // Real time ticks depend on how long instructions take, so only virtual
+    // time can be skipped
+    if (clockMode != CHIP8_CLOCK_VIRTUAL || this->cycles >= end ||
+            pc < ROM_START || pc > ROM_END) {
+        return 0;
+    }
+
+    unsigned short first = readMemory(pc) << 8 | readMemory(pc + 1);
+    unsigned long long skipped;
+
+    if (first == 0x00FD && mode == CHIP8_MODE_SCHIP) {
+        // 00FD stays on itself and changes nothing, only the clock runs.
+        // In CHIP8_MODE_CHIP8 it is an error the handler reports.
+        skipped = end - this->cycles;
+        opcode = first;
+#ifdef CHIP8_PROFILE
+        profile.addresses[pc] += skipped;
+        profile.opcodes[chip8OpcodeClass(first)] += skipped;
+#endif
+    } else if ((first & 0xF0FF) == 0xF00A) {
+        // FX0A only completes when a key is down, and keys do not change
+        // during runCycles()
+        for (int i = 0; i < KEYS; i++) {
+            if (key[i]) {
+                return 0;
             }
         }
-        clockPrev = clockNow;
+        skipped = end - this->cycles;
+        opcode = first;
+#ifdef CHIP8_PROFILE
+        profile.addresses[pc] += skipped;
+        profile.opcodes[chip8OpcodeClass(first)] += skipped;
+        profile.keyWaits += skipped;
+#endif
+    } else {
+        // FX07; 3X00; 1NNN back to the FX07 reads the delay timer until it
+        // reaches 0. Each iteration only changes VX, to the timer value.
+        if (pc + 6 > ROM_END + 1) {
+            return 0;
+        }
+        unsigned char X = (first >> 8) & 0xF;
+        unsigned short second = readMemory(pc + 2) << 8 | readMemory(pc + 3);
+        unsigned short third = readMemory(pc + 4) << 8 | readMemory(pc + 5);
+        if ((first & 0xF0FF) != 0xF007 || second != (0x3000 | X << 8) ||
+                third != (0x1000 | pc)) {
+            return 0;
+        }
+
+        // First cycle at which the timer reads 0
+        unsigned long long zeroCycle = 0;
+        if (delayTimerEnd > tickBase) {
+            zeroCycle = cycleBase + (delayTimerEnd - tickBase) * cyclesPerTick;
+        }
+        if (zeroCycle <= this->cycles) {
+            return 0;
+        }
+
+        // Whole iterations before the one that reads 0 and exits, within
+        // the budget
+        unsigned long long iterations = (zeroCycle - this->cycles + 2) / 3;
+        iterations = std::min(iterations, (end - this->cycles) / 3);
+        if (iterations == 0) {
+            return 0;
+        }
+
+        skipped = iterations * 3;
+        // The last skipped FX07 ran 3 cycles before the end of the skip
+        unsigned long long last = this->cycles + skipped - 3;
+        V[X] = delayTimerEnd - (tickBase + (last - cycleBase) / cyclesPerTick);
+        opcode = third;
+#ifdef CHIP8_PROFILE
+        profile.addresses[pc] += iterations;
+        profile.addresses[pc + 2] += iterations;
+        profile.addresses[pc + 4] += iterations;
+        profile.opcodes[chip8OpcodeClass(first)] += iterations;
+        profile.opcodes[chip8OpcodeClass(second)] += iterations;
+        profile.opcodes[chip8OpcodeClass(third)] += iterations;
+#endif
+    }
+
+    this->cycles += skipped;
+    // Sound the buzzer if the sound timer ran out during the skip
+    advanceClock();
+    return skipped;
+}
+
+void Chip8::setCore(Chip8Core core) {
+    if (core == CHIP8_CORE_JIT && jit == NULL) {
+        if (!Chip8Jit::supported()) {
+            throw FormattedException("JIT is not supported on this host\n");
+        }
+        jit = new Chip8Jit(*this);
+    }
+    if (core == CHIP8_CORE_AOT && aot == NULL) {
+        if (!Chip8Aot::available()) {
+            throw FormattedException("No ROM was translated ahead of time into this build\n");
+        }
+        aot = new Chip8Aot(*this);
     }
+    this->core = core;
+}
+
+unsigned long long Chip8::currentTick() const {
+    if (clockMode == CHIP8_CLOCK_VIRTUAL) {
+        return tickBase + (cycles - cycleBase) / cyclesPerTick;
+    }
+    return ticks;
+}
+
+unsigned char Chip8::timerValue(unsigned long long end) const {
+    unsigned long long now = currentTick();
+    return end > now ? end - now : 0;
+}
+
+void Chip8::setClockMode(Chip8Clock mode) {
+    // Keep the tick count continuous so stored timer deadlines stay valid
+    if (mode == CHIP8_CLOCK_VIRTUAL) {
+        tickBase = currentTick();
+        cycleBase = cycles;
+    } else {
+        ticks = currentTick();
+        gettimeofday(&clockPrev, NULL);
+    }
+    clockMode = mode;
+}
+
+void Chip8::setCyclesPerTick(unsigned int cycles) {
+    if (cycles == 0) {
+        throw std::invalid_argument("Cycles per tick must be at least 1");
+    }
+
+    // Restart the current tick with the new rate
+    tickBase = currentTick();
+    cycleBase = this->cycles;
+    cyclesPerTick = cycles;
+}
+
+unsigned int Chip8::getCyclesPerTick() const {
+    return cyclesPerTick;
+}
+
+void Chip8::setSeed(unsigned int seed) {
+    rngState = seed;
+}
+
+unsigned char Chip8::nextRandom() {
+    // 32 bit LCG, the high bits have the longest period
+    rngState = rngState * 1103515245 + 12345;
+    return (rngState >> 16) & 0xFF;
+}
+
+unsigned long long Chip8::getCycles() const {
+    return cycles;
+}
+
+const unsigned long long *Chip8::getFusions() const {
+    return fusions;
+}
+
+// Save state fields are little endian regardless of the host
+static void putBytes(unsigned char *&p, unsigned long long value, int bytes) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &value, bytes);
+    p += bytes;
+#else
+    for (int i = 0; i < bytes; i++) {
+        *p++ = value >> (8 * i);
+    }
+#endif
+}
+
+static unsigned long long getBytes(const unsigned char *&p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (unsigned long long) *p++ << (8 * i);
+    }
+    return value;
+}
+
+static bool pageUsed(const unsigned char *page) {
+    uint64_t bits = 0;
+    for (int i = 0; i < CHIP8_STATE_PAGE; i += 8) {
+        uint64_t word;
+        memcpy(&word, page + i, 8);
+        bits |= word;
+    }
+    return bits != 0;
+}
+
+size_t Chip8::saveState(unsigned char *buffer, size_t size) const {
+    // Find the memory pages to store first, so the size is known up front
+    unsigned int used = 0;
+    int pageCount = 0;
+    for (int i = 0; i < CHIP8_PAGES; i++) {
+        if (pageUsed(pages[i]->bytes)) {
+            used |= 1 << i;
+            pageCount++;
+        }
+    }
+
+    size_t length = CHIP8_STATE_FIXED_SIZE + pageCount * CHIP8_STATE_PAGE;
+    if (mode == CHIP8_MODE_SCHIP) {
+        length += CHIP8_STATE_SCHIP_GFX_SIZE;
+    }
+    if (size < length) {
+        throw FormattedException("Save state needs %zu bytes, buffer has %zu\n",
+                length, size);
+    }
+
+    unsigned char *p = buffer;
+    memcpy(p, "C8ST", 4);
+    p += 4;
+    putBytes(p, CHIP8_STATE_VERSION, 1);
+    putBytes(p, mode, 1);
+    putBytes(p, quirks, 1);
+
+    // CPU
+    putBytes(p, pc, 2);
+    putBytes(p, opcode, 2);
+    putBytes(p, I, 2);
+    putBytes(p, sp, 1);
+    memcpy(p, V, REGISTERS);
+    p += REGISTERS;
+    for (int i = 0; i < STACK; i++) {
+        putBytes(p, stack[i], 2);
+    }
+
+    // Clock and timers
+    putBytes(p, clockMode, 1);
+    putBytes(p, cycles, 8);
+    putBytes(p, cyclesPerTick, 4);
+    putBytes(p, tickBase, 8);
+    putBytes(p, cycleBase, 8);
+    putBytes(p, ticks, 8);
+    putBytes(p, delayTimerEnd, 8);
+    putBytes(p, soundTimerEnd, 8);
+    putBytes(p, soundActive, 1);
+
+    // Random number generator and keypad
+    putBytes(p, rngState, 4);
+    unsigned int keys = 0;
+    for (int i = 0; i < KEYS; i++) {
+        keys |= key[i] << i;
+    }
+    putBytes(p, keys, 2);
+
+    // SUPER-CHIP resolution and flags
+    putBytes(p, hires, 1);
+    memcpy(p, rplFlags, RPL_FLAGS);
+    p += RPL_FLAGS;
+
+    // Display, one row per 8 bytes
+    for (int y = 0; y < GFX_Y; y++) {
+        putBytes(p, gfx->words[y], 8);
+    }
+
+    // Memory pages that are not all zero
+    putBytes(p, used, 2);
+    for (int i = 0; i < CHIP8_PAGES; i++) {
+        if (used & (1 << i)) {
+            memcpy(p, pages[i]->bytes, CHIP8_STATE_PAGE);
+            p += CHIP8_STATE_PAGE;
+        }
+    }
+
+    // SUPER-CHIP display, 8 bytes per half row
+    if (mode == CHIP8_MODE_SCHIP) {
+        for (int i = 0; i < SCHIP_GFX_WORDS; i++) {
+            putBytes(p, schipGfx->words[i], 8);
+        }
+    }
+
+    return p - buffer;
+}
+
+void Chip8::loadState(const unsigned char *buffer, size_t size) {
+    // Validate everything before touching the machine. Version 2 has no
+    // quirks, version 1 no mode, SUPER-CHIP resolution or flags either.
+    if (size < CHIP8_STATE_V1_FIXED_SIZE || memcmp(buffer, "C8ST", 4) != 0) {
+        throw FormattedException("Not a save state\n");
+    }
+    unsigned int version = buffer[4];
+    if (version < 1 || version > CHIP8_STATE_VERSION) {
+        throw FormattedException("Unsupported save state version %u\n", version);
+    }
+    size_t fixedSize = version == 1 ? CHIP8_STATE_V1_FIXED_SIZE :
+        version == 2 ? CHIP8_STATE_V2_FIXED_SIZE : CHIP8_STATE_FIXED_SIZE;
+    if (size < fixedSize) {
+        throw FormattedException("Not a save state\n");
+    }
+
+    const unsigned char *p = buffer + 5;
+    unsigned int stateMode = CHIP8_MODE_CHIP8;
+    if (version >= 2) {
+        stateMode = getBytes(p, 1);
+        if (stateMode > CHIP8_MODE_SCHIP) {
+            throw FormattedException("Save state has an invalid mode %u\n", stateMode);
+        }
+    }
+    unsigned int stateQuirks = 0;
+    if (version >= 3) {
+        stateQuirks = getBytes(p, 1);
+        if (stateQuirks & ~CHIP8_QUIRKS_ALL) {
+            throw FormattedException("Save state has invalid quirks 0x%X\n", stateQuirks);
+        }
+    }
+    const unsigned char *cpu = p;
+
+    p = buffer + fixedSize - 2;
+    unsigned int used = getBytes(p, 2);
+    size_t length = fixedSize + __builtin_popcount(used) * CHIP8_STATE_PAGE;
+    if (stateMode == CHIP8_MODE_SCHIP) {
+        length += CHIP8_STATE_SCHIP_GFX_SIZE;
+    }
+    if (size != length) {
+        throw FormattedException("Save state is %zu bytes, expected %zu\n", size, length);
+    }
+
+    p = cpu;
+    unsigned short statePc = getBytes(p, 2);
+    unsigned short stateOpcode = getBytes(p, 2);
+    unsigned short stateI = getBytes(p, 2);
+    unsigned short stateSp = getBytes(p, 1);
+    if (stateSp > STACK) {
+        throw FormattedException("Save state stack pointer out of range: %d\n", stateSp);
+    }
+    const unsigned char *registers = p;
+    p += REGISTERS;
+    const unsigned char *stackData = p;
+    p += 2 * STACK;
+
+    unsigned int stateClockMode = getBytes(p, 1);
+    unsigned long long stateCycles = getBytes(p, 8);
+    unsigned int stateCyclesPerTick = getBytes(p, 4);
+    if (stateClockMode > CHIP8_CLOCK_VIRTUAL || stateCyclesPerTick == 0) {
+        throw FormattedException("Save state has an invalid clock\n");
+    }
+
+    // CPU
+    pc = statePc;
+    opcode = stateOpcode;
+    I = stateI;
+    sp = stateSp;
+    memcpy(V, registers, REGISTERS);
+    for (int i = 0; i < STACK; i++) {
+        stack[i] = getBytes(stackData, 2);
+    }
+
+    // Clock and timers. Wall clock time is not saved, the current tick
+    // restarts now.
+    clockMode = (Chip8Clock) stateClockMode;
+    cycles = stateCycles;
+    cyclesPerTick = stateCyclesPerTick;
+    tickBase = getBytes(p, 8);
+    cycleBase = getBytes(p, 8);
+    ticks = getBytes(p, 8);
+    gettimeofday(&clockPrev, NULL);
+    delayTimerEnd = getBytes(p, 8);
+    soundTimerEnd = getBytes(p, 8);
+    soundActive = getBytes(p, 1);
+    soundEventCount = 0;
+
+    // Random number generator and keypad
+    rngState = getBytes(p, 4);
+    unsigned int keys = getBytes(p, 2);
+    for (int i = 0; i < KEYS; i++) {
+        key[i] = (keys >> i) & 1;
+    }
+
+    // Instruction set. Decoded code only has to go if the quirks change.
+    setQuirks(stateQuirks);
+
+    // SUPER-CHIP resolution and flags
+    mode = (Chip8Mode) stateMode;
+    if (version >= 2) {
+        hires = getBytes(p, 1);
+        memcpy(rplFlags, p, RPL_FLAGS);
+        p += RPL_FLAGS;
+    } else {
+        hires = false;
+        memset(rplFlags, 0, sizeof(rplFlags));
+    }
+
+    // Display
+    uint64_t *rows = writableGfx();
+    for (int y = 0; y < GFX_Y; y++) {
+        rows[y] = getBytes(p, 8);
+    }
+    drawFlag = true;
+
+    // Memory, pages missing from the state are zero. Decoded code is only
+    // dropped for pages that actually change.
+    p += 2;
+    for (int i = 0; i < CHIP8_PAGES; i++) {
+        const unsigned char *source = ZEROS;
+        if (used & (1 << i)) {
+            source = p;
+            p += CHIP8_STATE_PAGE;
+        }
+        writeMemory(i * CHIP8_STATE_PAGE, source, CHIP8_STATE_PAGE);
+    }
+
+    // SUPER-CHIP display, blank in CHIP8_MODE_CHIP8
+    uint64_t *words = writableSchipGfx();
+    for (int i = 0; i < SCHIP_GFX_WORDS; i++) {
+        words[i] = mode == CHIP8_MODE_SCHIP ? getBytes(p, 8) : 0;
+    }
+}
+
+void Chip8::saveCounters(Chip8Counters &counters) const {
+    memcpy(counters.fusions, fusions, sizeof(fusions));
+#ifdef CHIP8_PROFILE
+    counters.profile = profile;
+#endif
+}
+
+void Chip8::loadCounters(const Chip8Counters &counters) {
+    memcpy(fusions, counters.fusions, sizeof(fusions));
+#ifdef CHIP8_PROFILE
+    profile = counters.profile;
+#endif
+}
+
+void Chip8::saveStateFile(const char *path) const {
+    unsigned char buffer[CHIP8_STATE_MAX_SIZE];
+    size_t length = saveState(buffer, sizeof(buffer));
+
+    std::ofstream outfile(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    outfile.write((const char *) buffer, length);
+    if (!outfile) {
+        throw FormattedException("Could not write save state: %s\n", path);
+    }
+}
+
+void Chip8::loadStateFile(const char *path) {
+    std::ifstream infile(path, std::ios::in | std::ios::binary);
+    if (!infile) {
+        throw FormattedException("Could not open save state: %s\n", path);
+    }
+
+    // Read one byte more than the largest state to catch oversized files
+    unsigned char buffer[CHIP8_STATE_MAX_SIZE + 1];
+    infile.read((char *) buffer, sizeof(buffer));
+    loadState(buffer, infile.gcount());
+}
+
+#ifdef CHIP8_PROFILE
+const Chip8Profile &Chip8::getProfile() const {
+    return profile;
+}
+
+void Chip8::resetProfile() {
+    memset(&profile, 0, sizeof(profile));
+}
+
+void Chip8::dumpProfile(const char *path) const {
+    std::ofstream outfile(path, std::ios::out | std::ios::trunc);
+    char line[64];
+
+    unsigned long long total = 0;
+    for (int i = 0; i < CHIP8_OPCODE_CLASSES; i++) {
+        total += profile.opcodes[i];
+    }
+    // Percentages of an empty profile are 0
+    double scale = total > 0 ? 100.0 / total : 0;
+
+    outfile << "instructions " << total << "\n";
+    outfile << "draws " << profile.draws << "\n";
+    outfile << "key_waits " << profile.keyWaits << "\n";
+
+    // Instruction mix in opcode table order
+    outfile << "\n# opcode count percent\n";
+    for (int i = 0; i < CHIP8_OPCODE_CLASSES; i++) {
+        snprintf(line, sizeof(line), "%s %llu %.2f\n", CHIP8_OPCODE_CLASS_NAMES[i],
+                profile.opcodes[i], profile.opcodes[i] * scale);
+        outfile << line;
+    }
+
+    // Executed addresses, hottest first
+    unsigned short order[MEMORY];
+    int executed = 0;
+    for (int address = 0; address < MEMORY; address++) {
+        if (profile.addresses[address] > 0) {
+            order[executed++] = address;
+        }
+    }
+    std::stable_sort(order, order + executed, [this](unsigned short a, unsigned short b) {
+        return profile.addresses[a] > profile.addresses[b];
+    });
+
+    outfile << "\n# address opcode count percent\n";
+    for (int i = 0; i < executed; i++) {
+        unsigned short address = order[i];
+        snprintf(line, sizeof(line), "%03X %04X %llu %.2f\n", address,
+                readMemory(address) << 8 | readMemory((address + 1) & ADDRESS_MASK),
+                profile.addresses[address], profile.addresses[address] * scale);
+        outfile << line;
+    }
+
+    if (!outfile) {
+        throw FormattedException("Could not write profile: %s\n", path);
+    }
+}
+#endif
+
+void Chip8::setMode(Chip8Mode mode) {
+    this->mode = mode;
+    hires = false;
+    memset(writableGfx(), 0, GFX_Y * sizeof(uint64_t));
+    memset(writableSchipGfx(), 0, SCHIP_GFX_WORDS * sizeof(uint64_t));
+    drawFlag = true;
+
+    // The big font only exists on SUPER-CHIP. Decoded code is kept, the
+    // SUPER-CHIP handlers check the mode when they run.
+    writeMemory(BIG_FONTSET_START, mode == CHIP8_MODE_SCHIP ? CHIP8_BIG_FONTSET : ZEROS,
+            BIG_FONTSET_LEN);
+}
+
+Chip8Mode Chip8::getMode() const {
+    return mode;
+}
+
+void Chip8::setQuirks(unsigned int quirks) {
+    if (quirks & ~CHIP8_QUIRKS_ALL) {
+        throw std::invalid_argument("Unknown quirk");
+    }
+    if (quirks == this->quirks) {
+        return;
+    }
+    this->quirks = quirks;
+
+    // Handlers were picked for the old quirks
+    for (int i = 0; i < CHIP8_PAGES; i++) {
+        Chip8Page *page = writablePage(i * CHIP8_PAGE_SIZE);
+        memset(page->ops, 0, sizeof(page->ops));
+    }
+    if (jit != NULL) {
+        jit->flush();
+    }
+}
+
+unsigned int Chip8::getQuirks() const {
+    return quirks;
+}
+
+unsigned long long Chip8::hashGfx() const {
+    // 64 bit FNV-1a
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+
+    // A CHIP-8 row is one word, a SUPER-CHIP row two
+    const uint64_t *words = gfx->words;
+    int count = GFX_Y;
+    if (mode == CHIP8_MODE_SCHIP) {
+        words = schipGfx->words;
+        count = SCHIP_GFX_WORDS;
+    }
+
+    for (int i = 0; i < count; i++) {
+        // Hash each word from its leftmost 8 pixels to its rightmost
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (words[i] >> shift) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    }
+
+    return hash;
+}
+
+const uint64_t *Chip8::getGfx() const {
+    return gfx->words;
+}
+
+const uint64_t *Chip8::getSchipGfx() const {
+    return schipGfx->words;
+}
+
+bool Chip8::getPixel(int x, int y) const {
+    if (mode == CHIP8_MODE_SCHIP) {
+        return (schipGfx->words[2 * y + x / 64] >> (63 - x % 64)) & 1;
+    }
+    return (gfx->words[y] >> (GFX_X - 1 - x)) & 1;
 }
 
 #ifdef DEBUG
-void printGraphics(bool* gfx) {
+void printGraphics(const uint64_t* gfx) {
     int last_y = 0;
     // Loop through all x and y positions
     for (int i = 0; i < GFX_X * GFX_Y; i++) {
         int pixelY = i / GFX_X;
         // Check if this pixel
-        if (gfx[i]) {
+        if ((gfx[pixelY] >> (GFX_X - 1 - i % GFX_X)) & 1) {
             printf(". ");
         } else {
             printf("  ");
@@ -165,7 +1250,144 @@ void printGraphics(bool* gfx) {
 }
 #endif
 
+// Every decoded instruction with the operands its implementation takes.
+// QUIRK ops have a variant per quirk setting, WAIT ops start the loops
+// skipIdle() fast-forwards and CLOCK ops read the instruction count.
+// Expanded into the decode cache handlers and the handlers of the threaded
+// core.
+#define CHIP8_OPS(OP, QUIRK, WAIT, CLOCK) \
+    OP(0NNN, (op.NNN)) \
+    OP(00E0, ()) \
+    OP(00EE, ()) \
+    OP(00CN, (op.NN & 0xF)) \
+    OP(00FB, ()) \
+    OP(00FC, ()) \
+    WAIT(00FD, ()) \
+    OP(00FE, ()) \
+    OP(00FF, ()) \
+    OP(1NNN, (op.NNN)) \
+    OP(2NNN, (op.NNN)) \
+    OP(3XNN, (op.X, op.NN)) \
+    OP(4XNN, (op.X, op.NN)) \
+    OP(5XY0, (op.X, op.Y)) \
+    OP(6XNN, (op.X, op.NN)) \
+    OP(7XNN, (op.X, op.NN)) \
+    OP(8XY0, (op.X, op.Y)) \
+    QUIRK(8XY1, (op.X, op.Y)) \
+    QUIRK(8XY2, (op.X, op.Y)) \
+    QUIRK(8XY3, (op.X, op.Y)) \
+    OP(8XY4, (op.X, op.Y)) \
+    OP(8XY5, (op.X, op.Y)) \
+    QUIRK(8XY6, (op.X, op.Y)) \
+    OP(8XY7, (op.X, op.Y)) \
+    QUIRK(8XYE, (op.X, op.Y)) \
+    OP(9XY0, (op.X, op.Y)) \
+    OP(ANNN, (op.NNN)) \
+    QUIRK(BNNN, (op.NNN)) \
+    OP(CXNN, (op.X, op.NN)) \
+    QUIRK(DXYN, (op.X, op.Y, op.NN & 0xF)) \
+    OP(EX9E, (op.X)) \
+    OP(EXA1, (op.X)) \
+    WAIT(FX07, (op.X)) \
+    WAIT(FX0A, (op.X)) \
+    CLOCK(FX15, (op.X)) \
+    CLOCK(FX18, (op.X)) \
+    OP(FX1E, (op.X)) \
+    OP(FX29, (op.X)) \
+    OP(FX30, (op.X)) \
+    OP(FX33, (op.X)) \
+    QUIRK(FX55, (op.X)) \
+    QUIRK(FX65, (op.X)) \
+    OP(FX75, (op.X)) \
+    OP(FX85, (op.X))
+
+// Sequences the threaded core runs as one handler, with the operands of
+// each instruction. Only instructions that never write memory are fused, so
+// the later ones cannot change while the first ones run. The kinds of a
+// QUIRK sequence follow the quirk variant of its last instruction.
+#define CHIP8_FUSED_OPS(FUSE2, QUIRK_FUSE2, FUSE3) \
+    FUSE2(3XNN, (op.X, op.NN), 1NNN, (op.NNN)) \
+    FUSE2(4XNN, (op.X, op.NN), 1NNN, (op.NNN)) \
+    FUSE2(EX9E, (op.X), 1NNN, (op.NNN)) \
+    FUSE2(EXA1, (op.X), 1NNN, (op.NNN)) \
+    FUSE2(6XNN, (op.X, op.NN), 6XNN, (op.X, op.NN)) \
+    FUSE2(6XNN, (op.X, op.NN), EX9E, (op.X)) \
+    FUSE2(6XNN, (op.X, op.NN), EXA1, (op.X)) \
+    QUIRK_FUSE2(ANNN, (op.NNN), DXYN, (op.X, op.Y, op.NN & 0xF)) \
+    FUSE3(6XNN, (op.X, op.NN), EX9E, (op.X), 1NNN, (op.NNN)) \
+    FUSE3(7XNN, (op.X, op.NN), 3XNN, (op.X, op.NN), 1NNN, (op.NNN)) \
+    FUSE3(8XY4, (op.X, op.Y), 3XNN, (op.X, op.NN), 1NNN, (op.NNN)) \
+    FUSE3(FX07, (op.X), 3XNN, (op.X, op.NN), 1NNN, (op.NNN))
+
+// DecodedOp::kind, one per handler. Zero, as in a cleared cache, is an
+// instruction that still needs decoding. Fused kinds come last.
+#define KIND(name, args) KIND_##name,
+#define QUIRK_KIND(name, args) KIND_##name, KIND_##name##_QUIRK,
+#define FUSE2_KIND(a, aArgs, b, bArgs) KIND_##a##_##b,
+#define QUIRK_FUSE2_KIND(a, aArgs, b, bArgs) KIND_##a##_##b, KIND_##a##_##b##_QUIRK,
+#define FUSE3_KIND(a, aArgs, b, bArgs, c, cArgs) KIND_##a##_##b##_##c,
+enum DecodedKind {
+    KIND_Decode,
+    KIND_Invalid,
+    CHIP8_OPS(KIND, QUIRK_KIND, KIND, KIND)
+    // Names the first fused kind without taking a value of its own
+    KIND_FUSED,
+    KIND_FUSED_LAST = KIND_FUSED - 1,
+    CHIP8_FUSED_OPS(FUSE2_KIND, QUIRK_FUSE2_KIND, FUSE3_KIND)
+    KIND_COUNT
+};
+#undef KIND
+#undef QUIRK_KIND
+#undef FUSE2_KIND
+#undef QUIRK_FUSE2_KIND
+#undef FUSE3_KIND
+
+// Index of a sequence in Chip8::fusions and CHIP8_FUSION_NAMES
+#define FUSE2_INDEX(a, aArgs, b, bArgs) FUSION_##a##_##b,
+#define FUSE3_INDEX(a, aArgs, b, bArgs, c, cArgs) FUSION_##a##_##b##_##c,
+enum Chip8Fusion {
+    CHIP8_FUSED_OPS(FUSE2_INDEX, FUSE2_INDEX, FUSE3_INDEX)
+    FUSION_COUNT
+};
+#undef FUSE2_INDEX
+#undef FUSE3_INDEX
+static_assert(FUSION_COUNT == CHIP8_FUSIONS, "CHIP8_FUSIONS does not match CHIP8_FUSED_OPS");
+
+#define FUSE2_NAME(a, aArgs, b, bArgs) #a ";" #b,
+#define FUSE3_NAME(a, aArgs, b, bArgs, c, cArgs) #a ";" #b ";" #c,
+const char *const CHIP8_FUSION_NAMES[CHIP8_FUSIONS] = {
+    CHIP8_FUSED_OPS(FUSE2_NAME, FUSE2_NAME, FUSE3_NAME)
+};
+#undef FUSE2_NAME
+#undef FUSE3_NAME
+
+// Sets the decode cache handler and the threaded core handler of an opcode
+#define DECODE(name) \
+    do { \
+        op.handler = exec##name; \
+        op.kind = KIND_##name; \
+    } while (0)
+#define QUIRK_DECODE(name, quirk) \
+    do { \
+        op.handler = (quirk) ? exec##name<true> : exec##name<false>; \
+        op.kind = (quirk) ? KIND_##name##_QUIRK : KIND_##name; \
+    } while (0)
+
 void Chip8::runOpcode() {
+    // Decode and execute the current opcode without touching the cache
+    DecodedOp op;
+    decode(opcode, quirks, op);
+    op.handler(*this, op);
+}
+
+void Chip8::decode(unsigned short opcode, unsigned int quirks, DecodedOp &op) {
+    // Extract all operands up front, handlers pick the ones they need
+    op.opcode = opcode;
+    op.NNN = opcode & 0x0FFF;
+    op.X = (opcode & 0x0F00) >> 8;
+    op.Y = (opcode & 0x00F0) >> 4;
+    op.NN = opcode & 0x00FF;
+
     // Decode opcode
     // See https://en.wikipedia.org/wiki/CHIP-8#Opcode_table
     // Decode first half-byte first
@@ -174,125 +1396,150 @@ void Chip8::runOpcode() {
         case 0x0000:
             switch (opcode) {
                 case 0x00E0:
-                    op00E0();
+                    DECODE(00E0);
                     break;
 
                 case 0x00EE:
-                    op00EE();
+                    DECODE(00EE);
+                    break;
+
+                // SUPER-CHIP, the handlers reject them in CHIP8_MODE_CHIP8
+                case 0x00FB:
+                    DECODE(00FB);
+                    break;
+
+                case 0x00FC:
+                    DECODE(00FC);
+                    break;
+
+                case 0x00FD:
+                    DECODE(00FD);
                     break;
-                
+
+                case 0x00FE:
+                    DECODE(00FE);
+                    break;
+
+                case 0x00FF:
+                    DECODE(00FF);
+                    break;
+
                 default:
-                    op0NNN(opcode & 0x0FFF);
+                    if ((opcode & 0xFFF0) == 0x00C0) {
+                        DECODE(00CN);
+                    } else {
+                        DECODE(0NNN);
+                    }
                     break;
             }
             break;
 
         case 0x1000:
-            op1NNN(opcode & 0x0FFF);
+            DECODE(1NNN);
             break;
 
         case 0x2000:
-            op2NNN(opcode & 0x0FFF);
+            DECODE(2NNN);
             break;
 
         case 0x3000:
-            op3XNN((opcode & 0x0F00) >> 8, opcode & 0x00FF);
+            DECODE(3XNN);
             break;
 
         case 0x4000:
-            op4XNN((opcode & 0x0F00) >> 8, opcode & 0x00FF);
+            DECODE(4XNN);
             break;
 
         case 0x5000:
-            op5XY0((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+            DECODE(5XY0);
             break;
 
         case 0x6000:
-            op6XNN((opcode & 0x0F00) >> 8, opcode & 0x00FF);
+            DECODE(6XNN);
             break;
 
         case 0x7000:
-            op7XNN((opcode & 0x0F00) >> 8, opcode & 0x00FF);
+            DECODE(7XNN);
             break;
 
         case 0x8000:
             switch (opcode & 0xF00F) {
                 case 0x8000:
-                    op8XY0((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    DECODE(8XY0);
                     break;
 
                 case 0x8001:
-                    op8XY1((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    QUIRK_DECODE(8XY1, quirks & CHIP8_QUIRK_VF_RESET);
                     break;
 
                 case 0x8002:
-                    op8XY2((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    QUIRK_DECODE(8XY2, quirks & CHIP8_QUIRK_VF_RESET);
                     break;
 
                 case 0x8003:
-                    op8XY3((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    QUIRK_DECODE(8XY3, quirks & CHIP8_QUIRK_VF_RESET);
                     break;
 
                 case 0x8004:
-                    op8XY4((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    DECODE(8XY4);
                     break;
 
                 case 0x8005:
-                    op8XY5((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    DECODE(8XY5);
                     break;
 
                 case 0x8006:
-                    op8XY6((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    QUIRK_DECODE(8XY6, quirks & CHIP8_QUIRK_SHIFT_VY);
                     break;
 
                 case 0x8007:
-                    op8XY7((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    DECODE(8XY7);
                     break;
 
                 case 0x800E:
-                    op8XYE((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+                    QUIRK_DECODE(8XYE, quirks & CHIP8_QUIRK_SHIFT_VY);
                     break;
 
                 // Opcode not found
                 default:
-                    throwOpcodeNotImplemented(opcode);
+                    DECODE(Invalid);
                     break;
             }
             break;
 
         case 0x9000:
-            op9XY0((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
+            DECODE(9XY0);
             break;
 
         case 0xA000:
-            opANNN(opcode & 0x0FFF);
+            DECODE(ANNN);
             break;
 
         case 0xB000:
-            opBNNN(opcode & 0x0FFF);
+            QUIRK_DECODE(BNNN, quirks & CHIP8_QUIRK_JUMP_VX);
             break;
 
         case 0xC000:
-            opCXNN(((opcode & 0x0F00) >> 8), (opcode & 0x00FF));
+            DECODE(CXNN);
             break;
 
         case 0xD000:
-            opDXYN((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4, opcode & 0x000F);
+            QUIRK_DECODE(DXYN, quirks & CHIP8_QUIRK_CLIP);
             break;
 
         case 0xE000:
             switch (opcode & 0xF0FF) {
                 case 0xE09E:
-                    opEX9E((opcode & 0x0F00) >> 8);
+                    DECODE(EX9E);
                     break;
 
                 case 0xE0A1:
-                    opEXA1((opcode & 0x0F00) >> 8);
+                    DECODE(EXA1);
                     break;
 
                 // Opcode not found
                 default:
-                    throwOpcodeNotImplemented(opcode);
+                    DECODE(Invalid);
                     break;
             }
             break;
@@ -300,69 +1547,454 @@ void Chip8::runOpcode() {
         case 0xF000:
             switch (opcode & 0xF0FF) {
                 case 0xF007:
-                    opFX07((opcode & 0x0F00) >> 8);
+                    DECODE(FX07);
                     break;
 
                 case 0xF00A:
-                    opFX0A((opcode & 0x0F00) >> 8);
+                    DECODE(FX0A);
                     break;
 
                 case 0xF015:
-                    opFX15((opcode & 0x0F00) >> 8);
+                    DECODE(FX15);
                     break;
 
                 case 0xF018:
-                    opFX18((opcode & 0x0F00) >> 8);
+                    DECODE(FX18);
                     break;
 
                 case 0xF01E:
-                    opFX1E((opcode & 0x0F00) >> 8);
+                    DECODE(FX1E);
                     break;
 
                 case 0xF029:
-                    opFX29((opcode & 0x0F00) >> 8);
+                    DECODE(FX29);
                     break;
 
                 case 0xF033:
-                    opFX33((opcode & 0x0F00) >> 8);
+                    DECODE(FX33);
                     break;
 
                 case 0xF055:
-                    opFX55((opcode & 0x0F00) >> 8);
+                    QUIRK_DECODE(FX55, quirks & CHIP8_QUIRK_MEMORY_I);
                     break;
 
                 case 0xF065:
-                    opFX65((opcode & 0x0F00) >> 8);
+                    QUIRK_DECODE(FX65, quirks & CHIP8_QUIRK_MEMORY_I);
+                    break;
+
+                // SUPER-CHIP, the handlers reject them in CHIP8_MODE_CHIP8
+                case 0xF030:
+                    DECODE(FX30);
+                    break;
+
+                case 0xF075:
+                    DECODE(FX75);
+                    break;
+
+                case 0xF085:
+                    DECODE(FX85);
                     break;
 
                 // Opcode not found
                 default:
-                    throwOpcodeNotImplemented(opcode);
+                    DECODE(Invalid);
                     break;
             }
             break;
 
         // Opcode not found
         default:
-            throwOpcodeNotImplemented(opcode);
+            DECODE(Invalid);
             break;
     }
 }
 
+#undef DECODE
+#undef QUIRK_DECODE
+
+// Kind of the first instruction of a fused kind, other kinds are returned
+// as they are
+static unsigned int unfusedKind(unsigned int kind) {
+#define FUSE2_UNFUSE(a, aArgs, b, bArgs) \
+    case KIND_##a##_##b: return KIND_##a;
+#define QUIRK_FUSE2_UNFUSE(a, aArgs, b, bArgs) \
+    case KIND_##a##_##b: case KIND_##a##_##b##_QUIRK: return KIND_##a;
+#define FUSE3_UNFUSE(a, aArgs, b, bArgs, c, cArgs) \
+    case KIND_##a##_##b##_##c: return KIND_##a;
+    switch (kind) {
+        CHIP8_FUSED_OPS(FUSE2_UNFUSE, QUIRK_FUSE2_UNFUSE, FUSE3_UNFUSE)
+        default: return kind;
+    }
+#undef FUSE2_UNFUSE
+#undef QUIRK_FUSE2_UNFUSE
+#undef FUSE3_UNFUSE
+}
+
+void Chip8::fuse(unsigned short address) {
+    DecodedOp *ops = &pages[address / CHIP8_PAGE_SIZE]->ops[address % CHIP8_PAGE_SIZE];
+    unsigned int first = ops[0].kind;
+#define FUSE2_HEAD(a, aArgs, b, bArgs) first == KIND_##a ||
+#define FUSE3_HEAD(a, aArgs, b, bArgs, c, cArgs) first == KIND_##a ||
+    if (!(CHIP8_FUSED_OPS(FUSE2_HEAD, FUSE2_HEAD, FUSE3_HEAD) false)) {
+        return;
+    }
+#undef FUSE2_HEAD
+#undef FUSE3_HEAD
+
+    // The next two instructions, decoded (and fused) first if they are not
+    // yet. Sequences end before an instruction that leaves the page, so that
+    // a write only has to look for them in its own page, and at the end of
+    // the ROM area.
+    unsigned int next[2] = { KIND_Decode, KIND_Decode };
+    for (int i = 0; i < 2; i++) {
+        unsigned short following = address + 2 * (i + 1);
+        if (following / CHIP8_PAGE_SIZE != address / CHIP8_PAGE_SIZE ||
+                following % CHIP8_PAGE_SIZE == CHIP8_PAGE_SIZE - 1 || following > ROM_END) {
+            break;
+        }
+        DecodedOp &op = ops[2 * (i + 1)];
+        if (op.handler == NULL) {
+            decode(readMemory(following) << 8 | readMemory(following + 1), quirks, op);
+            fuse(following);
+        }
+        next[i] = unfusedKind(op.kind);
+    }
+
+    // Longest sequence first
+#define FUSE3_MATCH(a, aArgs, b, bArgs, c, cArgs) \
+    if (first == KIND_##a && next[0] == KIND_##b && next[1] == KIND_##c) { \
+        ops[0].kind = KIND_##a##_##b##_##c; \
+        return; \
+    }
+#define FUSE2_MATCH(a, aArgs, b, bArgs) \
+    if (first == KIND_##a && next[0] == KIND_##b) { \
+        ops[0].kind = KIND_##a##_##b; \
+        return; \
+    }
+#define QUIRK_FUSE2_MATCH(a, aArgs, b, bArgs) \
+    FUSE2_MATCH(a, aArgs, b, bArgs) \
+    if (first == KIND_##a && next[0] == KIND_##b##_QUIRK) { \
+        ops[0].kind = KIND_##a##_##b##_QUIRK; \
+        return; \
+    }
+#define IGNORE2(a, aArgs, b, bArgs)
+#define IGNORE3(a, aArgs, b, bArgs, c, cArgs)
+    CHIP8_FUSED_OPS(IGNORE2, IGNORE2, FUSE3_MATCH)
+    CHIP8_FUSED_OPS(FUSE2_MATCH, QUIRK_FUSE2_MATCH, IGNORE3)
+#undef FUSE3_MATCH
+#undef FUSE2_MATCH
+#undef QUIRK_FUSE2_MATCH
+#undef IGNORE2
+#undef IGNORE3
+}
+
+void Chip8::invalidateCode(unsigned short address) {
+    // Drop the cached decodes of the instructions containing this byte, the
+    // one starting at it and the one before, the page was made writable by
+    // the write
+    DecodedOp *ops = pages[address / CHIP8_PAGE_SIZE]->ops;
+    unsigned int index = address % CHIP8_PAGE_SIZE;
+    for (unsigned int i = index >= 1 ? index - 1 : 0; i <= index; i++) {
+        ops[i].handler = NULL;
+        ops[i].kind = KIND_Decode;
+    }
+
+    // and the sequences fused with them, which start at most two instructions
+    // earlier in the same page. They are fused again when they next run.
+    for (unsigned int i = index >= 5 ? index - 5 : 0; i + 1 < index; i++) {
+        if (ops[i].kind >= KIND_FUSED) {
+            ops[i].handler = NULL;
+            ops[i].kind = KIND_Decode;
+        }
+    }
+
+    if (jit != NULL && address >= ROM_START && address <= ROM_END) {
+        jit->invalidate(address);
+    }
+    if (aot != NULL) {
+        aot->invalidate(address);
+    }
+}
+
+// Decode cache handlers. Each one forwards the pre-extracted operands to the
+// opcode implementation.
+#define EXEC(name, args) \
+    void Chip8::exec##name(Chip8 &c, const DecodedOp &op) { c.op##name args; }
+#define QUIRK_EXEC(name, args) \
+    template <bool Quirk> \
+    void Chip8::exec##name(Chip8 &c, const DecodedOp &op) { c.op##name<Quirk> args; }
+
+void Chip8::execInvalid(Chip8 &c, const DecodedOp &op) {
+    c.throwOpcodeNotImplemented(op.opcode);
+}
+
+CHIP8_OPS(EXEC, QUIRK_EXEC, EXEC, EXEC)
+
+#undef EXEC
+#undef QUIRK_EXEC
+
+#ifndef CHIP8_PROFILE
+// GCC and Clang can jump to a label address, which lets every handler end
+// with its own indirect jump to the next one. Elsewhere a switch in a loop
+// dispatches from a single place.
+#if defined(__GNUC__) && !defined(CHIP8_NO_COMPUTED_GOTO)
+#define CHIP8_COMPUTED_GOTO
+#endif
+
+void Chip8::runThreaded(unsigned long long end) {
+    const DecodedOp *next;
+    unsigned short start = 0;  // Address of the running fused sequence
+    // The instruction count is kept here and only stored to cycles where
+    // something reads it: the clock, step(), skipIdle() and the caller
+    unsigned long long now = cycles;
+
+    // True with next pointing at the cache entry of the pc if the run has
+    // cycles left and the pc is an address the cache holds
+#define LOOKUP() \
+    (now < end && pc >= ROM_START && pc <= ROM_END && \
+        pc % CHIP8_PAGE_SIZE != CHIP8_PAGE_SIZE - 1 && \
+        (next = &pages[pc / CHIP8_PAGE_SIZE]->ops[pc % CHIP8_PAGE_SIZE]))
+
+    // Anything the cache does not hold (instructions across pages, invalid
+    // addresses, instructions not yet decoded) runs through step(), which
+    // also decodes into the cache
+#define FETCH() \
+    while (!LOOKUP() || next->kind == KIND_Decode) { \
+        cycles = now; \
+        if (now >= end) { \
+            return; \
+        } \
+        step(end); \
+        now = cycles; \
+    }
+
+    // Counts the instruction. The clock only needs work for real time ticks
+    // and to end a sound, see advanceClock().
+#define RETIRE() \
+    now++; \
+    if (clockMode != CHIP8_CLOCK_VIRTUAL || soundActive) { \
+        cycles = now; \
+        advanceClock(); \
+    }
+
+    try {
+#ifdef CHIP8_COMPUTED_GOTO
+#define TARGET(name, args) &&run_##name,
+#define QUIRK_TARGET(name, args) &&run_##name, &&run_##name##_QUIRK,
+#define FUSE2_TARGET(a, aArgs, b, bArgs) &&run_##a##_##b,
+#define QUIRK_FUSE2_TARGET(a, aArgs, b, bArgs) &&run_##a##_##b, &&run_##a##_##b##_QUIRK,
+#define FUSE3_TARGET(a, aArgs, b, bArgs, c, cArgs) &&run_##a##_##b##_##c,
+        static const void *const targets[KIND_COUNT] = {
+            &&fetch,
+            &&run_Invalid,
+            CHIP8_OPS(TARGET, QUIRK_TARGET, TARGET, TARGET)
+            CHIP8_FUSED_OPS(FUSE2_TARGET, QUIRK_FUSE2_TARGET, FUSE3_TARGET)
+        };
+#undef TARGET
+#undef QUIRK_TARGET
+#undef FUSE2_TARGET
+#undef QUIRK_FUSE2_TARGET
+#undef FUSE3_TARGET
+
+    // Only the common case is copied into every handler, so that the
+    // compiler keeps one indirect jump per handler. Instructions still to
+    // decode jump to fetch.
+#define HANDLER(kind) run_##kind:
+#define DISPATCH() \
+    if (LOOKUP()) { \
+        goto *targets[next->kind]; \
+    } \
+    goto fetch
+
+    fetch:
+        FETCH();
+        goto *targets[next->kind];
+        {
+#else
+#define HANDLER(kind) case KIND_##kind:
+#define DISPATCH() continue
+
+        for (;;) {
+            FETCH();
+            switch (next->kind) {
+#endif
+
+// The handler only reads the operands before it runs, like the decode
+// cache handlers
+#define RUN(name, args) \
+            HANDLER(name) { \
+                const DecodedOp &op = *next; \
+                opcode = op.opcode; \
+                (void) op; \
+                op##name args; \
+            } \
+            RETIRE(); \
+            DISPATCH();
+#define QUIRK_RUN(name, args) \
+            HANDLER(name) { \
+                const DecodedOp &op = *next; \
+                opcode = op.opcode; \
+                op##name<false> args; \
+            } \
+            RETIRE(); \
+            DISPATCH(); \
+            HANDLER(name##_QUIRK) { \
+                const DecodedOp &op = *next; \
+                opcode = op.opcode; \
+                op##name<true> args; \
+            } \
+            RETIRE(); \
+            DISPATCH();
+// Waits are skipped as in step()
+#define WAIT_RUN(name, args) \
+            HANDLER(name) \
+            cycles = now; \
+            if (skipIdle(end) > 0) { \
+                now = cycles; \
+                DISPATCH(); \
+            } \
+            { \
+                const DecodedOp &op = *next; \
+                opcode = op.opcode; \
+                op##name args; \
+            } \
+            RETIRE(); \
+            DISPATCH();
+#define CLOCK_RUN(name, args) \
+            HANDLER(name) \
+            cycles = now; \
+            { \
+                const DecodedOp &op = *next; \
+                opcode = op.opcode; \
+                op##name args; \
+            } \
+            RETIRE(); \
+            DISPATCH();
+
+// A fused sequence starts like a wait if its first instruction is FX07, and
+// runs its first instruction alone through step() if the run ends before
+// the sequence would. Every instruction is retired on its own, and the next
+// one only runs if the last fell through to it.
+#define FUSED_START(name, first, length) \
+            if (KIND_##first == KIND_FX07) { \
+                cycles = now; \
+                if (skipIdle(end) > 0) { \
+                    now = cycles; \
+                    DISPATCH(); \
+                } \
+            } \
+            if (end - now < length) { \
+                cycles = now; \
+                step(end); \
+                now = cycles; \
+                DISPATCH(); \
+            } \
+            fusions[FUSION_##name]++; \
+            start = pc;
+#define FUSED_RUN(index, name, args) \
+            { \
+                const DecodedOp &op = next[2 * (index)]; \
+                opcode = op.opcode; \
+                op##name args; \
+            } \
+            RETIRE();
+#define FUSED_NEXT(index) \
+            if (pc != start + 2 * (index)) { \
+                DISPATCH(); \
+            }
+#define FUSE2_RUN(a, aArgs, b, bArgs) \
+            HANDLER(a##_##b) \
+            FUSED_START(a##_##b, a, 2) \
+            FUSED_RUN(0, a, aArgs) \
+            FUSED_NEXT(1) \
+            FUSED_RUN(1, b, bArgs) \
+            DISPATCH();
+#define QUIRK_FUSE2_RUN(a, aArgs, b, bArgs) \
+            HANDLER(a##_##b) \
+            FUSED_START(a##_##b, a, 2) \
+            FUSED_RUN(0, a, aArgs) \
+            FUSED_NEXT(1) \
+            FUSED_RUN(1, b<false>, bArgs) \
+            DISPATCH(); \
+            HANDLER(a##_##b##_QUIRK) \
+            FUSED_START(a##_##b, a, 2) \
+            FUSED_RUN(0, a, aArgs) \
+            FUSED_NEXT(1) \
+            FUSED_RUN(1, b<true>, bArgs) \
+            DISPATCH();
+#define FUSE3_RUN(a, aArgs, b, bArgs, c, cArgs) \
+            HANDLER(a##_##b##_##c) \
+            FUSED_START(a##_##b##_##c, a, 3) \
+            FUSED_RUN(0, a, aArgs) \
+            FUSED_NEXT(1) \
+            FUSED_RUN(1, b, bArgs) \
+            FUSED_NEXT(2) \
+            FUSED_RUN(2, c, cArgs) \
+            DISPATCH();
+
+            HANDLER(Invalid)
+            opcode = next->opcode;
+            throwOpcodeNotImplemented(opcode);
+
+            CHIP8_OPS(RUN, QUIRK_RUN, WAIT_RUN, CLOCK_RUN)
+            CHIP8_FUSED_OPS(FUSE2_RUN, QUIRK_FUSE2_RUN, FUSE3_RUN)
+
+#ifndef CHIP8_COMPUTED_GOTO
+            }
+#endif
+        }
+    } catch (...) {
+        // The failed instruction is not counted, as in step()
+        cycles = now;
+        throw;
+    }
+
+#undef LOOKUP
+#undef FETCH
+#undef RETIRE
+#undef HANDLER
+#undef DISPATCH
+#undef RUN
+#undef QUIRK_RUN
+#undef WAIT_RUN
+#undef CLOCK_RUN
+#undef FUSED_START
+#undef FUSED_RUN
+#undef FUSED_NEXT
+#undef FUSE2_RUN
+#undef QUIRK_FUSE2_RUN
+#undef FUSE3_RUN
+}
+#endif
+
 void Chip8::throwOpcodeNotImplemented(unsigned short opcode) {
     printf("PC: %X, Opcode: %X\n", pc, opcode);
     throw FormattedException("Opcode not found, 0x%X\n", opcode);
 }
 
 void Chip8::op0NNN(unsigned short N) {
-    throwOpcodeNotImplemented(opcode);
+    throwOpcodeNotImplemented(N);
 
 }
 
+void Chip8::requireSchip(unsigned short opcode) {
+    // SUPER-CHIP opcodes stay invalid in CHIP8_MODE_CHIP8
+    if (mode != CHIP8_MODE_SCHIP) {
+        throwOpcodeNotImplemented(opcode);
+    }
+}
+
 void Chip8::op00E0() {
     // Clear display
-    std::fill(gfx, gfx + sizeof(gfx), 0);
+    if (mode == CHIP8_MODE_SCHIP) {
+        memset(writableSchipGfx(), 0, SCHIP_GFX_WORDS * sizeof(uint64_t));
+    } else {
+        memset(writableGfx(), 0, GFX_Y * sizeof(uint64_t));
+    }
     drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
 
     // Increment Program Counter
     pc += 2;
@@ -370,6 +2002,10 @@ void Chip8::op00E0() {
 
 void Chip8::op00EE() {
     // Return from function
+    if (sp == 0) {
+        throw FormattedException("Stack underflow at PC: %X\n", pc);
+    }
+
     // Move Program Counter back to the previous position in stack
     sp--;
     pc = stack[sp];
@@ -378,6 +2014,85 @@ void Chip8::op00EE() {
     pc += 2;
 }
 
+void Chip8::op00CN(unsigned char N) {
+    // Scrolls the display down N rows. Rows are whole words, so the rows
+    // that stay move in one memmove and the rows scrolled in are cleared.
+    requireSchip(0x00C0 | N);
+    uint64_t *words = writableSchipGfx();
+    memmove(words + 2 * N, words, (SCHIP_GFX_Y - N) * 2 * sizeof(uint64_t));
+    memset(words, 0, 2 * N * sizeof(uint64_t));
+
+    drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
+
+    // Increment Program Counter
+    pc += 2;
+}
+
+void Chip8::op00FB() {
+    // Scrolls the display right 4 pixels, the left word of each row shifts
+    // into the right one
+    requireSchip(0x00FB);
+    uint64_t *words = writableSchipGfx();
+    for (int i = 0; i < SCHIP_GFX_WORDS; i += 2) {
+        words[i + 1] = (words[i + 1] >> 4) | (words[i] << 60);
+        words[i] >>= 4;
+    }
+
+    drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
+
+    // Increment Program Counter
+    pc += 2;
+}
+
+void Chip8::op00FC() {
+    // Scrolls the display left 4 pixels, the right word of each row shifts
+    // into the left one
+    requireSchip(0x00FC);
+    uint64_t *words = writableSchipGfx();
+    for (int i = 0; i < SCHIP_GFX_WORDS; i += 2) {
+        words[i] = (words[i] << 4) | (words[i + 1] >> 60);
+        words[i + 1] <<= 4;
+    }
+
+    drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
+
+    // Increment Program Counter
+    pc += 2;
+}
+
+void Chip8::op00FD() {
+    // Exits the interpreter. The program counter is not incremented, so the
+    // system stays on this instruction, see isIdle().
+    requireSchip(0x00FD);
+}
+
+void Chip8::op00FE() {
+    // Switches to low resolution. The display is kept, as on SUPER-CHIP 1.1.
+    requireSchip(0x00FE);
+    hires = false;
+
+    // Increment Program Counter
+    pc += 2;
+}
+
+void Chip8::op00FF() {
+    // Switches to high resolution. The display is kept, as on SUPER-CHIP 1.1.
+    requireSchip(0x00FF);
+    hires = true;
+
+    // Increment Program Counter
+    pc += 2;
+}
+
 void Chip8::op1NNN(unsigned short N) {
     // goto NNN
     pc = N;
@@ -385,6 +2100,10 @@ void Chip8::op1NNN(unsigned short N) {
 
 void Chip8::op2NNN(unsigned short N) {
     // Calls subroutine at NNN
+    if (sp >= STACK) {
+        throw FormattedException("Stack overflow at PC: %X\n", pc);
+    }
+
     stack[sp] = pc;
     sp++;
     pc = N;
@@ -447,25 +2166,37 @@ void Chip8::op8XY0(unsigned char X, unsigned char Y) {
     pc += 2;
 }
 
+template <bool ResetVF>
 void Chip8::op8XY1(unsigned char X, unsigned char Y) {
-    // Sets VX |= VY
+    // Sets VX |= VY. The COSMAC VIP also clears VF.
     V[X] |= V[Y];
+    if (ResetVF) {
+        V[0xF] = 0;
+    }
 
     // Increment the program counter
     pc += 2;
 }
 
+template <bool ResetVF>
 void Chip8::op8XY2(unsigned char X, unsigned char Y) {
-    // Sets VX &= VY
+    // Sets VX &= VY. The COSMAC VIP also clears VF.
     V[X] &= V[Y];
+    if (ResetVF) {
+        V[0xF] = 0;
+    }
 
     // Increment the program counter
     pc += 2;
 }
 
+template <bool ResetVF>
 void Chip8::op8XY3(unsigned char X, unsigned char Y) {
-    // Sets VX ^= VY
+    // Sets VX ^= VY. The COSMAC VIP also clears VF.
     V[X] ^= V[Y];
+    if (ResetVF) {
+        V[0xF] = 0;
+    }
 
     // Increment the program counter
     pc += 2;
@@ -509,10 +2240,13 @@ void Chip8::op8XY5(unsigned char X, unsigned char Y) {
     pc += 2;
 }
 
+template <bool ShiftVY>
 void Chip8::op8XY6(unsigned char X, unsigned char Y) {
-    // Stores the VX LSB in VF and shifts VX right by 1 bit
-    V[0xF] = V[X] & 0x0001;
-    V[X] >>= 1;
+    // Stores the VX LSB in VF and shifts VX right by 1 bit. The COSMAC VIP
+    // shifts VY into VX instead.
+    unsigned char source = ShiftVY ? Y : X;
+    V[0xF] = V[source] & 0x0001;
+    V[X] = V[source] >> 1;
 
     // Increment program counter
     pc += 2;
@@ -537,10 +2271,13 @@ void Chip8::op8XY7(unsigned char X, unsigned char Y) {
     pc += 2;
 }
 
+template <bool ShiftVY>
 void Chip8::op8XYE(unsigned char X, unsigned char Y) {
-    // Stores the VX MSB in VF and shifts VX left by 1 bit
-    V[0xF] = V[X] >> 7;
-    V[X] <<= 1;
+    // Stores the VX MSB in VF and shifts VX left by 1 bit. The COSMAC VIP
+    // shifts VY into VX instead.
+    unsigned char source = ShiftVY ? Y : X;
+    V[0xF] = V[source] >> 7;
+    V[X] = V[source] << 1;
 
     // Increment program counter
     pc += 2;
@@ -565,44 +2302,130 @@ void Chip8::opANNN(unsigned short N) {
     pc += 2;
 }
 
+template <bool JumpVX>
 void Chip8::opBNNN(unsigned short N) {
-    // Jumps to the address NNN plus V0
-    pc = N + V[0];
+    // Jumps to the address NNN plus V0. SUPER-CHIP reads it as BXNN and adds
+    // VX instead.
+    pc = N + V[JumpVX ? N >> 8 : 0];
 }
 
 void Chip8::opCXNN(unsigned char X, unsigned char N) {
     // Sets VX to rand & NN
-    V[X] = N & (rand() & 0xFF);
+    V[X] = N & nextRandom();
 
     // Increment Program Counter
     pc += 2;
 }
 
+template <bool Clip>
 void Chip8::opDXYN(unsigned char X, unsigned char Y, unsigned char N) {
     // Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a
     // height of N+1 pixels. Each row of 8 pixels is read as bit-coded starting
     // from memory location I; I value doesn’t change after the execution of
     // this instruction. VF is set to 1 if any screen pixels are flipped from
     // set to unset when the sprite is drawn, and to 0 if that doesn’t happen 
+    if (mode == CHIP8_MODE_SCHIP) {
+        drawSchip(X, Y, N);
+        return;
+    }
+
+    // Sprites start on the screen and wrap around its edges, or are clipped
+    // at them
+    unsigned char x = V[X] % GFX_X;
+    unsigned char y = V[Y] % GFX_Y;
 
     // Reset VF
     V[0xF] = 0;
 
-    unsigned short line;
-    bool pixel;
-    unsigned short pixelPos;
+    uint64_t *rows = writableGfx();
+    for (int h = 0; h < N && (!Clip || y + h < GFX_Y); h++) {
+        // Move the 8 pixel sprite row to column x of a 64 bit screen row
+        uint64_t line = (uint64_t) readMemory((I + h) & ADDRESS_MASK) << (GFX_X - 8);
+        if (x != 0) {
+            line = Clip ? line >> x : (line >> x) | (line << (GFX_X - x));
+        }
 
-    for(int h = 0; h < N; h++) {
-        line = memory[I + h];
-        for (int w = 0; w < 8; w++) {
-            pixelPos = (V[X] + w) + (V[Y] + h) * GFX_X;
-            pixel = (line & (0x80 >> w)) != 0;
-            V[0xF] = (pixel && gfx[pixelPos]) ? 1 : 0;  // If pixel and last_pixel, set VF to 1
-            gfx[pixelPos] ^= pixel;  // last_pixel XOR pixel
+        uint64_t &row = rows[(y + h) % GFX_Y];
+        if (row & line) {
+            // A set pixel is flipped to unset
+            V[0xF] = 1;
         }
+        row ^= line;
     }
 
     drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
+
+    // Increment Program Counter
+    pc += 2;
+}
+
+// Doubles each of the low 16 bits, for 2x2 pixels in low resolution
+static uint64_t doubleBits(uint64_t bits) {
+    bits = (bits | bits << 8) & 0x00FF00FF;
+    bits = (bits | bits << 4) & 0x0F0F0F0F;
+    bits = (bits | bits << 2) & 0x33333333;
+    bits = (bits | bits << 1) & 0x55555555;
+    return bits | bits << 1;
+}
+
+bool Chip8::xorSchipRow(uint64_t *row, int x, uint64_t line) {
+    // Moves the left aligned pixels of a line to column x of a two word
+    // row. Pixels past the right edge are shifted out, which clips them.
+    uint64_t left = 0;
+    uint64_t right;
+    if (x < 64) {
+        left = line >> x;
+        right = x == 0 ? 0 : line << (64 - x);
+    } else {
+        right = line >> (x - 64);
+    }
+
+    bool collision = (row[0] & left) || (row[1] & right);
+    row[0] ^= left;
+    row[1] ^= right;
+    return collision;
+}
+
+void Chip8::drawSchip(unsigned char X, unsigned char Y, unsigned char N) {
+    // Draws an 8xN sprite, or a 16x16 sprite of 2 bytes per row if N is 0.
+    // The position wraps around the screen and the sprite is clipped at its
+    // edges. Low resolution draws 2x2 pixels on a 64x32 grid.
+    int scale = hires ? 1 : 2;
+    int x = V[X] % (SCHIP_GFX_X / scale) * scale;
+    int y = V[Y] % (SCHIP_GFX_Y / scale) * scale;
+    int width = N == 0 ? 16 : 8;
+    int height = N == 0 ? 16 : N;
+
+    uint64_t *words = writableSchipGfx();
+    bool collision = false;
+    for (int h = 0; h < height && y + h * scale < SCHIP_GFX_Y; h++) {
+        uint64_t bits;
+        if (N == 0) {
+            bits = readMemory((I + 2 * h) & ADDRESS_MASK) << 8 |
+                readMemory((I + 2 * h + 1) & ADDRESS_MASK);
+        } else {
+            bits = readMemory((I + h) & ADDRESS_MASK);
+        }
+        if (!hires) {
+            bits = doubleBits(bits);
+        }
+
+        uint64_t line = bits << (64 - width * scale);
+        for (int r = 0; r < scale; r++) {
+            collision |= xorSchipRow(words + 2 * (y + h * scale + r), x, line);
+        }
+    }
+
+    // VF is 1 if any pixel was flipped to unset
+    V[0xF] = collision;
+
+    drawFlag = true;
+#ifdef CHIP8_PROFILE
+    profile.draws++;
+#endif
 
     // Increment Program Counter
     pc += 2;
@@ -610,7 +2433,7 @@ void Chip8::opDXYN(unsigned char X, unsigned char Y, unsigned char N) {
 
 void Chip8::opEX9E(unsigned char X) {
     // Skips the next instruction if the key in VX is pressed
-    if (key[V[X]]) {
+    if (key[V[X] & KEY_MASK]) {
         // Increment the program counter twice
         pc += 4;
     } else {
@@ -621,7 +2444,7 @@ void Chip8::opEX9E(unsigned char X) {
 
 void Chip8::opEXA1(unsigned char X) {
     // Skips the next instruction if the key in VX is not pressed
-    if (!key[V[X]]) {
+    if (!key[V[X] & KEY_MASK]) {
         // Increment the program counter twice
         pc += 4;
     } else {
@@ -632,7 +2455,7 @@ void Chip8::opEXA1(unsigned char X) {
 
 void Chip8::opFX07(unsigned char X) {
     // Sets VX to the value of the delay timer
-    V[X] = delayTimer;
+    V[X] = timerValue(delayTimerEnd);
 
     // Increment the program counter
     pc += 2;
@@ -649,19 +2472,29 @@ void Chip8::opFX0A(unsigned char X) {
             return;
         }
     }
+
+#ifdef CHIP8_PROFILE
+    profile.keyWaits++;
+#endif
 }
 
 void Chip8::opFX15(unsigned char X) {
     // Sets the delay timer to VX
-    delayTimer = V[X];
+    delayTimerEnd = currentTick() + V[X];
 
     // Increment the program counter
     pc += 2;
 }
 
 void Chip8::opFX18(unsigned char X) {
-    // Sets the sound timer to VX
-    soundTimer = V[X];
+    // Sets the sound timer to VX. A timer that ran out since the clock was
+    // last advanced stops first, so the events stay in order.
+    updateSound();
+    if (soundActive != (V[X] > 0)) {
+        pushSoundEvent(cycles, V[X] > 0);
+    }
+    soundTimerEnd = currentTick() + V[X];
+    soundActive = V[X] > 0;
 
     // Increment the program counter
     pc += 2;
@@ -685,37 +2518,93 @@ void Chip8::opFX29(unsigned char X) {
     pc += 2;
 }
 
+void Chip8::opFX30(unsigned char X) {
+    // Sets I to the location of the 8x10 sprite for the digit in VX, see
+    // CHIP8_BIG_FONTSET
+    requireSchip(0xF030 | X << 8);
+    I = BIG_FONTSET_START + (V[X] & 0xF) * 10;
+
+    // Increment the program counter
+    pc += 2;
+}
+
 void Chip8::opFX33(unsigned char X) {
     // Stores the binary-coded decimal of VX in I, I+1, and I+2, where I is the
     // MSB, I+1 is the middle byte and I+2 is the LSB.
     // https://en.wikipedia.org/wiki/Binary-coded_decimal
-    memory[I] = V[X] / 100;  // MSB
-    memory[I+1] = (V[X] / 10) % 10;  // Middle byte
-    memory[I+2] = V[X] % 10;  // LSB
+    // Addresses wrap around at the end of memory
+    writeMemory(I & ADDRESS_MASK, V[X] / 100);  // MSB
+    writeMemory((I + 1) & ADDRESS_MASK, (V[X] / 10) % 10);  // Middle byte
+    writeMemory((I + 2) & ADDRESS_MASK, V[X] % 10);  // LSB
 
     // Increment the program counter
     pc += 2;
 }
 
+template <bool IncrementI>
 void Chip8::opFX55(unsigned char X) {
     // Dumps the registers V0-VX (inclusive) in memory starting at location I. I
-    // is left unmodified.
+    // is left unmodified, the COSMAC VIP leaves it past the last register.
     for (int i = 0; i <= X; i++) {
-        memory[I + i] = V[i];
+        writeMemory((I + i) & ADDRESS_MASK, V[i]);
+    }
+    if (IncrementI) {
+        I += X + 1;
     }
 
     // Increment the program counter
     pc += 2;
 }
 
+template <bool IncrementI>
 void Chip8::opFX65(unsigned char X) {
     // Loads the registers V0-VX (inclusive) in memory starting from location I.
-    // I is left unmodified.
+    // I is left unmodified, the COSMAC VIP leaves it past the last register.
     for (int i = 0; i <= X; i++) {
-        V[i] = memory[I + i];
+        V[i] = readMemory((I + i) & ADDRESS_MASK);
     }
+    if (IncrementI) {
+        I += X + 1;
+    }
+
+    // Increment the program counter
+    pc += 2;
+}
+
+void Chip8::opFX75(unsigned char X) {
+    // Saves the registers V0-VX (inclusive) in the RPL user flags
+    requireSchip(0xF075 | X << 8);
+    memcpy(rplFlags, V, X + 1);
+
+    // Increment the program counter
+    pc += 2;
+}
+
+void Chip8::opFX85(unsigned char X) {
+    // Restores the registers V0-VX (inclusive) from the RPL user flags
+    requireSchip(0xF085 | X << 8);
+    memcpy(V, rplFlags, X + 1);
 
     // Increment the program counter
     pc += 2;
 }
 
+// Both variants of the opcodes with a quirk, for callers in other files
+template void Chip8::op8XY1<false>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY1<true>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY2<false>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY2<true>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY3<false>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY3<true>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY6<false>(unsigned char X, unsigned char Y);
+template void Chip8::op8XY6<true>(unsigned char X, unsigned char Y);
+template void Chip8::op8XYE<false>(unsigned char X, unsigned char Y);
+template void Chip8::op8XYE<true>(unsigned char X, unsigned char Y);
+template void Chip8::opBNNN<false>(unsigned short N);
+template void Chip8::opBNNN<true>(unsigned short N);
+template void Chip8::opDXYN<false>(unsigned char X, unsigned char Y, unsigned char N);
+template void Chip8::opDXYN<true>(unsigned char X, unsigned char Y, unsigned char N);
+template void Chip8::opFX55<false>(unsigned char X);
+template void Chip8::opFX55<true>(unsigned char X);
+template void Chip8::opFX65<false>(unsigned char X);
+template void Chip8::opFX65<true>(unsigned char X);
@@ -7,7 +7,10 @@
 #define CHIP8_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <atomic>
 #include <fstream>
+#include <memory>
 #include <cstring>
 #include <sys/time.h>
 
@@ -20,9 +23,15 @@
 #define REGISTERS 16
 #define GFX_X 64
 #define GFX_Y 32
+#define SCHIP_GFX_X 128
+#define SCHIP_GFX_Y 64
 #define STACK 16
 #define KEYS 16
 
+// Memory and keypad indices wrap around instead of running off the arrays
+#define ADDRESS_MASK (MEMORY - 1)
+#define KEY_MASK (KEYS - 1)
+
 // Program counter starts at 0x200
 // Memory addresses 0x000 - 0x200 is used for the CHIP8 interpreter, will be
 // used to store constants (font data)
@@ -31,12 +40,214 @@
 #define ROM_START 0x200
 #define ROM_END 0xE9F
 
+// Memory is held in pages that forks share until one of them writes, see
+// Chip8::fork()
+#define CHIP8_PAGE_SIZE 256
+#define CHIP8_PAGES (MEMORY / CHIP8_PAGE_SIZE)
+
 #define FONTSET_LEN 80
 
+// 4x5 font for the hex digits, loaded at address 0
+extern const unsigned char CHIP8_FONTSET[FONTSET_LEN];
+
+// SUPER-CHIP 8x10 font for the hex digits, loaded after the small font in
+// CHIP8_MODE_SCHIP
+#define BIG_FONTSET_START FONTSET_LEN
+#define BIG_FONTSET_LEN 160
+extern const unsigned char CHIP8_BIG_FONTSET[BIG_FONTSET_LEN];
+
+// SUPER-CHIP display, two 64 bit words per row of SCHIP_GFX_X pixels
+#define SCHIP_GFX_WORDS (SCHIP_GFX_Y * 2)
+
+// SUPER-CHIP RPL user flags saved by FX75 and restored by FX85
+#define RPL_FLAGS 16
+
 #define CLOCK_HZ 60.0
 #define CLOCK_RATE_MS ((int) ((1.0 / CLOCK_HZ) * 1000 + 0.5))
 #define CPU_CLOCK_HZ 1000
-#define CPU_CLOCK_RATE_US ((int) ((1.0 / CPU_CLOCK_HZ) * 1000000))
+
+// Default number of instructions emulated per 60Hz frame, CPU_CLOCK_HZ
+#define CYCLES_PER_FRAME ((int) (CPU_CLOCK_HZ / CLOCK_HZ + 0.5))
+
+/**
+ * @brief Source of the 60Hz timer ticks. CHIP8_CLOCK_REALTIME follows the
+ * wall clock. CHIP8_CLOCK_VIRTUAL derives ticks from the number of executed
+ * instructions, which makes runs reproducible and lets the core run faster
+ * than real time.
+ */
+enum Chip8Clock {
+    CHIP8_CLOCK_REALTIME,
+    CHIP8_CLOCK_VIRTUAL
+};
+
+/**
+ * @brief Execution engine used by Chip8::runCycles(). CHIP8_CORE_THREADED
+ * runs the decoded instructions in one loop that jumps from handler to
+ * handler. CHIP8_CORE_JIT translates basic blocks to native code and is only
+ * available on x86-64 Linux hosts. CHIP8_CORE_AOT runs the blocks chip8-aot
+ * translated to C++ at build time, see Chip8Aot.
+ */
+enum Chip8Core {
+    CHIP8_CORE_INTERPRETER,
+    CHIP8_CORE_JIT,
+    CHIP8_CORE_THREADED,
+    CHIP8_CORE_AOT
+};
+
+/**
+ * @brief Instruction set. CHIP8_MODE_SCHIP adds the SUPER-CHIP 1.1 opcodes
+ * and its 128x64 display, see Chip8::setMode().
+ */
+enum Chip8Mode {
+    CHIP8_MODE_CHIP8,
+    CHIP8_MODE_SCHIP
+};
+
+/**
+ * @brief Behaviours CHIP-8 interpreters disagree on, combined as bit flags
+ * and selected per ROM with Chip8::setQuirks(). Without any, this emulator
+ * shifts VX in place, leaves I unchanged on FX55/FX65, jumps to NNN + V0,
+ * wraps sprites around the screen edges and leaves VF alone on logic ops.
+ */
+enum Chip8Quirk {
+    CHIP8_QUIRK_SHIFT_VY = 1 << 0,  // 8XY6/8XYE shift VY into VX
+    CHIP8_QUIRK_MEMORY_I = 1 << 1,  // FX55/FX65 leave I past the last register
+    CHIP8_QUIRK_JUMP_VX = 1 << 2,  // BXNN jumps to XNN + VX
+    CHIP8_QUIRK_CLIP = 1 << 3,  // DXYN clips sprites at the edges, SUPER-CHIP always does
+    CHIP8_QUIRK_VF_RESET = 1 << 4  // 8XY1/8XY2/8XY3 set VF to 0
+};
+#define CHIP8_QUIRKS_ALL 0x1F
+
+/**
+ * @brief Parses quirks given by profile, "none", "cosmac" (COSMAC VIP:
+ * shift_vy, memory_i, clip, vf_reset) or "schip" (SUPER-CHIP 1.1: jump_vx,
+ * clip), or as a comma separated list of "shift_vy", "memory_i", "jump_vx",
+ * "clip" and "vf_reset".
+ *
+ * @param text : Profile name or list of quirks
+ * @param quirks : Set to the CHIP8_QUIRK_* flags
+ * @return false if the text names an unknown profile or quirk
+ */
+bool chip8ParseQuirks(const char *text, unsigned int *quirks);
+
+// Save states. A state is a fixed part followed by the memory pages that are
+// not all zero and, in CHIP8_MODE_SCHIP, the SUPER-CHIP display. See
+// Chip8::saveState(). The fixed part of version 2 has no quirks, version 1 no
+// mode, SUPER-CHIP resolution or flags either.
+#define CHIP8_STATE_VERSION 3
+#define CHIP8_STATE_PAGE CHIP8_PAGE_SIZE
+#define CHIP8_STATE_FIXED_SIZE 397
+#define CHIP8_STATE_V2_FIXED_SIZE 396
+#define CHIP8_STATE_V1_FIXED_SIZE 378
+#define CHIP8_STATE_SCHIP_GFX_SIZE (SCHIP_GFX_WORDS * 8)
+#define CHIP8_STATE_MAX_SIZE (CHIP8_STATE_FIXED_SIZE + MEMORY + CHIP8_STATE_SCHIP_GFX_SIZE)
+
+// Buzzer changes kept until Chip8::takeSoundEvents() is called
+#define CHIP8_SOUND_EVENTS 32
+
+/**
+ * @brief The buzzer starting or stopping. The cycle is the number of
+ * instructions executed before the change, see Chip8::getCycles().
+ */
+struct Chip8SoundEvent {
+    unsigned long long cycle;
+    bool on;
+};
+
+// Instruction sequences the threaded core runs as one handler, see
+// Chip8::getFusions()
+#define CHIP8_FUSIONS 12
+
+// Opcode patterns of the sequences, e.g. "7XNN;3XNN;1NNN"
+extern const char *const CHIP8_FUSION_NAMES[CHIP8_FUSIONS];
+
+#ifdef CHIP8_PROFILE
+// Instruction classes counted by the profiler, one per opcode of the table
+// plus one for invalid opcodes. See CHIP8_OPCODE_CLASS_NAMES.
+#define CHIP8_OPCODE_CLASSES 45
+
+// Opcode patterns of the classes, e.g. "8XY4", and "invalid" for the last
+extern const char *const CHIP8_OPCODE_CLASS_NAMES[CHIP8_OPCODE_CLASSES];
+
+/**
+ * @brief Returns the profiler class of an opcode, an index into
+ * CHIP8_OPCODE_CLASS_NAMES
+ */
+unsigned int chip8OpcodeClass(unsigned short opcode);
+
+/**
+ * @brief Execution counters of a profiling build, see Chip8::getProfile().
+ */
+struct Chip8Profile {
+    unsigned long long opcodes[CHIP8_OPCODE_CLASSES];  // Per opcode class
+    unsigned long long addresses[MEMORY];  // Per program counter
+    unsigned long long draws;  // Instructions that set drawFlag
+    unsigned long long keyWaits;  // FX0A executions that found no key
+};
+#endif
+
+/**
+ * @brief The statistics of an instance, which save states leave out, see
+ * Chip8::saveCounters()
+ */
+struct Chip8Counters {
+    unsigned long long fusions[CHIP8_FUSIONS];
+#ifdef CHIP8_PROFILE
+    Chip8Profile profile;
+#endif
+};
+
+class Chip8;
+class Chip8Jit;
+class Chip8Aot;
+class Chip8Bench;
+
+/**
+ * @brief An instruction decoded once, with the handler to run it and all of
+ * its operands already extracted from the opcode. N is the low nibble of NN,
+ * its byte holds the kind so that the struct stays 16 bytes.
+ */
+struct DecodedOp {
+    void (*handler)(Chip8 &chip8, const DecodedOp &op);  // NULL if not decoded
+    unsigned short opcode;
+    unsigned short NNN;
+    unsigned char X;
+    unsigned char Y;
+    unsigned char NN;
+    unsigned char kind;  // Handler of the threaded core, see Chip8::runThreaded()
+};
+
+/**
+ * @brief A page of memory with the decoded instructions at each of its
+ * addresses but the last, whose instruction ends in the next page. refs
+ * counts the page tables holding the page; a page is only written through
+ * the one table holding it, by the one instance holding that table, anyone
+ * else copies it first.
+ */
+struct Chip8Page {
+    unsigned char bytes[CHIP8_PAGE_SIZE];  // First, translated code reads it through the page pointer
+    DecodedOp ops[CHIP8_PAGE_SIZE];  // Decode cache, handler NULL if not decoded
+    std::atomic<unsigned int> refs;
+};
+
+/**
+ * @brief The pages of a memory, shared by an instance and its forks until one
+ * of them writes, which gives the writer a table of its own
+ */
+struct Chip8PageTable {
+    Chip8Page *pages[CHIP8_PAGES];
+    std::atomic<unsigned int> refs;
+};
+
+/**
+ * @brief A display buffer, shared by an instance and its forks like
+ * Chip8PageTable
+ */
+template <int WORDS>
+struct Chip8Display {
+    uint64_t words[WORDS];
+    std::atomic<unsigned int> refs;
+};
 
 /**
  * @brief Calculates time difference in milliseconds
@@ -49,24 +260,114 @@ int timediff_us(struct timeval *end, struct timeval *start);
  * @brief Chip8 system internals
  */
 class Chip8 {
+    friend class Chip8Jit;
+    friend class Chip8Aot;
+    friend class Chip8Bench;  // Calls the opcode handlers directly
+
 private:
     unsigned short pc;  // Program counter
     unsigned short opcode;  // Current opcode
-    unsigned char memory[MEMORY];  // 4KB RAM
     unsigned char V[REGISTERS];  // 16 registers
     unsigned short I;  // Address register (16 bits)
 
-    // Timer registers
-    unsigned char delayTimer;  // Counts down at 60Hz
-    unsigned char soundTimer;  // Counts down at 60Hz, plays a sound when reaches 0
+    // Timer registers. Timers are stored as the tick at which they reach 0
+    // and are only evaluated when an opcode reads them.
+    unsigned long long delayTimerEnd;  // Counts down at 60Hz
+    unsigned long long soundTimerEnd;  // Counts down at 60Hz, the buzzer sounds until it reaches 0
+    bool soundActive;
+
+    // Buzzer changes since the last takeSoundEvents()
+    Chip8SoundEvent soundEvents[CHIP8_SOUND_EVENTS];
+    unsigned int soundEventCount;
+    void pushSoundEvent(unsigned long long cycle, bool on);
+    void updateSound();
+
+    // Clock
+    Chip8Clock clockMode;
+    unsigned long long cycles;  // Number of executed instructions
+    unsigned int cyclesPerTick;  // Instructions per 60Hz tick in CHIP8_CLOCK_VIRTUAL
+    unsigned long long tickBase;  // Tick count at cycleBase in CHIP8_CLOCK_VIRTUAL
+    unsigned long long cycleBase;
+    unsigned long long ticks;  // Tick count in CHIP8_CLOCK_REALTIME
 
     // Timestamp
     struct timeval clockPrev;
 
+    unsigned long long currentTick() const;
+    unsigned char timerValue(unsigned long long end) const;
+    void advanceClock();
+
+    // Executes one instruction, or fast-forwards a wait without passing the
+    // end cycle, see runCycles(). An end of 0 never skips.
+    void step(unsigned long long end);
+    // Fast-forwards key waits, 00FD and delay timer polling loops, see
+    // runCycles()
+    unsigned long long skipIdle(unsigned long long end);
+    // Runs the decoded instructions up to the end cycle with every handler
+    // inlined into one loop, for CHIP8_CORE_THREADED
+    void runThreaded(unsigned long long end);
+    // Runs of each sequence of CHIP8_FUSION_NAMES by runThreaded()
+    unsigned long long fusions[CHIP8_FUSIONS];
+
+    // Random number generator state for CXNN, per instance so that instances
+    // are independent and reproducible
+    unsigned int rngState;
+    unsigned char nextRandom();
+
+    // Execution engine
+    Chip8Core core;
+    Chip8Jit *jit;  // Created on first use of CHIP8_CORE_JIT
+    Chip8Aot *aot;  // Created on first use of CHIP8_CORE_AOT
+
+    // 4KB RAM. The page table, its pages and both displays are shared with
+    // forks until written, so writes go through the writable*() functions,
+    // which copy a shared block first. Reads use the copy of the page
+    // pointers in the object.
+    Chip8PageTable *pageTable;
+    Chip8Page *pages[CHIP8_PAGES];
+
+    unsigned char readMemory(unsigned short address) const {
+        return pages[address / CHIP8_PAGE_SIZE]->bytes[address % CHIP8_PAGE_SIZE];
+    }
+    bool ownsPage(const Chip8Page *page) const;
+    Chip8Page *writablePage(unsigned short address);
+    void writeMemory(unsigned short address, unsigned char value);
+    void writeMemory(unsigned short address, const unsigned char *data, size_t size);
+
+    // Graphics buffer, one 64 bit word per row of GFX_X pixels. The leftmost
+    // pixel of a row is the MSB.
+    Chip8Display<GFX_Y> *gfx;
+    uint64_t *writableGfx();
+
+    // SUPER-CHIP state. The display is always 128x64, row y is the words
+    // 2y (left half) and 2y + 1, so scrolls are word shifts and memmoves.
+    // Low resolution draws 2x2 pixels on it.
+    Chip8Mode mode;
+    unsigned int quirks;  // CHIP8_QUIRK_* flags, decode picks handlers for them
+    bool hires;
+    Chip8Display<SCHIP_GFX_WORDS> *schipGfx;
+    uint64_t *writableSchipGfx();
+    unsigned char rplFlags[RPL_FLAGS];
+    void requireSchip(unsigned short opcode);
+    bool xorSchipRow(uint64_t *row, int x, uint64_t line);
+    void drawSchip(unsigned char X, unsigned char Y, unsigned char N);
+
     // Stack
     unsigned short stack[STACK];  // 16 levels of stack
     unsigned short sp;  // Stack pointer
 
+#ifdef CHIP8_PROFILE
+    Chip8Profile profile;
+#endif
+
+    // The decode cache lives in the pages, filled lazily as instructions are
+    // executed and invalidated when the program writes into them
+    static void decode(unsigned short opcode, unsigned int quirks, DecodedOp &op);
+    // Gives the instruction just decoded at an even address the kind of
+    // the sequence it starts, if any, see CHIP8_FUSIONS
+    void fuse(unsigned short address);
+    void invalidateCode(unsigned short address);
+
     // Opcodes, see https://en.wikipedia.org/wiki/CHIP-8#Opcode_table
     void runOpcode();
     void throwOpcodeNotImplemented(unsigned short opcode);
@@ -74,6 +375,12 @@ private:
     void op0NNN(unsigned short N);
     void op00E0();
     void op00EE();
+    void op00CN(unsigned char N);
+    void op00FB();
+    void op00FC();
+    void op00FD();
+    void op00FE();
+    void op00FF();
     void op1NNN(unsigned short N);
     void op2NNN(unsigned short N);
     void op3XNN(unsigned char X, unsigned char N);
@@ -82,19 +389,21 @@ private:
     void op6XNN(unsigned char X, unsigned char N);
     void op7XNN(unsigned char X, unsigned char N);
     void op8XY0(unsigned char X, unsigned char Y);
-    void op8XY1(unsigned char X, unsigned char Y);
-    void op8XY2(unsigned char X, unsigned char Y);
-    void op8XY3(unsigned char X, unsigned char Y);
+    // Opcodes with a quirk are instantiated with and without it, so the
+    // handler decoded for an instance never tests its quirks
+    template <bool ResetVF = false> void op8XY1(unsigned char X, unsigned char Y);
+    template <bool ResetVF = false> void op8XY2(unsigned char X, unsigned char Y);
+    template <bool ResetVF = false> void op8XY3(unsigned char X, unsigned char Y);
     void op8XY4(unsigned char X, unsigned char Y);
     void op8XY5(unsigned char X, unsigned char Y);
-    void op8XY6(unsigned char X, unsigned char Y);
+    template <bool ShiftVY = false> void op8XY6(unsigned char X, unsigned char Y);
     void op8XY7(unsigned char X, unsigned char Y);
-    void op8XYE(unsigned char X, unsigned char Y);
+    template <bool ShiftVY = false> void op8XYE(unsigned char X, unsigned char Y);
     void op9XY0(unsigned char X, unsigned char Y);
     void opANNN(unsigned short N);
-    void opBNNN(unsigned short N);
+    template <bool JumpVX = false> void opBNNN(unsigned short N);
     void opCXNN(unsigned char X, unsigned char N);
-    void opDXYN(unsigned char X, unsigned char Y, unsigned char N);
+    template <bool Clip = false> void opDXYN(unsigned char X, unsigned char Y, unsigned char N);
     void opEX9E(unsigned char X);
     void opEXA1(unsigned char X);
     void opFX07(unsigned char X);
@@ -103,9 +412,63 @@ private:
     void opFX18(unsigned char X);
     void opFX1E(unsigned char X);
     void opFX29(unsigned char X);
+    void opFX30(unsigned char X);
     void opFX33(unsigned char X);
-    void opFX55(unsigned char X);
-    void opFX65(unsigned char X);
+    template <bool IncrementI = false> void opFX55(unsigned char X);
+    template <bool IncrementI = false> void opFX65(unsigned char X);
+    void opFX75(unsigned char X);
+    void opFX85(unsigned char X);
+
+    // Decode cache handlers, one per opcode
+    static void execInvalid(Chip8 &c, const DecodedOp &op);
+    static void exec0NNN(Chip8 &c, const DecodedOp &op);
+    static void exec00E0(Chip8 &c, const DecodedOp &op);
+    static void exec00EE(Chip8 &c, const DecodedOp &op);
+    static void exec00CN(Chip8 &c, const DecodedOp &op);
+    static void exec00FB(Chip8 &c, const DecodedOp &op);
+    static void exec00FC(Chip8 &c, const DecodedOp &op);
+    static void exec00FD(Chip8 &c, const DecodedOp &op);
+    static void exec00FE(Chip8 &c, const DecodedOp &op);
+    static void exec00FF(Chip8 &c, const DecodedOp &op);
+    static void exec1NNN(Chip8 &c, const DecodedOp &op);
+    static void exec2NNN(Chip8 &c, const DecodedOp &op);
+    static void exec3XNN(Chip8 &c, const DecodedOp &op);
+    static void exec4XNN(Chip8 &c, const DecodedOp &op);
+    static void exec5XY0(Chip8 &c, const DecodedOp &op);
+    static void exec6XNN(Chip8 &c, const DecodedOp &op);
+    static void exec7XNN(Chip8 &c, const DecodedOp &op);
+    static void exec8XY0(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void exec8XY1(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void exec8XY2(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void exec8XY3(Chip8 &c, const DecodedOp &op);
+    static void exec8XY4(Chip8 &c, const DecodedOp &op);
+    static void exec8XY5(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void exec8XY6(Chip8 &c, const DecodedOp &op);
+    static void exec8XY7(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void exec8XYE(Chip8 &c, const DecodedOp &op);
+    static void exec9XY0(Chip8 &c, const DecodedOp &op);
+    static void execANNN(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void execBNNN(Chip8 &c, const DecodedOp &op);
+    static void execCXNN(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void execDXYN(Chip8 &c, const DecodedOp &op);
+    static void execEX9E(Chip8 &c, const DecodedOp &op);
+    static void execEXA1(Chip8 &c, const DecodedOp &op);
+    static void execFX07(Chip8 &c, const DecodedOp &op);
+    static void execFX0A(Chip8 &c, const DecodedOp &op);
+    static void execFX15(Chip8 &c, const DecodedOp &op);
+    static void execFX18(Chip8 &c, const DecodedOp &op);
+    static void execFX1E(Chip8 &c, const DecodedOp &op);
+    static void execFX29(Chip8 &c, const DecodedOp &op);
+    static void execFX30(Chip8 &c, const DecodedOp &op);
+    static void execFX33(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void execFX55(Chip8 &c, const DecodedOp &op);
+    template <bool Quirk> static void execFX65(Chip8 &c, const DecodedOp &op);
+    static void execFX75(Chip8 &c, const DecodedOp &op);
+    static void execFX85(Chip8 &c, const DecodedOp &op);
+
+    // Creates a fork, see fork()
+    struct ForkTag {};
+    Chip8(const Chip8 &parent, ForkTag);
 
 public:
 
@@ -116,15 +479,31 @@ public:
     Chip8();
 
     /**
-     * @brief Destructor. Does nothing for now
+     * @brief Destructor. Releases the JIT and the AOT engine if they were
+     * created, and the memory pages and displays no fork still shares.
      */
     ~Chip8();
 
+    // Owns the engines, so copies are not allowed, see fork()
+    Chip8(const Chip8 &) = delete;
+    Chip8 &operator=(const Chip8 &) = delete;
+
     /**
-     * @brief Graphics buffer. Dimensions are defined by GFX_X and GFX_Y, should
-     * be 64x32. Each value in this buffer is a binary value.
+     * @brief Creates a child in the same state, for searching over inputs
+     * from one position. The child shares the memory pages and displays with
+     * this instance, and whichever of them first writes to a shared page
+     * (FX33, FX55, loading) or display (drawing, clearing, scrolling) copies
+     * it. A fork costs one small allocation and three reference counts, and
+     * memory grows only with the pages the branches write.
+     *
+     * The child keeps the core of this instance, except that forks of
+     * CHIP8_CORE_JIT and CHIP8_CORE_AOT interpret. It starts with no pending
+     * sound events and, in profiling builds, empty counters. Instances
+     * sharing pages may run on different threads.
+     *
+     * @return The child, independent of this instance from now on
      */
-    bool gfx[GFX_X * GFX_Y];  // 64x32 graphics
+    std::unique_ptr<Chip8> fork() const;
 
     /**
      * @brief Drawing flag. When this is true, reload the graphics. The graphics
@@ -139,6 +518,23 @@ public:
      */
     bool key[KEYS];  // Keypad
 
+    /**
+     * @brief Returns true while the sound timer is above 0 and the buzzer
+     * sounds
+     */
+    bool isSoundOn() const;
+
+    /**
+     * @brief Moves the buzzer changes since the last call into a buffer, in
+     * the order they happened. If more than CHIP8_SOUND_EVENTS changes
+     * happened in between, the last kept one is overwritten so the final
+     * state is always right. Loading a state discards pending changes.
+     *
+     * @param events : Buffer of CHIP8_SOUND_EVENTS events
+     * @return Number of events written
+     */
+    unsigned int takeSoundEvents(Chip8SoundEvent *events);
+
     /**
      * @brief Loads a ROM file into memory. The location in memory allocated to ROM
      * data is from 0x200 to 0xE9F, which is defined by ROM_START and ROM_END in
@@ -151,10 +547,241 @@ public:
      */
     void loadRom(const char *path);
 
+    /**
+     * @brief Loads a ROM image already in memory, such as one mapped by
+     * RomLibrary. Only copies the data, the image is not kept.
+     *
+     * @param data : ROM data
+     * @param size : Size of the ROM data
+     * @throws invalid_argument if the ROM is greater than the allocated memory
+     */
+    void loadRom(const unsigned char *data, size_t size);
+
     /**
      * @brief Runs a single clock cycle in emulation.
      */
     void emulateCycle();
+
+    /**
+     * @brief Runs a number of clock cycles in emulation with the selected
+     * execution engine. Both engines give identical results.
+     *
+     * On the virtual clock, loops that only wait are fast-forwarded instead
+     * of executed: FX0A with no key pressed, which cannot end before the
+     * keys change, 00FD halting a SUPER-CHIP program for good, and
+     * "FX07; 3X00; 1NNN" polling the delay timer, which is skipped to the
+     * iteration that reads 0. The result is the same as
+     * executing every instruction.
+     *
+     * @param cycles : Number of instructions to execute
+     */
+    void runCycles(unsigned long long cycles);
+
+    /**
+     * @brief Returns true if the system is waiting in FX0A for a key or
+     * halted by 00FD, with no sound playing, so nothing observable happens
+     * until a key is pressed.
+     */
+    bool isIdle() const;
+
+    /**
+     * @brief Selects the execution engine used by runCycles(). emulateCycle()
+     * always uses the interpreter.
+     *
+     * @param core : CHIP8_CORE_INTERPRETER (default), CHIP8_CORE_THREADED,
+     * CHIP8_CORE_JIT or CHIP8_CORE_AOT. A ROM without a translation linked
+     * in is interpreted on CHIP8_CORE_AOT.
+     * @throws FormattedException if the JIT is not supported on this host, or
+     * for CHIP8_CORE_AOT if no translated ROM is linked in
+     */
+    void setCore(Chip8Core core);
+
+    /**
+     * @brief Selects the instruction set. CHIP8_MODE_SCHIP enables 00CN,
+     * 00FB-00FF, DXY0, FX30 and FX75/FX85, loads the big font at
+     * BIG_FONTSET_START and switches the display to SCHIP_GFX_X by
+     * SCHIP_GFX_Y, starting in low resolution. Call before running the ROM;
+     * the display is cleared.
+     *
+     * @param mode : CHIP8_MODE_CHIP8 (default) or CHIP8_MODE_SCHIP
+     */
+    void setMode(Chip8Mode mode);
+
+    /**
+     * @brief Returns the instruction set selected by setMode()
+     */
+    Chip8Mode getMode() const;
+
+    /**
+     * @brief Selects the behaviour of the opcodes interpreters disagree on.
+     * Handlers are picked for the quirks when an instruction is decoded, so
+     * changing them drops all decoded and translated code. Call before
+     * running the ROM.
+     *
+     * @param quirks : CHIP8_QUIRK_* flags, 0 by default
+     * @throws invalid_argument if a flag is not in CHIP8_QUIRKS_ALL
+     */
+    void setQuirks(unsigned int quirks);
+
+    /**
+     * @brief Returns the flags selected by setQuirks()
+     */
+    unsigned int getQuirks() const;
+
+    /**
+     * @brief Hashes the display with 64 bit FNV-1a. Each row is packed into
+     * 8 bytes per 64 pixels, leftmost pixel in the MSB of the first byte, so
+     * identical screens always give identical hashes. Hashes the display of
+     * the current mode, see getGfx() and getSchipGfx().
+     *
+     * @return 64 bit hash of the current display
+     */
+    unsigned long long hashGfx() const;
+
+    /**
+     * @brief Returns the graphics buffer of CHIP8_MODE_CHIP8. Dimensions are
+     * defined by GFX_X and GFX_Y, should be 64x32. Each of the GFX_Y rows is
+     * packed into a 64 bit word with the leftmost pixel in the MSB.
+     */
+    const uint64_t *getGfx() const;
+
+    /**
+     * @brief Returns the graphics buffer of CHIP8_MODE_SCHIP, SCHIP_GFX_X by
+     * SCHIP_GFX_Y in both resolutions. Each row is 2 words, the left 64
+     * pixels first, leftmost pixel in the MSB.
+     */
+    const uint64_t *getSchipGfx() const;
+
+    /**
+     * @brief Reads a single pixel of the display of the current mode.
+     *
+     * @param x : Column, 0 to GFX_X - 1, or SCHIP_GFX_X - 1 in CHIP8_MODE_SCHIP
+     * @param y : Row, 0 to GFX_Y - 1, or SCHIP_GFX_Y - 1 in CHIP8_MODE_SCHIP
+     * @return true if the pixel is set
+     */
+    bool getPixel(int x, int y) const;
+
+    /**
+     * @brief Selects the source of the 60Hz timer ticks. Timer values are
+     * carried over when switching.
+     *
+     * @param mode : CHIP8_CLOCK_REALTIME (default) or CHIP8_CLOCK_VIRTUAL
+     */
+    void setClockMode(Chip8Clock mode);
+
+    /**
+     * @brief Sets the number of executed instructions per 60Hz tick used by
+     * CHIP8_CLOCK_VIRTUAL. Defaults to CYCLES_PER_FRAME.
+     *
+     * @param cycles : Instructions per tick, must be at least 1
+     * @throws invalid_argument if cycles is 0
+     */
+    void setCyclesPerTick(unsigned int cycles);
+
+    /**
+     * @brief Returns the number of executed instructions per 60Hz tick used
+     * by CHIP8_CLOCK_VIRTUAL
+     */
+    unsigned int getCyclesPerTick() const;
+
+    /**
+     * @brief Seeds the random number generator used by CXNN. Instances with
+     * the same seed and input produce the same results.
+     *
+     * @param seed : Any value, defaults to 0
+     */
+    void setSeed(unsigned int seed);
+
+    /**
+     * @brief Returns the number of instructions executed since construction
+     */
+    unsigned long long getCycles() const;
+
+    /**
+     * @brief Returns how many times CHIP8_CORE_THREADED ran each sequence of
+     * CHIP8_FUSION_NAMES as one handler, since construction. A run that
+     * skips or jumps out of the sequence is counted too.
+     */
+    const unsigned long long *getFusions() const;
+
+    /**
+     * @brief Writes a snapshot of the machine into a buffer. The snapshot
+     * holds the registers, stack, timers, clock, random number generator,
+     * keypad, mode, quirks and display, and the 256 byte memory pages that
+     * are not all zero. Does not allocate.
+     *
+     * @param buffer : Destination, CHIP8_STATE_MAX_SIZE bytes always suffice
+     * @param size : Size of the buffer
+     * @return Number of bytes written
+     * @throws FormattedException if the buffer is too small
+     */
+    size_t saveState(unsigned char *buffer, size_t size) const;
+
+    /**
+     * @brief Restores a snapshot written by saveState(), or of an older
+     * version: version 2 restores without quirks, version 1 also in
+     * CHIP8_MODE_CHIP8. The execution engine is kept and the wall clock of
+     * CHIP8_CLOCK_REALTIME restarts from now. Does not allocate, unless a
+     * page that changes is shared with a fork.
+     *
+     * @param buffer : Snapshot
+     * @param size : Size of the snapshot
+     * @throws FormattedException if the snapshot is invalid or of a newer
+     * version, in which case the machine is unchanged
+     */
+    void loadState(const unsigned char *buffer, size_t size);
+
+    /**
+     * @brief Writes a snapshot to a file, see saveState().
+     *
+     * @param path : Path of the file to create or overwrite
+     * @throws FormattedException if the file cannot be written
+     */
+    void saveStateFile(const char *path) const;
+
+    /**
+     * @brief Restores a snapshot from a file, see loadState().
+     *
+     * @param path : Path of a file written by saveStateFile()
+     * @throws FormattedException if the file cannot be read or is invalid
+     */
+    void loadStateFile(const char *path);
+
+    /**
+     * @brief Copies the statistics, getFusions() and the profile of a
+     * profiling build. Save states do not hold them, so code that runs
+     * frames and then undoes them with loadState(), like run-ahead, restores
+     * them with loadCounters() to leave the counts of the real run.
+     */
+    void saveCounters(Chip8Counters &counters) const;
+
+    /**
+     * @brief Restores statistics copied by saveCounters()
+     */
+    void loadCounters(const Chip8Counters &counters);
+
+#ifdef CHIP8_PROFILE
+    /**
+     * @brief Returns the execution counters. Only profiling builds, made
+     * with CHIP8_PROFILE defined, count instructions; they always run
+     * runCycles() on the interpreter so that every instruction is counted.
+     */
+    const Chip8Profile &getProfile() const;
+
+    /**
+     * @brief Sets all execution counters to 0
+     */
+    void resetProfile();
+
+    /**
+     * @brief Writes the execution counters to a text file: the totals, the
+     * instruction mix and every executed address, hottest first.
+     *
+     * @param path : Path of the file to create or overwrite
+     * @throws FormattedException if the file cannot be written
+     */
+    void dumpProfile(const char *path) const;
+#endif
 };
 
 
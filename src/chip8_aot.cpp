@@ -0,0 +1,138 @@
+/**
+ * @file chip8_aot.cpp
+ * @brief Implementation of the runtime of ahead-of-time translated ROMs
+ */
+
+#include <vector>
+
+#include "chip8_aot.h"
+
+// Programs of the translated files linked in, added by their registrations
+// before main() runs and only read after that
+static std::vector<const Chip8AotProgram *> &programs() {
+    static std::vector<const Chip8AotProgram *> list;
+    return list;
+}
+
+Chip8AotRegistration::Chip8AotRegistration(const Chip8AotProgram &program) {
+    programs().push_back(&program);
+}
+
+bool Chip8Aot::available() {
+    return !programs().empty();
+}
+
+Chip8Aot::Chip8Aot(Chip8 &chip8) : chip8(chip8) {
+    context.V = chip8.V;
+    context.I = &chip8.I;
+    context.pc = &chip8.pc;
+    context.opcode = &chip8.opcode;
+    context.sp = &chip8.sp;
+    context.stack = chip8.stack;
+    context.key = chip8.key;
+    context.pages = chip8.pages;
+
+    select();
+}
+
+void Chip8Aot::select() {
+    program = NULL;
+    quirks = chip8.quirks;
+    for (const Chip8AotProgram *candidate : programs()) {
+        if (candidate->quirks != quirks ||
+                (program != NULL && candidate->size <= program->size)) {
+            continue;
+        }
+        size_t i = 0;
+        while (i < candidate->size && chip8.readMemory(ROM_START + i) == candidate->rom[i]) {
+            i++;
+        }
+        if (i == candidate->size) {
+            program = candidate;
+        }
+    }
+
+    std::fill(blocks, blocks + MEMORY, (const Chip8AotBlock *) NULL);
+    std::fill(covered, covered + MEMORY, false);
+    if (program != NULL) {
+        for (size_t i = 0; i < program->blockCount; i++) {
+            const Chip8AotBlock &block = program->blocks[i];
+            blocks[block.address] = &block;
+            std::fill(covered + block.address, covered + block.address + 2 * block.length, true);
+        }
+    }
+
+    // Nothing is checked yet
+    generation = 1;
+    std::fill(runnable, runnable + MEMORY, (const Chip8AotBlock *) NULL);
+    std::fill(checked, checked + MEMORY, 0);
+}
+
+void Chip8Aot::invalidate(unsigned short address) {
+    if (covered[address & ADDRESS_MASK]) {
+        generation++;
+        std::fill(runnable, runnable + MEMORY, (const Chip8AotBlock *) NULL);
+    }
+}
+
+inline const Chip8AotBlock *Chip8Aot::verify(unsigned short address) {
+    const Chip8AotBlock *block = blocks[address];
+    if (block == NULL || checked[address] == generation) {
+        // No block, or one that did not match in this generation
+        return NULL;
+    }
+    checked[address] = generation;
+
+    for (unsigned int i = 0; i < 2u * block->length; i++) {
+        if (chip8.readMemory(address + i) != program->rom[address + i - ROM_START]) {
+            return NULL;
+        }
+    }
+    runnable[address] = block;
+    return block;
+}
+
+void Chip8Aot::run(unsigned long long cycles) {
+    if (chip8.quirks != quirks) {
+        // The blocks follow the quirks they were translated for
+        select();
+    }
+
+    // The instruction count is kept here while blocks run and stored
+    // whenever the interpreter or the clock needs it
+    unsigned long long now = chip8.cycles;
+    unsigned long long end = now + cycles;
+    while (now < end) {
+        unsigned short pc = chip8.pc;
+        const Chip8AotBlock *block = NULL;
+        if (pc < MEMORY) {
+            block = runnable[pc];
+            if (block == NULL) {
+                block = verify(pc);
+            }
+        }
+
+        if (block != NULL && block->length <= end - now) {
+            unsigned int executed = block->run(context);
+            now += executed;
+            if (chip8.clockMode != CHIP8_CLOCK_VIRTUAL || chip8.soundActive) {
+                chip8.cycles = now;
+                chip8.advanceClock();
+            }
+            if (executed == block->length) {
+                continue;
+            }
+            // The stack error of the last instruction is reported by the
+            // interpreter below
+        }
+
+        // No block, not enough budget left for the whole block, or one that
+        // no longer matches memory
+        chip8.cycles = now;
+        if (block != NULL || chip8.skipIdle(end) == 0) {
+            chip8.emulateCycle();
+        }
+        now = chip8.cycles;
+    }
+    chip8.cycles = now;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file chip8_aot.h
+ * @brief Runtime of the ROMs translated ahead of time to C++ by chip8-aot
+ */
+
+#ifndef CHIP8_AOT_H
+#define CHIP8_AOT_H
+
+#include "chip8.h"
+
+// Maximum number of CHIP8 instructions translated into one block
+#define AOT_MAX_BLOCK 64
+
+/**
+ * @brief The registers of a Chip8 as translated blocks see them. Filled in
+ * once per instance, the pointers stay valid for its lifetime.
+ */
+struct Chip8AotContext {
+    unsigned char *V;
+    unsigned short *I;
+    unsigned short *pc;
+    unsigned short *opcode;
+    unsigned short *sp;
+    unsigned short *stack;
+    const bool *key;
+    Chip8Page *const *pages;  // The page pointers of the instance, see Chip8::readMemory()
+
+    unsigned char read(unsigned short address) const {
+        return pages[address / CHIP8_PAGE_SIZE]->bytes[address % CHIP8_PAGE_SIZE];
+    }
+};
+
+/**
+ * @brief A translated block. Runs the instructions from address up to and
+ * including its last one, stores the next pc and the last opcode as the
+ * interpreter leaves them, and returns the number of instructions executed.
+ * That is less than length only when the last instruction is a call or
+ * return that overflows or underflows the stack; the pc is then left on that
+ * instruction for the interpreter to report.
+ */
+typedef unsigned int (*Chip8AotFunction)(const Chip8AotContext &c);
+
+struct Chip8AotBlock {
+    unsigned short address;
+    unsigned short length;  // Instructions, the block covers 2 * length bytes
+    Chip8AotFunction run;
+};
+
+/**
+ * @brief The translation of one ROM, as written by chip8-aot
+ */
+struct Chip8AotProgram {
+    const char *name;  // ROM file name without the extension
+    const unsigned char *rom;  // The ROM the blocks were translated from
+    size_t size;
+    unsigned int quirks;  // CHIP8_QUIRK_* flags the blocks follow
+    const Chip8AotBlock *blocks;  // Sorted by address
+    size_t blockCount;
+};
+
+/**
+ * @brief Adds a program to the ones Chip8Aot picks from. Translated files
+ * hold one of these, so linking the file is all it takes to use it.
+ */
+struct Chip8AotRegistration {
+    Chip8AotRegistration(const Chip8AotProgram &program);
+};
+
+/**
+ * @class Chip8Aot
+ * @brief Runs a Chip8 on the blocks translated ahead of time for its ROM,
+ * the engine of CHIP8_CORE_AOT.
+ *
+ * The program is picked when the ROM is loaded, by comparing memory with the
+ * ROMs of the linked programs translated for the quirks in use. Before a
+ * block runs for the first time, and again after anything wrote to the bytes
+ * of a block (FX33, FX55, loading a state), its bytes are compared with the
+ * ROM it was translated from; blocks that no longer match, addresses without
+ * a block and the instructions that are never translated run on the
+ * interpreter. Like the JIT, translations leave out instructions that touch
+ * the display, timers, keypad waits, random numbers or write memory.
+ */
+class Chip8Aot {
+private:
+    Chip8 &chip8;
+    Chip8AotContext context;
+
+    const Chip8AotProgram *program;  // NULL if no linked program matches
+    unsigned int quirks;  // Of the Chip8 when the program was picked
+    // Block starting at each address, or NULL
+    const Chip8AotBlock *blocks[MEMORY];
+    // Bytes of memory that are part of a block
+    bool covered[MEMORY];
+
+    // Blocks that matched memory since the last write to a covered byte, by
+    // address. Filled by verify(), which compares a block at most once per
+    // generation, and cleared when a covered byte is written.
+    const Chip8AotBlock *runnable[MEMORY];
+    unsigned int generation;
+    unsigned int checked[MEMORY];  // Generation of the last comparison
+
+    const Chip8AotBlock *verify(unsigned short address);
+
+public:
+    /**
+     * @brief Returns true if any translated program is linked in
+     */
+    static bool available();
+
+    /**
+     * @brief Creates the engine of a Chip8 instance and picks the program
+     * for the ROM in its memory, see select()
+     */
+    Chip8Aot(Chip8 &chip8);
+
+    // Holds a reference to its Chip8, so copies are not allowed
+    Chip8Aot(const Chip8Aot &) = delete;
+    Chip8Aot &operator=(const Chip8Aot &) = delete;
+
+    /**
+     * @brief Picks the linked program whose ROM is in memory at ROM_START,
+     * the longest if several are, among those translated for the quirks of
+     * the Chip8. Called after loading a ROM, and by run() if the quirks
+     * changed since.
+     */
+    void select();
+
+    /**
+     * @brief Runs a number of cycles on the translated blocks, and on the
+     * interpreter where there are none
+     *
+     * @param cycles : Number of instructions to execute
+     */
+    void run(unsigned long long cycles);
+
+    /**
+     * @brief Notifies the engine that a byte of memory was written. Blocks
+     * are compared with memory again if the byte is part of one.
+     */
+    void invalidate(unsigned short address);
+};
+
+#endif
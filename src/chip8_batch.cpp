@@ -0,0 +1,773 @@
+/**
+ * @file chip8_batch.cpp
+ * @brief Implementation of the lockstep batch engine
+ */
+
+#include <algorithm>
+
+#include "chip8_batch.h"
+
+// Build the lane loops for AVX2 as well as the baseline and pick one at load
+// time
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#define BATCH_INLINE inline __attribute__((always_inline))
+#else
+#define BATCH_CLONES
+#define BATCH_INLINE inline
+#endif
+
+// Operations, one per opcode
+enum {
+    BATCH_INVALID,
+    BATCH_0NNN,
+    BATCH_00E0,
+    BATCH_00EE,
+    BATCH_1NNN,
+    BATCH_2NNN,
+    BATCH_3XNN,
+    BATCH_4XNN,
+    BATCH_5XY0,
+    BATCH_6XNN,
+    BATCH_7XNN,
+    BATCH_8XY0,
+    BATCH_8XY1,
+    BATCH_8XY2,
+    BATCH_8XY3,
+    BATCH_8XY4,
+    BATCH_8XY5,
+    BATCH_8XY6,
+    BATCH_8XY7,
+    BATCH_8XYE,
+    BATCH_9XY0,
+    BATCH_ANNN,
+    BATCH_BNNN,
+    BATCH_CXNN,
+    BATCH_DXYN,
+    BATCH_EX9E,
+    BATCH_EXA1,
+    BATCH_FX07,
+    BATCH_FX0A,
+    BATCH_FX15,
+    BATCH_FX18,
+    BATCH_FX1E,
+    BATCH_FX29,
+    BATCH_FX33,
+    BATCH_FX55,
+    BATCH_FX65
+};
+
+Chip8Batch::Chip8Batch(unsigned int lanes) {
+    if (lanes == 0) {
+        throw std::invalid_argument("A batch needs at least 1 lane");
+    }
+    this->lanes = lanes;
+
+    // Blank program image with the font
+    std::fill(image, image + MEMORY, 0);
+    memcpy(image, CHIP8_FONTSET, FONTSET_LEN);
+    std::fill(imageDecoded, imageDecoded + MEMORY, false);
+    std::fill(overwritten, overwritten + MEMORY, 0);
+
+    pc.assign(lanes, ROM_START);
+    I.assign(lanes, 0);
+    sp.assign(lanes, 0);
+    V.assign(REGISTERS * lanes, 0);
+    stack.assign(STACK * lanes, 0);
+    gfx.assign(GFX_Y * lanes, 0);
+    delayTimerEnd.assign(lanes, 0);
+    soundTimerEnd.assign(lanes, 0);
+    keys.assign(lanes, 0);
+    rngState.assign(lanes, 0);
+
+    memory.resize((size_t) MEMORY * lanes);
+    for (unsigned int lane = 0; lane < lanes; lane++) {
+        memcpy(&memory[(size_t) lane * MEMORY], image, MEMORY);
+    }
+
+    halted.assign(lanes, false);
+    haltCycles.assign(lanes, 0);
+    errors.assign(lanes, std::string());
+
+    cycles = 0;
+    cyclesPerTick = CYCLES_PER_FRAME;
+    tickBase = 0;
+    cycleBase = 0;
+
+    // All lanes start in one group at ROM_START
+    order.resize(lanes);
+    for (unsigned int lane = 0; lane < lanes; lane++) {
+        order[lane] = lane;
+    }
+    groups.push_back(LaneGroup { ROM_START, 0, lanes });
+    sharedLanes.reserve(lanes);
+    halts = 0;
+    haltsSeen = 0;
+}
+
+void Chip8Batch::loadRom(const char *path) {
+    // Open ROM file in binary mode
+    std::ifstream infile(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!infile) {
+        throw FormattedException("Could not open ROM file: %s\n", path);
+    }
+
+    // Check that ROM file size fits
+    int length = infile.tellg();
+    infile.seekg(infile.beg);
+    if (length > ROM_END - ROM_START) {
+        throw std::invalid_argument("ROM file too big");
+    }
+
+    unsigned char buffer[ROM_END - ROM_START];
+    infile.read((char *) buffer, length);
+    loadRom(buffer, length);
+}
+
+void Chip8Batch::loadRom(const unsigned char *data, size_t size) {
+    if (size > ROM_END - ROM_START) {
+        throw std::invalid_argument("ROM file too big");
+    }
+
+    // Write the ROM to the shared image, then copy it to every lane
+    std::fill(image + ROM_START, image + ROM_END, 0);
+    if (size > 0) {
+        memcpy(image + ROM_START, data, size);
+    }
+    std::fill(imageDecoded, imageDecoded + MEMORY, false);
+    std::fill(overwritten + ROM_START, overwritten + ROM_END, 0);
+
+    for (unsigned int lane = 0; lane < lanes; lane++) {
+        memcpy(&memory[(size_t) lane * MEMORY + ROM_START], image + ROM_START,
+                ROM_END - ROM_START);
+    }
+}
+
+void Chip8Batch::runCycles(unsigned long long cycles) {
+    for (unsigned long long i = 0; i < cycles && !groups.empty(); i++) {
+        step();
+    }
+}
+
+void Chip8Batch::step() {
+    for (const LaneGroup &group : groups) {
+        runGroup(group.address, &order[group.begin], group.count);
+    }
+
+    cycles++;
+    regroup();
+}
+
+void Chip8Batch::regroup() {
+    bool newHalts = halts != haltsSeen;
+    haltsSeen = halts;
+
+    // A group stays together unless its lanes took different branches
+    nextGroups.clear();
+    for (const LaneGroup &group : groups) {
+        unsigned int *members = &order[group.begin];
+        unsigned int count = group.count;
+        if (newHalts) {
+            count = std::remove_if(members, members + count,
+                    [this](unsigned int lane) { return halted[lane]; }) - members;
+            if (count == 0) {
+                continue;
+            }
+        }
+
+        unsigned short address = pc[members[0]];
+        unsigned int same = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            same += pc[members[i]] == address;
+        }
+        if (same == count) {
+            addGroup(address, group.begin, count);
+            continue;
+        }
+
+        // Split by program counter, keeping the lanes of each part in order
+        std::sort(members, members + count, [this](unsigned int a, unsigned int b) {
+            return pc[a] < pc[b] || (pc[a] == pc[b] && a < b);
+        });
+        unsigned int start = 0;
+        for (unsigned int i = 1; i <= count; i++) {
+            if (i == count || pc[members[i]] != pc[members[start]]) {
+                addGroup(pc[members[start]], group.begin + start, i - start);
+                start = i;
+            }
+        }
+    }
+
+    // Groups that moved to the same address or past each other are merged
+    // and sorted again
+    auto unordered = [](const LaneGroup &a, const LaneGroup &b) {
+        return a.address >= b.address;
+    };
+    if (std::adjacent_find(nextGroups.begin(), nextGroups.end(), unordered) ==
+            nextGroups.end()) {
+        groups.swap(nextGroups);
+        return;
+    }
+
+    std::sort(nextGroups.begin(), nextGroups.end(),
+            [](const LaneGroup &a, const LaneGroup &b) { return a.address < b.address; });
+    nextOrder.clear();
+    groups.clear();
+    for (unsigned int i = 0; i < nextGroups.size(); ) {
+        unsigned short address = nextGroups[i].address;
+        unsigned int begin = nextOrder.size();
+        unsigned int merged = 0;
+        for (; i < nextGroups.size() && nextGroups[i].address == address; i++) {
+            const unsigned int *members = &order[nextGroups[i].begin];
+            nextOrder.insert(nextOrder.end(), members, members + nextGroups[i].count);
+            merged++;
+        }
+        if (merged > 1) {
+            std::sort(nextOrder.begin() + begin, nextOrder.end());
+        }
+        groups.push_back(LaneGroup { address, begin, (unsigned int) nextOrder.size() - begin });
+    }
+    order.swap(nextOrder);
+}
+
+void Chip8Batch::addGroup(unsigned short address, unsigned int begin, unsigned int count) {
+    if (address > ROM_END || address < ROM_START) {
+        for (unsigned int i = 0; i < count; i++) {
+            halt(order[begin + i], "Program Counter out of range: %X", address);
+        }
+        return;
+    }
+    nextGroups.push_back(LaneGroup { address, begin, count });
+}
+
+template <typename Lanes>
+BATCH_INLINE void Chip8Batch::execute(BatchOp op, const Lanes &group) {
+    const unsigned int n = group.size();
+    const unsigned int stride = lanes;
+    unsigned short *pc = this->pc.data();
+    unsigned short *I = this->I.data();
+    unsigned char *vx = &V[op.X * stride];
+    unsigned char *vy = &V[op.Y * stride];
+    unsigned char *v0 = &V[0];
+    unsigned char *vf = &V[0xF * stride];
+
+    switch (op.kind) {
+        case BATCH_INVALID:
+            for (unsigned int i = 0; i < n; i++) {
+                halt(group[i], "Opcode not found, 0x%X", op.opcode);
+            }
+            break;
+
+        case BATCH_0NNN:
+            for (unsigned int i = 0; i < n; i++) {
+                halt(group[i], "Opcode not found, 0x%X", op.NNN);
+            }
+            break;
+
+        case BATCH_00E0:
+            // Clear display
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                for (int y = 0; y < GFX_Y; y++) {
+                    gfx[y * stride + l] = 0;
+                }
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_00EE:
+            // Return from function
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                if (sp[l] == 0) {
+                    halt(l, "Stack underflow at PC: %X", pc[l]);
+                    continue;
+                }
+                sp[l]--;
+                pc[l] = stack[sp[l] * stride + l] + 2;
+            }
+            break;
+
+        case BATCH_1NNN:
+            for (unsigned int i = 0; i < n; i++) {
+                pc[group[i]] = op.NNN;
+            }
+            break;
+
+        case BATCH_2NNN:
+            // Calls subroutine at NNN
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                if (sp[l] >= STACK) {
+                    halt(l, "Stack overflow at PC: %X", pc[l]);
+                    continue;
+                }
+                stack[sp[l] * stride + l] = pc[l];
+                sp[l]++;
+                pc[l] = op.NNN;
+            }
+            break;
+
+        case BATCH_3XNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += vx[l] == op.NN ? 4 : 2;
+            }
+            break;
+
+        case BATCH_4XNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += vx[l] != op.NN ? 4 : 2;
+            }
+            break;
+
+        case BATCH_5XY0:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += vx[l] == vy[l] ? 4 : 2;
+            }
+            break;
+
+        case BATCH_6XNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] = op.NN;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_7XNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] += op.NN;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY0:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] = vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY1:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] |= vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY2:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] &= vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY3:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] ^= vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        // The flag is written before VX, in the same order as Chip8, so X or
+        // Y being F gives the same result
+        case BATCH_8XY4:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                unsigned char sum = vx[l] + vy[l];
+                vf[l] = sum < vx[l];
+                vx[l] += vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY5:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vf[l] = vy[l] <= vx[l];
+                vx[l] -= vy[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY6:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vf[l] = vx[l] & 1;
+                vx[l] >>= 1;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XY7:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vf[l] = vx[l] <= vy[l];
+                vx[l] = vy[l] - vx[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_8XYE:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vf[l] = vx[l] >> 7;
+                vx[l] <<= 1;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_9XY0:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += vx[l] != vy[l] ? 4 : 2;
+            }
+            break;
+
+        case BATCH_ANNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                I[l] = op.NNN;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_BNNN:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] = op.NNN + v0[l];
+            }
+            break;
+
+        case BATCH_CXNN:
+            // Same generator as Chip8::nextRandom()
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                rngState[l] = rngState[l] * 1103515245 + 12345;
+                vx[l] = op.NN & (rngState[l] >> 16);
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_DXYN:
+            // Same drawing as Chip8::opDXYN()
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                const unsigned char *mem = &memory[(size_t) l * MEMORY];
+                unsigned char x = vx[l] % GFX_X;
+                unsigned char y = vy[l] % GFX_Y;
+                unsigned char collision = 0;
+
+                for (int h = 0; h < op.N; h++) {
+                    uint64_t line = (uint64_t) mem[(I[l] + h) & ADDRESS_MASK] << (GFX_X - 8);
+                    if (x != 0) {
+                        line = (line >> x) | (line << (GFX_X - x));
+                    }
+
+                    uint64_t &row = gfx[((y + h) % GFX_Y) * stride + l];
+                    collision |= (row & line) != 0;
+                    row ^= line;
+                }
+
+                vf[l] = collision;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_EX9E:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += (keys[l] >> (vx[l] & KEY_MASK)) & 1 ? 4 : 2;
+            }
+            break;
+
+        case BATCH_EXA1:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                pc[l] += (keys[l] >> (vx[l] & KEY_MASK)) & 1 ? 2 : 4;
+            }
+            break;
+
+        case BATCH_FX07:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                vx[l] = timerValue(delayTimerEnd[l]);
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX0A:
+            // Waits on the same instruction until a key is down, the lowest
+            // key wins
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                if (keys[l] != 0) {
+                    vx[l] = __builtin_ctz(keys[l]);
+                    pc[l] += 2;
+                }
+            }
+            break;
+
+        case BATCH_FX15:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                delayTimerEnd[l] = currentTick() + vx[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX18:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                soundTimerEnd[l] = currentTick() + vx[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX1E:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                I[l] += vx[l];
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX29:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                I[l] = vx[l] * 0x5;
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX33:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                writeMemory(l, I[l], vx[l] / 100);
+                writeMemory(l, I[l] + 1, (vx[l] / 10) % 10);
+                writeMemory(l, I[l] + 2, vx[l] % 10);
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX55:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                for (int r = 0; r <= op.X; r++) {
+                    writeMemory(l, I[l] + r, V[r * stride + l]);
+                }
+                pc[l] += 2;
+            }
+            break;
+
+        case BATCH_FX65:
+            for (unsigned int i = 0; i < n; i++) {
+                size_t l = group[i];
+                const unsigned char *mem = &memory[(size_t) l * MEMORY];
+                for (int r = 0; r <= op.X; r++) {
+                    V[r * stride + l] = mem[(I[l] + r) & ADDRESS_MASK];
+                }
+                pc[l] += 2;
+            }
+            break;
+    }
+}
+
+BATCH_CLONES
+void Chip8Batch::runGroup(unsigned short address, const unsigned int *group,
+        unsigned int count) {
+    BatchOp &op = imageOps[address];
+    if (!imageDecoded[address]) {
+        decode(image[address] << 8 | image[address + 1], op);
+        imageDecoded[address] = true;
+    }
+
+    if (overwritten[address] == 0 && overwritten[address + 1] == 0) {
+        // Every lane still holds the shared program here
+        // Lanes are sorted, so they are adjacent if the group spans no gaps
+        if (group[count - 1] - group[0] == count - 1) {
+            execute(op, LaneRange { group[0], group[0] + count });
+        } else {
+            execute(op, LaneList { group, count });
+        }
+        return;
+    }
+
+    // Some lane wrote over the shared program here, split off the lanes whose
+    // own instruction differs. The buffer is kept across calls, so this does
+    // not allocate.
+    sharedLanes.clear();
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned char *own = &memory[(size_t) group[i] * MEMORY + address];
+        unsigned short opcode = own[0] << 8 | own[1];
+        if (opcode == op.opcode) {
+            sharedLanes.push_back(group[i]);
+        } else {
+            BatchOp ownOp;
+            decode(opcode, ownOp);
+            execute(ownOp, LaneList { &group[i], 1 });
+        }
+    }
+    if (!sharedLanes.empty()) {
+        execute(op, LaneList { sharedLanes.data(), (unsigned int) sharedLanes.size() });
+    }
+}
+
+void Chip8Batch::writeMemory(unsigned int lane, unsigned short address,
+        unsigned char value) {
+    address &= ADDRESS_MASK;
+    unsigned char &byte = memory[(size_t) lane * MEMORY + address];
+
+    // Keep count of the lanes that differ from the shared image
+    overwritten[address] += (value != image[address]) - (byte != image[address]);
+    byte = value;
+}
+
+void Chip8Batch::decode(unsigned short opcode, BatchOp &op) {
+    // Same operands and opcode table as Chip8::decode()
+    op.opcode = opcode;
+    op.NNN = opcode & 0x0FFF;
+    op.X = (opcode & 0x0F00) >> 8;
+    op.Y = (opcode & 0x00F0) >> 4;
+    op.NN = opcode & 0x00FF;
+    op.N = opcode & 0x000F;
+    op.kind = BATCH_INVALID;
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (opcode == 0x00E0) {
+                op.kind = BATCH_00E0;
+            } else if (opcode == 0x00EE) {
+                op.kind = BATCH_00EE;
+            } else {
+                op.kind = BATCH_0NNN;
+            }
+            break;
+
+        case 0x1000: op.kind = BATCH_1NNN; break;
+        case 0x2000: op.kind = BATCH_2NNN; break;
+        case 0x3000: op.kind = BATCH_3XNN; break;
+        case 0x4000: op.kind = BATCH_4XNN; break;
+        case 0x5000: op.kind = BATCH_5XY0; break;
+        case 0x6000: op.kind = BATCH_6XNN; break;
+        case 0x7000: op.kind = BATCH_7XNN; break;
+
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0: op.kind = BATCH_8XY0; break;
+                case 0x1: op.kind = BATCH_8XY1; break;
+                case 0x2: op.kind = BATCH_8XY2; break;
+                case 0x3: op.kind = BATCH_8XY3; break;
+                case 0x4: op.kind = BATCH_8XY4; break;
+                case 0x5: op.kind = BATCH_8XY5; break;
+                case 0x6: op.kind = BATCH_8XY6; break;
+                case 0x7: op.kind = BATCH_8XY7; break;
+                case 0xE: op.kind = BATCH_8XYE; break;
+            }
+            break;
+
+        case 0x9000: op.kind = BATCH_9XY0; break;
+        case 0xA000: op.kind = BATCH_ANNN; break;
+        case 0xB000: op.kind = BATCH_BNNN; break;
+        case 0xC000: op.kind = BATCH_CXNN; break;
+        case 0xD000: op.kind = BATCH_DXYN; break;
+
+        case 0xE000:
+            switch (opcode & 0x00FF) {
+                case 0x9E: op.kind = BATCH_EX9E; break;
+                case 0xA1: op.kind = BATCH_EXA1; break;
+            }
+            break;
+
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x07: op.kind = BATCH_FX07; break;
+                case 0x0A: op.kind = BATCH_FX0A; break;
+                case 0x15: op.kind = BATCH_FX15; break;
+                case 0x18: op.kind = BATCH_FX18; break;
+                case 0x1E: op.kind = BATCH_FX1E; break;
+                case 0x29: op.kind = BATCH_FX29; break;
+                case 0x33: op.kind = BATCH_FX33; break;
+                case 0x55: op.kind = BATCH_FX55; break;
+                case 0x65: op.kind = BATCH_FX65; break;
+            }
+            break;
+    }
+}
+
+void Chip8Batch::halt(unsigned int lane, const char *format, unsigned int value) {
+    char message[64];
+    snprintf(message, sizeof(message), format, value);
+    errors[lane] = message;
+    halted[lane] = true;
+    halts++;
+    haltCycles[lane] = cycles;
+}
+
+unsigned long long Chip8Batch::currentTick() const {
+    return tickBase + (cycles - cycleBase) / cyclesPerTick;
+}
+
+unsigned char Chip8Batch::timerValue(unsigned long long end) const {
+    unsigned long long now = currentTick();
+    return end > now ? end - now : 0;
+}
+
+void Chip8Batch::setCyclesPerTick(unsigned int cycles) {
+    if (cycles == 0) {
+        throw std::invalid_argument("Cycles per tick must be at least 1");
+    }
+
+    // Restart the current tick with the new rate
+    tickBase = currentTick();
+    cycleBase = this->cycles;
+    cyclesPerTick = cycles;
+}
+
+void Chip8Batch::setSeed(unsigned int lane, unsigned int seed) {
+    rngState[lane] = seed;
+}
+
+void Chip8Batch::setKey(unsigned int lane, unsigned char key, bool pressed) {
+    unsigned short bit = 1 << (key & KEY_MASK);
+    keys[lane] = pressed ? keys[lane] | bit : keys[lane] & ~bit;
+}
+
+unsigned int Chip8Batch::size() const {
+    return lanes;
+}
+
+unsigned long long Chip8Batch::getCycles(unsigned int lane) const {
+    return halted[lane] ? haltCycles[lane] : cycles;
+}
+
+const std::string &Chip8Batch::getError(unsigned int lane) const {
+    return errors[lane];
+}
+
+unsigned long long Chip8Batch::hashGfx(unsigned int lane) const {
+    // Same 64 bit FNV-1a as Chip8::hashGfx()
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+
+    for (int y = 0; y < GFX_Y; y++) {
+        uint64_t row = gfx[y * lanes + lane];
+        for (int shift = GFX_X - 8; shift >= 0; shift -= 8) {
+            hash ^= (row >> shift) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    }
+
+    return hash;
+}
+
+bool Chip8Batch::getPixel(unsigned int lane, int x, int y) const {
+    return (gfx[y * lanes + lane] >> (GFX_X - 1 - x)) & 1;
+}
@@ -0,0 +1,217 @@
+/**
+ * @file chip8_batch.h
+ * @brief Lockstep engine that runs many instances of the same ROM together
+ */
+
+#ifndef CHIP8_BATCH_H
+#define CHIP8_BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+/**
+ * @class Chip8Batch
+ * @brief Runs a number of lanes, each a complete CHIP8 system, one
+ * instruction per lane per step. All lanes start from the same program image
+ * and keep their state in structure-of-arrays layout, one array per register
+ * with one entry per lane.
+ *
+ * Every step, the lanes are grouped by program counter and each group
+ * executes its decoded instruction as one loop over its lanes, which the
+ * compiler vectorizes when the lanes are adjacent. A lane whose own memory no
+ * longer holds the shared program at its program counter is split off and
+ * decoded on its own.
+ *
+ * Lanes always use the virtual clock and give the same results as a Chip8
+ * with the same seed and input. A lane that hits an error stops, the others
+ * keep running. The sound timer does not beep.
+ */
+class Chip8Batch {
+private:
+    // Instruction decoded to an operation and its operands
+    struct BatchOp {
+        unsigned char kind;
+        unsigned char X;
+        unsigned char Y;
+        unsigned char NN;
+        unsigned char N;
+        unsigned short NNN;
+        unsigned short opcode;
+    };
+
+    // Adjacent lanes begin to end - 1
+    struct LaneRange {
+        unsigned int begin;
+        unsigned int end;
+        unsigned int size() const { return end - begin; }
+        size_t operator[](unsigned int i) const { return (size_t) begin + i; }
+    };
+
+    // Arbitrary lanes
+    struct LaneList {
+        const unsigned int *lanes;
+        unsigned int count;
+        unsigned int size() const { return count; }
+        size_t operator[](unsigned int i) const { return lanes[i]; }
+    };
+
+    unsigned int lanes;
+
+    // Program image shared by all lanes, decoded lazily by address
+    unsigned char image[MEMORY];
+    BatchOp imageOps[MEMORY];
+    bool imageDecoded[MEMORY];
+    // Number of lanes whose memory differs from the image at each address
+    unsigned int overwritten[MEMORY];
+
+    // Per lane state. Registers, stack and display rows are stored as
+    // [index * lanes + lane], memory as [lane * MEMORY + address].
+    std::vector<unsigned short> pc;
+    std::vector<unsigned short> I;
+    std::vector<unsigned short> sp;
+    std::vector<unsigned char> V;
+    std::vector<unsigned short> stack;
+    std::vector<uint64_t> gfx;
+    std::vector<unsigned char> memory;
+    std::vector<unsigned long long> delayTimerEnd;
+    std::vector<unsigned long long> soundTimerEnd;
+    std::vector<unsigned short> keys;  // One bit per key
+    std::vector<unsigned int> rngState;
+
+    // Running lanes sharing a program counter, order[begin] to
+    // order[begin + count - 1]
+    struct LaneGroup {
+        unsigned short address;
+        unsigned int begin;
+        unsigned int count;
+    };
+
+    // Lanes of each group in ascending order, groups sorted by address
+    std::vector<unsigned int> order;
+    std::vector<LaneGroup> groups;
+    std::vector<unsigned int> nextOrder;
+    std::vector<LaneGroup> nextGroups;
+    // Lanes of a group still holding the image instruction, see runGroup()
+    std::vector<unsigned int> sharedLanes;
+
+    std::vector<bool> halted;
+    unsigned int halts;  // Number of lanes that stopped
+    unsigned int haltsSeen;  // Value of halts at the last regroup()
+    std::vector<unsigned long long> haltCycles;
+    std::vector<std::string> errors;
+
+    // Shared virtual clock, all running lanes have executed cycles
+    // instructions
+    unsigned long long cycles;
+    unsigned int cyclesPerTick;
+    unsigned long long tickBase;
+    unsigned long long cycleBase;
+
+    unsigned long long currentTick() const;
+    unsigned char timerValue(unsigned long long end) const;
+
+    static void decode(unsigned short opcode, BatchOp &op);
+    void step();
+    void regroup();
+    void addGroup(unsigned short address, unsigned int begin, unsigned int count);
+    void runGroup(unsigned short address, const unsigned int *group, unsigned int count);
+    template <typename Lanes>
+    void execute(BatchOp op, const Lanes &group);
+    void writeMemory(unsigned int lane, unsigned short address, unsigned char value);
+    void halt(unsigned int lane, const char *format, unsigned int value);
+
+public:
+    /**
+     * @brief Creates a batch of blank lanes, each loaded with the fontset.
+     *
+     * @param lanes : Number of instances, at least 1
+     * @throws invalid_argument if lanes is 0
+     */
+    Chip8Batch(unsigned int lanes);
+
+    /**
+     * @brief Loads a ROM file into the memory of every lane. See
+     * Chip8::loadRom().
+     *
+     * @param path : Path to the ROM file
+     * @throws FormattedException if the file cannot be opened
+     * @throws invalid_argument if the ROM file is greater than the allocated memory
+     */
+    void loadRom(const char *path);
+
+    /**
+     * @brief Loads a ROM image already in memory into every lane. See
+     * Chip8::loadRom().
+     *
+     * @param data : ROM data
+     * @param size : Size of the ROM data
+     * @throws invalid_argument if the ROM is greater than the allocated memory
+     */
+    void loadRom(const unsigned char *data, size_t size);
+
+    /**
+     * @brief Runs every lane for a number of instructions in lockstep.
+     *
+     * @param cycles : Number of instructions to execute per lane
+     */
+    void runCycles(unsigned long long cycles);
+
+    /**
+     * @brief Sets the number of executed instructions per 60Hz tick for all
+     * lanes. Defaults to CYCLES_PER_FRAME.
+     *
+     * @param cycles : Instructions per tick, must be at least 1
+     * @throws invalid_argument if cycles is 0
+     */
+    void setCyclesPerTick(unsigned int cycles);
+
+    /**
+     * @brief Seeds the random number generator of one lane, see
+     * Chip8::setSeed().
+     */
+    void setSeed(unsigned int lane, unsigned int seed);
+
+    /**
+     * @brief Presses or releases a key of one lane.
+     *
+     * @param lane : Lane index
+     * @param key : Key, 0 to KEYS - 1
+     * @param pressed : true if the key is down
+     */
+    void setKey(unsigned int lane, unsigned char key, bool pressed);
+
+    /**
+     * @brief Returns the number of lanes
+     */
+    unsigned int size() const;
+
+    /**
+     * @brief Returns the number of instructions a lane has executed
+     */
+    unsigned long long getCycles(unsigned int lane) const;
+
+    /**
+     * @brief Returns the error that stopped a lane, or an empty string if the
+     * lane is still running
+     */
+    const std::string &getError(unsigned int lane) const;
+
+    /**
+     * @brief Hashes the display of one lane, see Chip8::hashGfx()
+     */
+    unsigned long long hashGfx(unsigned int lane) const;
+
+    /**
+     * @brief Reads a single pixel of the display of one lane.
+     *
+     * @param lane : Lane index
+     * @param x : Column, 0 to GFX_X - 1
+     * @param y : Row, 0 to GFX_Y - 1
+     * @return true if the pixel is set
+     */
+    bool getPixel(unsigned int lane, int x, int y) const;
+};
+
+#endif
@@ -1,23 +1,162 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 
+#include "audio.h"
 #include "chip8.h"
 #include "gtk_io.h"
+#include "movie.h"
+#ifdef CHIP8_PULSE
+#include "pulse_sink.h"
+#endif
+
+static void printAudioStats(const AudioStats &stats) {
+    printf("Audio: %u Hz, %u sample ring, %u sample output buffer\n",
+            stats.sampleRate, stats.ringSamples, stats.sinkSamples);
+    printf("Audio: FX18 to output %.1f ms mean, %.1f ms max over %llu starts\n",
+            stats.latencyMean * 1000, stats.latencyMax * 1000, stats.starts);
+    printf("Audio: %llu samples, %llu dropped, %llu skipped, %llu silent for lack of data\n",
+            stats.rendered, stats.dropped, stats.skipped, stats.underruns);
+}
 
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        // Must specify a second argument
-        std::cerr << "Usage: emulator romfile.rom" << std::endl;
+    const char *moviePath = NULL;
+    const char *audioPath = NULL;
+    unsigned long cyclesPerFrame = CYCLES_PER_FRAME;
+    unsigned long runAheadFrames = 0;
+    Chip8Mode mode = CHIP8_MODE_CHIP8;
+    unsigned int quirks = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:a:A:sq:")) != -1) {
+        switch (opt) {
+            case 's':
+                mode = CHIP8_MODE_SCHIP;
+                break;
+
+            case 'q':
+                if (!chip8ParseQuirks(optarg, &quirks)) {
+                    optind = argc;
+                }
+                break;
+
+            case 'r':
+                moviePath = optarg;
+                break;
+
+            case 'a':
+                audioPath = optarg;
+                break;
+
+            case 'A':
+                runAheadFrames = strtoul(optarg, NULL, 0);
+                if (runAheadFrames > RUN_AHEAD_MAX_FRAMES) {
+                    optind = argc;
+                }
+                break;
+
+            case 't':
+                cyclesPerFrame = strtoul(optarg, NULL, 0);
+                if (cyclesPerFrame == 0 || cyclesPerFrame > MAX_CYCLES_PER_FRAME) {
+                    optind = argc;
+                }
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        // Must specify exactly one ROM
+        std::cerr << "Usage: emulator [-r movie] [-t cycles_per_frame] [-a audio.wav] "
+            "[-A run_ahead_frames] [-s] [-q quirks] romfile.rom" << std::endl;
         return -1;
     }
 
-    char *rom = argv[1];
+    char *rom = argv[optind];
 
     Chip8 *chip8 = new Chip8();
+    // The window runs one batch of instructions per frame, so the timers
+    // tick once per batch
+    chip8->setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8->setCyclesPerTick(cyclesPerFrame);
+    chip8->setMode(mode);
+    chip8->setQuirks(quirks);
     chip8->loadRom(rom);
 
-    GtkDriver gtk(chip8);
-    return gtk.run();
+    Chip8Movie movie;
+    if (moviePath) {
+        // Everything a replay needs to start from the same power on state
+        movie.mode = mode;
+        movie.quirks = quirks;
+        movie.seed = 0;
+        movie.cyclesPerTick = cyclesPerFrame;
+        movie.romHash = hashRomFile(rom);
+        chip8->setSeed(movie.seed);
+    }
+
+    // The buzzer is written to a file if asked, else played when PulseAudio
+    // is available. The emulator runs silent if the output cannot be opened.
+    AudioSink *sink = NULL;
+    if (audioPath) {
+        sink = new WavSink(audioPath);
+    }
+#ifdef CHIP8_PULSE
+    else {
+        sink = new PulseSink();
+    }
+#endif
+    Chip8Audio *audio = NULL;
+    if (sink) {
+        try {
+            audio = new Chip8Audio(*chip8, sink);
+        } catch (const std::exception &e) {
+            std::cerr << e.what();
+        }
+    }
+
+    // Save states are kept next to the ROM
+    GtkDriver gtk(chip8, std::string(rom) + ".state", moviePath ? &movie : NULL, audio,
+            runAheadFrames);
+    int status = gtk.run();
+
+    if (audio) {
+        try {
+            audio->stop();
+            printAudioStats(audio->getStats());
+        } catch (const std::exception &e) {
+            std::cerr << e.what();
+            status = 1;
+        }
+        delete audio;
+    }
+    delete sink;
+
+    if (moviePath) {
+        try {
+            saveMovie(moviePath, movie);
+            std::cout << "Wrote movie to " << moviePath << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << e.what();
+            status = 1;
+        }
+    }
+
+#ifdef CHIP8_PROFILE
+    // Keep the counters of the session next to the ROM
+    std::string profilePath = std::string(rom) + ".profile";
+    try {
+        chip8->dumpProfile(profilePath.c_str());
+        std::cout << "Wrote profile to " << profilePath << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+    }
+#endif
+
+    return status;
 }
 
@@ -3,8 +3,22 @@
  * @brief Implementation of the OpenGL driver
  */
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
 #include "gtk_io.h"
 
+// Colors as RGB24 surface pixels
+const uint32_t BACKGROUND_PIXEL =
+    (uint32_t) (BACKGROUND_R * 255 + 0.5) << 16 |
+    (uint32_t) (BACKGROUND_G * 255 + 0.5) << 8 |
+    (uint32_t) (BACKGROUND_B * 255 + 0.5);
+const uint32_t FOREGROUND_PIXEL =
+    (uint32_t) (FOREGROUND_R * 255 + 0.5) << 16 |
+    (uint32_t) (FOREGROUND_G * 255 + 0.5) << 8 |
+    (uint32_t) (FOREGROUND_B * 255 + 0.5);
+
 const guint CHIP8_KEYVALS[KEYS] = {
     CHIP8_0, CHIP8_1, CHIP8_2, CHIP8_3,
     CHIP8_4, CHIP8_5, CHIP8_6, CHIP8_7,
@@ -12,10 +26,11 @@ const guint CHIP8_KEYVALS[KEYS] = {
     CHIP8_C, CHIP8_D, CHIP8_E, CHIP8_F
 };
 
-GtkDriver::GtkDriver(Chip8 *chip8) {
+GtkDriver::GtkDriver(Chip8 *chip8, const std::string &statePath, Chip8Movie *movie,
+        Chip8Audio *audio, unsigned int runAheadFrames) {
     app = Gtk::Application::create("me.wesleysoohoo.chip8");
 
-    window = new Chip8Window(chip8);
+    window.reset(new Chip8Window(chip8, statePath, movie, audio, runAheadFrames));
     window->set_default_size(GFX_X * SCALAR, GFX_Y * SCALAR);
     window->set_resizable(false);
     window->set_title(GTK_TITLE);
@@ -29,100 +44,539 @@ int GtkDriver::run() {
     return app->run(*window);
 }
 
-Chip8Window::Chip8Window(Chip8 *chip8) {
+Chip8Window::Chip8Window(Chip8 *chip8, const std::string &statePath, Chip8Movie *movie,
+        Chip8Audio *audio, unsigned int runAheadFrames) : runAhead(runAheadFrames) {
     this->chip8 = chip8;
+    this->statePath = statePath;
+    this->movie = movie;
+    recording = movie != NULL;
+    this->audio = audio;
+    rewinding = false;
+#ifdef CHIP8_PROFILE
+    profileFrames = 0;
+#endif
 
-    area = new Chip8Area(chip8);
+    area = Gtk::manage(new Chip8Area(&frames));
+#ifdef CHIP8_PROFILE
+    area->setProfiles(&profiles);
+#endif
     this->add(*area);
     area->show();
 
-//    Glib::signal_timeout().connect(sigc::mem_fun(*this,
-//                &Chip8Window::emulateCycle), 1000 / CPU_CLOCK_HZ);
-    Glib::signal_idle().connect(sigc::mem_fun(*this,
-                &Chip8Window::emulateCycle));
+    // The dispatcher runs its handler on the GTK thread
+    frameReady.connect(sigc::mem_fun(*this, &Chip8Window::onFrameReady));
 
-    gettimeofday(&clockPrev, NULL);
+    running = true;
+    emulator = std::thread(&Chip8Window::emulationLoop, this);
 }
 
 Chip8Window::~Chip8Window() {
+    stop();
+}
 
+void Chip8Window::stop() {
+    {
+        std::lock_guard<std::mutex> lock(inputLock);
+        running = false;
+    }
+    inputReady.notify_one();
+    // Runs from on_hide() and again from the destructor, only the first
+    // call finds the thread to join
+    if (!emulator.joinable()) {
+        return;
+    }
+    emulator.join();
+
+    if (recording) {
+        finishMovie();
+    }
+
+    if (runAhead.getFrames() > 0) {
+        double perRun = runAhead.secondsPerRun();
+        printf("Ran %u frames ahead, %.1f us per frame, %.1f us per frame run ahead\n",
+                runAhead.getFrames(), perRun * 1e6, perRun * 1e6 / runAhead.getFrames());
+    }
 }
 
-bool Chip8Window::emulateCycle() {
-    struct timeval clockNow;
-    gettimeofday(&clockNow, NULL);
+void Chip8Window::finishMovie() {
+    movie->cycles = chip8->getCycles();
+    movie->gfxHash = chip8->hashGfx();
+    recording = false;
+}
 
-    if (timediff_us(&clockNow, &clockPrev) >= CPU_CLOCK_RATE_US) {
-        clockPrev = clockNow;
-        return area->emulateCycle();
-    } else {
-        return true;
+void Chip8Window::on_hide() {
+    // The application quits once the window is hidden, leave the Chip8 to
+    // the caller
+    stop();
+    Gtk::Window::on_hide();
+}
+
+void Chip8Window::emulationLoop() {
+    const std::chrono::nanoseconds frameTime((long long) (1000000000 / CLOCK_HZ + 0.5));
+    auto nextFrame = std::chrono::steady_clock::now();
+
+    while (running) {
+        Chip8Input input;
+        while (inputs.pop(input)) {
+            handleInput(input);
+        }
+
+        bool ahead = false;
+        try {
+            if (rewinding) {
+                // Step back one frame per frame of real time
+                history.rewind(*chip8);
+
+                // Key changes from the undone frames never happened
+                while (recording && !movie->events.empty() &&
+                        movie->events.back().cycle >= chip8->getCycles()) {
+                    movie->events.pop_back();
+                }
+
+                // Rewinding is silent
+                if (audio) {
+                    audio->reset(*chip8);
+                }
+            } else {
+                // One timer tick per frame, the rate follows loaded states
+                chip8->runCycles(chip8->getCyclesPerTick());
+                history.record(*chip8);
+
+                if (audio) {
+                    audio->renderFrame(*chip8);
+                }
+
+                // Show the future frame, the system itself is left as it was
+                ahead = runAhead.run(*chip8);
+            }
+        } catch (const std::exception &e) {
+            // Keep showing the last frame
+            std::cerr << e.what();
+            return;
+        }
+
+        const uint64_t *gfx = chip8->getMode() == CHIP8_MODE_SCHIP ?
+            chip8->getSchipGfx() : chip8->getGfx();
+        publishFrame(ahead ? runAhead.getGfx() : gfx);
+
+        if (!rewinding && chip8->isIdle()) {
+            // Nothing changes until a key is pressed, so block instead of
+            // running empty frames
+            waitForInput();
+
+            // Catch up on the frames spent blocked so the timers stay in
+            // step with real time. The wait is fast-forwarded, so this
+            // costs next to nothing. The frame that ran above was due at
+            // nextFrame. Frames due since then are caught up, except the
+            // last one, which the loop runs next.
+            nextFrame += frameTime;
+            auto now = std::chrono::steady_clock::now();
+            if (nextFrame < now) {
+                unsigned long long missed = (now - nextFrame) / frameTime;
+                try {
+                    chip8->runCycles(missed * chip8->getCyclesPerTick());
+                    // The buzzer was off, and the sink played silence
+                    if (audio) {
+                        audio->reset(*chip8);
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << e.what();
+                    return;
+                }
+                nextFrame += missed * frameTime;
+            }
+            continue;
+        }
+
+        // Sleep until the next frame. Deadlines advance by whole frames so
+        // sleeping late does not add up, but frames that were missed
+        // entirely are dropped rather than run back to back.
+        nextFrame += frameTime;
+        auto now = std::chrono::steady_clock::now();
+        if (nextFrame < now) {
+            nextFrame = now;
+        }
+        std::this_thread::sleep_until(nextFrame);
     }
 }
 
+void Chip8Window::waitForInput() {
+    std::unique_lock<std::mutex> lock(inputLock);
+    inputReady.wait(lock, [this] { return !inputs.empty() || !running; });
+}
+
+void Chip8Window::handleInput(const Chip8Input &input) {
+    try {
+        switch (input.type) {
+            case Chip8Input::KEY_DOWN:
+                setKey(input.key, true);
+                break;
+
+            case Chip8Input::KEY_UP:
+                setKey(input.key, false);
+                break;
+
+            case Chip8Input::SAVE_STATE:
+                chip8->saveStateFile(statePath.c_str());
+                std::cout << "Saved state to " << statePath << std::endl;
+                break;
+
+            case Chip8Input::LOAD_STATE:
+                if (recording) {
+                    // A movie replays from power on, it cannot jump to a state
+                    finishMovie();
+                    std::cout << "Stopped recording" << std::endl;
+                }
+                chip8->loadStateFile(statePath.c_str());
+                if (audio) {
+                    audio->reset(*chip8);
+                }
+                std::cout << "Loaded state from " << statePath << std::endl;
+                break;
+
+            case Chip8Input::REWIND_START:
+                rewinding = true;
+                break;
+
+            case Chip8Input::REWIND_STOP:
+                rewinding = false;
+                break;
+
+            case Chip8Input::SPEED_UP:
+                changeSpeed(true);
+                break;
+
+            case Chip8Input::SPEED_DOWN:
+                changeSpeed(false);
+                break;
+        }
+    } catch (const std::exception &e) {
+        // Keep running on a missing or broken state file
+        std::cerr << e.what();
+    }
+}
+
+void Chip8Window::setKey(unsigned char key, bool pressed) {
+    // Only record changes, held keys repeat their press events
+    if (recording && chip8->key[key] != pressed) {
+        movie->events.push_back({ chip8->getCycles(), key, pressed });
+    }
+    chip8->key[key] = pressed;
+}
+
+void Chip8Window::changeSpeed(bool faster) {
+    if (recording) {
+        // A movie replays at a single rate
+        std::cout << "Speed is fixed while recording" << std::endl;
+        return;
+    }
+
+    unsigned int cycles = chip8->getCyclesPerTick();
+    cycles = faster ? std::min(cycles * 2, (unsigned int) MAX_CYCLES_PER_FRAME)
+        : std::max(cycles / 2, 1u);
+    chip8->setCyclesPerTick(cycles);
+    std::cout << "Running " << cycles << " instructions per frame" << std::endl;
+}
+
+void Chip8Window::publishFrame(const uint64_t *gfx) {
+    bool notify = false;
+
+    if (chip8->drawFlag) {
+        // Only the words of the current mode are copied
+        Chip8Frame &frame = frames.writeBuffer();
+        frame.schip = chip8->getMode() == CHIP8_MODE_SCHIP;
+        memcpy(frame.gfx, gfx, (frame.schip ? SCHIP_GFX_WORDS : GFX_Y) * sizeof(uint64_t));
+        frames.publish();
+        chip8->drawFlag = false;
+        notify = true;
+    }
+
+#ifdef CHIP8_PROFILE
+    if (++profileFrames == PROFILE_OVERLAY_FRAMES) {
+        profileFrames = 0;
+        profiles.writeBuffer() = chip8->getProfile();
+        profiles.publish();
+        notify = true;
+    }
+#endif
+
+    if (notify) {
+        frameReady.emit();
+    }
+}
+
+void Chip8Window::onFrameReady() {
+    area->refresh();
+#ifdef CHIP8_PROFILE
+    area->updateProfile();
+#endif
+}
+
+void Chip8Window::sendInput(Chip8Input::Type type, unsigned char key) {
+    Chip8Input input;
+    input.type = type;
+    input.key = key;
+    if (!inputs.push(input)) {
+        std::cerr << "Input queue full, dropped event" << std::endl;
+        return;
+    }
+
+    // Taking the lock orders the push before a wait that has just checked
+    // the queue, so the wakeup cannot be lost
+    {
+        std::lock_guard<std::mutex> lock(inputLock);
+    }
+    inputReady.notify_one();
+}
+
 bool Chip8Window::on_key_press_event(GdkEventKey *event) {
+    if (event->keyval == SAVE_STATE_KEY) {
+        sendInput(Chip8Input::SAVE_STATE);
+        return true;
+    }
+    if (event->keyval == LOAD_STATE_KEY) {
+        sendInput(Chip8Input::LOAD_STATE);
+        return true;
+    }
+    if (event->keyval == REWIND_KEY) {
+        sendInput(Chip8Input::REWIND_START);
+        return true;
+    }
+    if (event->keyval == SPEED_UP_KEY) {
+        sendInput(Chip8Input::SPEED_UP);
+        return true;
+    }
+    if (event->keyval == SPEED_DOWN_KEY) {
+        sendInput(Chip8Input::SPEED_DOWN);
+        return true;
+    }
+
+#ifdef CHIP8_PROFILE
+    if (event->keyval == PROFILE_OVERLAY_KEY) {
+        area->toggleProfile();
+        return true;
+    }
+#endif
+
     for (int i = 0; i < KEYS; i++) {
         if (event->keyval == CHIP8_KEYVALS[i]) {
-            chip8->key[i] = true;
+            sendInput(Chip8Input::KEY_DOWN, i);
         }
     }
     return true;
 }
 
 bool Chip8Window::on_key_release_event(GdkEventKey *event) {
+    if (event->keyval == REWIND_KEY) {
+        sendInput(Chip8Input::REWIND_STOP);
+        return true;
+    }
+
     for (int i = 0; i < KEYS; i++) {
         if (event->keyval == CHIP8_KEYVALS[i]) {
-            chip8->key[i] = false;
+            sendInput(Chip8Input::KEY_UP, i);
         }
     }
     return true;
 }
 
-Chip8Area::Chip8Area(Chip8 *chip8) {
-    this->chip8 = chip8;
+Chip8Area::Chip8Area(TripleBuffer<Chip8Frame> *frames) {
+    this->frames = frames;
+
+    surfaces[0] = Cairo::ImageSurface::create(Cairo::FORMAT_RGB24, GFX_X, GFX_Y);
+    surfaces[1] = Cairo::ImageSurface::create(Cairo::FORMAT_RGB24, SCHIP_GFX_X, SCHIP_GFX_Y);
+    for (int i = 0; i < 2; i++) {
+        patterns[i] = Cairo::SurfacePattern::create(surfaces[i]);
+        patterns[i]->set_filter(Cairo::FILTER_NEAREST);
+    }
+
+    // Start from a blank screen
+    active = 0;
+    clearSurface(active);
+
+#ifdef CHIP8_PROFILE
+    profiles = NULL;
+    overlay = false;
+#endif
 }
 
 Chip8Area::~Chip8Area() {
 
 }
 
+void Chip8Area::clearSurface(int index) {
+    unsigned char *data = surfaces[index]->get_data();
+    int stride = surfaces[index]->get_stride();
+    int width = surfaces[index]->get_width();
+    surfaces[index]->flush();
+    for (int y = 0; y < surfaces[index]->get_height(); y++) {
+        uint32_t *pixels = (uint32_t *) (data + y * stride);
+        std::fill(pixels, pixels + width, BACKGROUND_PIXEL);
+    }
+    surfaces[index]->mark_dirty();
+    memset(presented, 0, sizeof(presented));
+}
+
 bool Chip8Area::on_draw(const Cairo::RefPtr<Cairo::Context>& cr) {
-    // Set background to background color
-    cr->set_source_rgb(BACKGROUND_R, BACKGROUND_G, BACKGROUND_B);
+    // Scale the surface up in a single paint, clipped by GTK to the
+    // invalidated rows. Both resolutions fill the same window.
+    double scale = (double) GFX_X * SCALAR / surfaces[active]->get_width();
+    cr->save();
+    cr->scale(scale, scale);
+    cr->set_source(patterns[active]);
     cr->paint();
+    cr->restore();
 
-    // Set to foreground color
-    cr->set_source_rgb(FOREGROUND_R, FOREGROUND_G, FOREGROUND_B);
-
-    // Loop through all x and y positions
-    for (int i = 0; i < GFX_X * GFX_Y; i++) {
-        // Check if this pixel
-        if (chip8->gfx[i]) {
-            int pixelX = i % GFX_X;
-            int pixelY = i / GFX_X;
-            int x = pixelX * SCALAR;
-            int y = pixelY * SCALAR;
-            cr->rectangle(x, y, SCALAR, SCALAR);
-        }
+#ifdef CHIP8_PROFILE
+    if (overlay) {
+        drawProfile(cr);
     }
-
-    cr->fill();
+#endif
     return true;
 }
 
 void Chip8Area::forceRedraw() {
-    auto window = get_window();
-    Gdk::Rectangle r(0, 0, get_allocation().get_width(), get_allocation().get_height());
-    window->invalidate_rect(r, false);
-}
+    const Chip8Frame &frame = frames->readBuffer();
+    const uint64_t *gfx = frame.gfx;
 
-bool Chip8Area::emulateCycle() {
-    chip8->emulateCycle();
+    // A mode change selects the other surface, drawn from blank
+    if (active != frame.schip) {
+        active = frame.schip;
+        clearSurface(active);
+        queue_draw();
+    }
 
-    if (chip8->drawFlag) {
+    Cairo::RefPtr<Cairo::ImageSurface> &surface = surfaces[active];
+    int rows = surface->get_height();
+    int words = surface->get_width() / 64;  // Words per row
+    int scale = GFX_X * SCALAR / surface->get_width();
+    int first = rows;
+    int last = -1;
+
+    surface->flush();
+    unsigned char *data = surface->get_data();
+    int stride = surface->get_stride();
+
+    // Only redraw words that changed since the last presented frame
+    for (int y = 0; y < rows; y++) {
+        uint32_t *pixels = (uint32_t *) (data + y * stride);
+        for (int w = 0; w < words; w++) {
+            uint64_t word = gfx[y * words + w];
+            if (word == presented[y * words + w]) {
+                continue;
+            }
+
+            for (int x = 0; x < 64; x++) {
+                // Leftmost pixel is the MSB
+                bool set = (word >> (63 - x)) & 1;
+                pixels[w * 64 + x] = set ? FOREGROUND_PIXEL : BACKGROUND_PIXEL;
+            }
+            presented[y * words + w] = word;
+
+            if (first > y) {
+                first = y;
+            }
+            last = y;
+        }
+    }
+
+    if (last < 0) {
+        // Nothing changed on screen
+        return;
+    }
+
+    surface->mark_dirty();
+    queue_draw_area(0, first * scale, GFX_X * SCALAR, (last - first + 1) * scale);
+}
+
+void Chip8Area::refresh() {
+    if (frames->update()) {
         forceRedraw();
-        chip8->drawFlag = false;
     }
-    return true;
 }
 
+
+#ifdef CHIP8_PROFILE
+void Chip8Area::setProfiles(TripleBuffer<Chip8Profile> *profiles) {
+    this->profiles = profiles;
+}
+
+void Chip8Area::toggleProfile() {
+    overlay = !overlay;
+    queue_draw();
+}
+
+void Chip8Area::updateProfile() {
+    if (profiles->update() && overlay) {
+        queue_draw();
+    }
+}
+
+void Chip8Area::drawProfile(const Cairo::RefPtr<Cairo::Context>& cr) {
+    const Chip8Profile &profile = profiles->readBuffer();
+    const double lineHeight = 14;
+    char line[64];
+
+    unsigned long long total = 0;
+    for (int i = 0; i < CHIP8_OPCODE_CLASSES; i++) {
+        total += profile.opcodes[i];
+    }
+    double scale = total > 0 ? 100.0 / total : 0;
+
+    // Hottest addresses and opcode classes
+    unsigned short addresses[MEMORY];
+    for (int i = 0; i < MEMORY; i++) {
+        addresses[i] = i;
+    }
+    std::partial_sort(addresses, addresses + PROFILE_OVERLAY_ROWS, addresses + MEMORY,
+            [&profile](unsigned short a, unsigned short b) {
+        return profile.addresses[a] > profile.addresses[b];
+    });
+
+    unsigned char classes[CHIP8_OPCODE_CLASSES];
+    for (int i = 0; i < CHIP8_OPCODE_CLASSES; i++) {
+        classes[i] = i;
+    }
+    std::partial_sort(classes, classes + PROFILE_OVERLAY_ROWS, classes + CHIP8_OPCODE_CLASSES,
+            [&profile](unsigned char a, unsigned char b) {
+        return profile.opcodes[a] > profile.opcodes[b];
+    });
+
+    // Dim the display behind the text
+    cr->set_source_rgba(0, 0, 0, 0.7);
+    cr->rectangle(0, 0, GFX_X * SCALAR, (PROFILE_OVERLAY_ROWS + 3) * lineHeight);
+    cr->fill();
+
+    cr->set_source_rgb(1, 1, 1);
+    cr->select_font_face("monospace", Cairo::FONT_SLANT_NORMAL, Cairo::FONT_WEIGHT_NORMAL);
+    cr->set_font_size(12);
+
+    cr->move_to(8, lineHeight);
+    cr->show_text("Address");
+    cr->move_to(GFX_X * SCALAR / 2, lineHeight);
+    cr->show_text("Opcode");
+
+    for (int i = 0; i < PROFILE_OVERLAY_ROWS; i++) {
+        double y = (i + 2) * lineHeight;
+
+        if (profile.addresses[addresses[i]] > 0) {
+            snprintf(line, sizeof(line), "%03X %6.2f%%", addresses[i],
+                    profile.addresses[addresses[i]] * scale);
+            cr->move_to(8, y);
+            cr->show_text(line);
+        }
+
+        if (profile.opcodes[classes[i]] > 0) {
+            snprintf(line, sizeof(line), "%-7s %6.2f%%", CHIP8_OPCODE_CLASS_NAMES[classes[i]],
+                    profile.opcodes[classes[i]] * scale);
+            cr->move_to(GFX_X * SCALAR / 2, y);
+            cr->show_text(line);
+        }
+    }
+
+    snprintf(line, sizeof(line), "draws %llu  key waits %llu", profile.draws,
+            profile.keyWaits);
+    cr->move_to(8, (PROFILE_OVERLAY_ROWS + 2.5) * lineHeight);
+    cr->show_text(line);
+}
+#endif
@@ -9,13 +9,27 @@
 #include <gtkmm/window.h>
 #include <gtkmm/drawingarea.h>
 #include <cairomm/context.h>
-#include <glibmm/main.h>
+#include <cairomm/surface.h>
+#include <cairomm/pattern.h>
+#include <glibmm/dispatcher.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include "io.h"
+#include "audio.h"
 #include "chip8.h"
 #include "colors.h"
+#include "movie.h"
+#include "rewind.h"
+#include "run_ahead.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
 
-#define SCALAR 10  // 10 screen pixels per Chip8 pixel
+#define SCALAR 10  // 10 screen pixels per Chip8 pixel, 5 in SUPER-CHIP
 #define GTK_TITLE "Chip8 Emulator"
 
 // Define key maps
@@ -36,51 +50,207 @@
 #define CHIP8_E GDK_KEY_f
 #define CHIP8_F GDK_KEY_v
 
+// Save state hotkeys
+#define SAVE_STATE_KEY GDK_KEY_F5
+#define LOAD_STATE_KEY GDK_KEY_F9
+
+// Runs the game backwards while held
+#define REWIND_KEY GDK_KEY_BackSpace
+
+// Double or halve the instructions per frame
+#define SPEED_UP_KEY GDK_KEY_Page_Up
+#define SPEED_DOWN_KEY GDK_KEY_Page_Down
+#define MAX_CYCLES_PER_FRAME 65536
+
+#ifdef CHIP8_PROFILE
+// Shows or hides the profile overlay
+#define PROFILE_OVERLAY_KEY GDK_KEY_F3
+// Entries per list of the overlay
+#define PROFILE_OVERLAY_ROWS 8
+// The overlay is refreshed twice per second
+#define PROFILE_OVERLAY_FRAMES 30
+#endif
+
+// Input events waiting for the emulation thread
+#define INPUT_QUEUE_SIZE 256
+
+/**
+ * @brief Display of one emulated frame, as returned by Chip8::getGfx() or
+ * Chip8::getSchipGfx()
+ */
+struct Chip8Frame {
+    bool schip;  // SCHIP_GFX_WORDS words instead of GFX_Y
+    uint64_t gfx[SCHIP_GFX_WORDS];
+};
+
+/**
+ * @brief Input passed from the GTK thread to the emulation thread
+ */
+struct Chip8Input {
+    enum Type {
+        KEY_DOWN,
+        KEY_UP,
+        SAVE_STATE,
+        LOAD_STATE,
+        REWIND_START,
+        REWIND_STOP,
+        SPEED_UP,
+        SPEED_DOWN
+    };
+
+    Type type;
+    unsigned char key;  // KEY_DOWN and KEY_UP only
+};
+
 /**
  * @class Chip8Area
- * @brief Handles all of the graphics in the chip8 window
+ * @brief Handles all of the graphics in the chip8 window. Only runs on the
+ * GTK thread and only reads frames published by the emulation thread.
  */
 class Chip8Area : public Gtk::DrawingArea {
 private:
-    Chip8 *chip8;
+    TripleBuffer<Chip8Frame> *frames;
+
+    // One surface pixel per Chip8 pixel, scaled up with nearest neighbour
+    // filtering when painted. Both resolutions are created up front, index 1
+    // is SUPER-CHIP, so switching modes only selects the other surface.
+    Cairo::RefPtr<Cairo::ImageSurface> surfaces[2];
+    Cairo::RefPtr<Cairo::SurfacePattern> patterns[2];
+    int active;  // Surface being painted
+
+    // Words as they are currently drawn on the active surface
+    uint64_t presented[SCHIP_GFX_WORDS];
 
+    void clearSurface(int index);
     void forceRedraw();
     bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
 
+#ifdef CHIP8_PROFILE
+    TripleBuffer<Chip8Profile> *profiles;
+    bool overlay;
+    void drawProfile(const Cairo::RefPtr<Cairo::Context>& cr);
+#endif
+
 public:
     /**
      * @brief Constructs the implementation of Gtk::DrawingArea for the Chip8
      * system.
+     *
+     * @param frames : Frames published by the emulation thread
      */
-    Chip8Area(Chip8 *chip8);
+    Chip8Area(TripleBuffer<Chip8Frame> *frames);
 
     virtual ~Chip8Area();
 
-    bool emulateCycle();
+    /**
+     * @brief Redraws the rows that changed in the newest published frame
+     */
+    void refresh();
+
+#ifdef CHIP8_PROFILE
+    /**
+     * @brief Sets the counters shown by the profile overlay
+     *
+     * @param profiles : Counters published by the emulation thread
+     */
+    void setProfiles(TripleBuffer<Chip8Profile> *profiles);
+
+    /**
+     * @brief Shows or hides the hottest addresses and the instruction mix
+     * over the display
+     */
+    void toggleProfile();
+
+    /**
+     * @brief Redraws the profile overlay with the newest published counters
+     * if it is shown
+     */
+    void updateProfile();
+#endif
 };
 
 /**
  * @class Chip8Window
  * @brief Wrapper of Gtk::Window that includes key event handling and chip8
  * emulation
+ *
+ * The system runs on its own thread. Each 60Hz frame it runs one batch of
+ * instructions, one timer tick on the virtual clock, then sleeps until the
+ * next frame. Key events and hotkeys reach it through
+ * a lock-free queue and finished frames come back through a lock-free triple
+ * buffer, so the GTK thread never touches the Chip8 while it runs. While the
+ * program waits for a key the thread blocks until the next input instead of
+ * waking up every frame.
  */
 class Chip8Window : public Gtk::Window {
 private:
     Chip8 *chip8;
-    Chip8Area *area;
+    Chip8Area *area;  // Managed, destroyed with the window
+
+    // Owned by the emulation thread while it runs
+    std::string statePath;
+    Chip8Rewind history;
+    bool rewinding;
+    Chip8Movie *movie;  // NULL if not recording
+    bool recording;
+    Chip8Audio *audio;  // NULL if silent
+    Chip8RunAhead runAhead;
+#ifdef CHIP8_PROFILE
+    unsigned int profileFrames;  // Frames since the overlay was refreshed
+#endif
+
+    // GTK thread to emulation thread. The lock and condition only wake the
+    // emulation thread when it blocks on an idle system.
+    SpscQueue<Chip8Input, INPUT_QUEUE_SIZE> inputs;
+    std::mutex inputLock;
+    std::condition_variable inputReady;
+    // Emulation thread to GTK thread
+    TripleBuffer<Chip8Frame> frames;
+#ifdef CHIP8_PROFILE
+    TripleBuffer<Chip8Profile> profiles;
+#endif
+    Glib::Dispatcher frameReady;
+
+    std::thread emulator;
+    std::atomic<bool> running;
+
+    void emulationLoop();
+    void handleInput(const Chip8Input &input);
+    void setKey(unsigned char key, bool pressed);
+    void finishMovie();
+    void changeSpeed(bool faster);
+    void publishFrame(const uint64_t *gfx);
+    void waitForInput();
+    void stop();
 
-    bool emulateCycle();
+    void sendInput(Chip8Input::Type type, unsigned char key = 0);
+    void onFrameReady();
     bool on_key_press_event(GdkEventKey *event) override;
     bool on_key_release_event(GdkEventKey *event) override;
-    struct timeval clockPrev;
+    void on_hide() override;
 
 public:
     /**
      * @brief Constructs the implementation of Gtk::Window for the Chip8 system
-     * and initializes all of the key event listeners and the chip8 clock
+     * and starts the emulation thread
+     *
+     * @param chip8 : System to run
+     * @param statePath : File written and read by the save state hotkeys
+     * @param movie : Filled in with every key change and, once the window
+     * is hidden, the length and final display of the session. NULL to not
+     * record. Recording stops when a state is loaded.
+     * @param audio : Renders the buzzer after every frame, NULL for none.
+     * Only used by the emulation thread until the window is hidden.
+     * @param runAheadFrames : Frames ahead of the system the display is
+     * shown, 0 to show the current frame. See Chip8RunAhead.
+     * @throws invalid_argument if runAheadFrames is above RUN_AHEAD_MAX_FRAMES
      */
-    Chip8Window(Chip8 *chip8);
+    Chip8Window(Chip8 *chip8, const std::string &statePath, Chip8Movie *movie,
+            Chip8Audio *audio, unsigned int runAheadFrames);
 
+    /**
+     * @brief Stops the emulation thread if the window was never hidden
+     */
     virtual ~Chip8Window();
 };
 
@@ -91,17 +261,27 @@ public:
 class GtkDriver : public IO {
 private:
     Glib::RefPtr<Gtk::Application> app;
-    Chip8Window *window;
+    // Destroyed before the application
+    std::unique_ptr<Chip8Window> window;
 
 public:
     /**
      * @brief Constructs the GTK driver. Sets up the window and initializes
      * all default variables
+     *
+     * @param chip8 : System to run
+     * @param statePath : File written and read by the save state hotkeys
+     * @param movie : Movie to record into, NULL to not record. See
+     * Chip8Window::Chip8Window().
+     * @param audio : Buzzer output, NULL for none
+     * @param runAheadFrames : Frames to run ahead, 0 for none
      */
-    GtkDriver(Chip8 *chip8);
+    GtkDriver(Chip8 *chip8, const std::string &statePath, Chip8Movie *movie,
+            Chip8Audio *audio, unsigned int runAheadFrames);
 
     /**
-     * @brief GTK destructor. Does nothing for now.
+     * @brief GTK destructor. Destroys the window, which stops the emulation
+     * thread if it still runs.
      */
     ~GtkDriver();
 
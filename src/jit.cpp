@@ -0,0 +1,775 @@
+/**
+ * @file jit.cpp
+ * @brief Implementation of the x86-64 basic block recompiler
+ */
+
+#include <sys/mman.h>
+#include <initializer_list>
+
+#include "jit.h"
+
+// Worst case size of one translated block: FX65 with all 16 registers is the
+// largest translation at well under 768 bytes per instruction
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK * 768)
+
+// Host registers, as encoded in ModRM and REX
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+#define EDI 7
+#define R8 8
+#define R9 9
+#define R10 10
+#define R11 11
+
+// Host register holding each V register while native code runs, or -1 for
+// one kept in memory. The caller-saved registers the entry stub need not
+// save go to V0 to V4, the ones ROMs use most, and to VF, written by every
+// arithmetic instruction. rbx holds the Chip8 object and r12 the budget,
+// eax, ecx and edx are scratch. A host register holds its V register in its
+// low byte, the rest is garbage; writing whole host registers keeps them
+// free of partial register merges.
+static const int HOST_REGISTERS[REGISTERS] = { ESI, EDI, R8, R9, R10, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, R11 };
+
+// Condition codes for jcc
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+
+// How the translator treats an opcode
+#define OP_INTERPRET 0  // Ends the block before it, run by the interpreter
+#define OP_STRAIGHT 1  // Translated, execution continues with the next opcode
+#define OP_TERMINATOR 2  // Translated, ends the block
+
+// Signature of the entry stub. Returns the unused part of the budget.
+typedef unsigned long long (*JitEntry)(Chip8 *chip8, unsigned long long budget,
+        unsigned char *block);
+
+namespace {
+
+/**
+ * @brief Writes x86-64 machine code into the code buffer. The CHIP8 state is
+ * always addressed as [rbx + disp32]. Byte registers are any host register
+ * but ah to bh, which are never used.
+ */
+class Emitter {
+public:
+    unsigned char *p;
+
+    Emitter(unsigned char *p) : p(p) {}
+
+    void byte(unsigned char b) {
+        *p++ = b;
+    }
+
+    void bytes(std::initializer_list<unsigned char> list) {
+        for (unsigned char b : list) {
+            *p++ = b;
+        }
+    }
+
+    void word(unsigned short w) {
+        memcpy(p, &w, sizeof(w));
+        p += sizeof(w);
+    }
+
+    void dword(unsigned int d) {
+        memcpy(p, &d, sizeof(d));
+        p += sizeof(d);
+    }
+
+    void qword(unsigned long long q) {
+        memcpy(p, &q, sizeof(q));
+        p += sizeof(q);
+    }
+
+    // ModRM and displacement for [rbx + disp32]
+    void state(int reg, int disp) {
+        byte(0x80 | ((reg & 7) << 3) | 0x3);
+        dword(disp);
+    }
+
+    // REX prefix, if one is needed, for a byte register in ModRM.reg and
+    // one in ModRM.rm. Without one, 4 to 7 would mean ah to bh.
+    void rexByte(int reg, int rm) {
+        if (reg >= 4 || rm >= 4) {
+            byte(0x40 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+        }
+    }
+
+    // ModRM of two registers
+    void registers(int reg, int rm) {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // Jumps with a rel32 operand to be linked later, returns the operand
+    unsigned char *jcc(unsigned char cc) {
+        bytes({0x0F, (unsigned char) (0x80 | cc)});
+        dword(0);
+        return p - 4;
+    }
+
+    unsigned char *jmp() {
+        byte(0xE9);
+        dword(0);
+        return p - 4;
+    }
+
+    static void link(unsigned char *rel, unsigned char *target) {
+        int disp = (int) (target - (rel + 4));
+        memcpy(rel, &disp, sizeof(disp));
+    }
+
+    // movzx reg, byte [rbx + disp]
+    void loadByte(int reg, int disp) {
+        if (reg >= 8) {
+            byte(0x44);
+        }
+        bytes({0x0F, 0xB6});
+        state(reg, disp);
+    }
+
+    // movzx reg, rm8
+    void loadByteRegister(int reg, int rm) {
+        rexByte(reg < 8 ? 0 : reg, rm);
+        bytes({0x0F, 0xB6});
+        registers(reg, rm);
+    }
+
+    // movzx reg, word [rbx + disp]
+    void loadWord(int reg, int disp) {
+        bytes({0x0F, 0xB7});
+        state(reg, disp);
+    }
+
+    // mov byte [rbx + disp], reg8
+    void storeByte(int reg, int disp) {
+        rexByte(reg, 0);
+        byte(0x88);
+        state(reg, disp);
+    }
+
+    // REX prefix, if one is needed, for 32 bit registers in ModRM.reg and
+    // ModRM.rm
+    void rex(int reg, int rm) {
+        if (reg >= 8 || rm >= 8) {
+            byte(0x40 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+        }
+    }
+
+    // mov rm32, reg32
+    void move(int reg, int rm) {
+        rex(reg, rm);
+        byte(0x89);
+        registers(reg, rm);
+    }
+
+    // mov rm32, imm8
+    void moveImm(int rm, unsigned char imm) {
+        rex(0, rm);
+        byte(0xB8 | (rm & 7));
+        dword(imm);
+    }
+
+    // add rm32, imm8, sign extended
+    void addImm(int rm, unsigned char imm) {
+        rex(0, rm);
+        byte(0x83);
+        registers(0, rm);
+        byte(imm);
+    }
+
+    // op byte [rbx + disp], imm8, where op is the ModRM.reg of the 0x80
+    // group: 0 add, 7 cmp
+    void aluByteImm(int op, int disp, unsigned char imm) {
+        byte(0x80);
+        state(op, disp);
+        byte(imm);
+    }
+
+    // op rm8, imm8
+    void aluByteRegisterImm(int op, int rm, unsigned char imm) {
+        rexByte(0, rm);
+        byte(0x80);
+        registers(op, rm);
+        byte(imm);
+    }
+
+    // mov word [rbx + disp], reg16
+    void storeWord(int reg, int disp) {
+        bytes({0x66, 0x89});
+        state(reg, disp);
+    }
+
+    // mov byte [rbx + disp], imm8
+    void storeByteImm(int disp, unsigned char imm) {
+        byte(0xC6);
+        state(0, disp);
+        byte(imm);
+    }
+
+    // mov word [rbx + disp], imm16
+    void storeWordImm(int disp, unsigned short imm) {
+        bytes({0x66, 0xC7});
+        state(0, disp);
+        word(imm);
+    }
+};
+
+int classify(unsigned short opcode) {
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            return opcode == 0x00EE ? OP_TERMINATOR : OP_INTERPRET;
+
+        case 0x1000:
+        case 0x2000:
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+        case 0xB000:
+            return OP_TERMINATOR;
+
+        case 0x6000:
+        case 0x7000:
+        case 0xA000:
+            return OP_STRAIGHT;
+
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0: case 0x1: case 0x2: case 0x3:
+                case 0x4: case 0x5: case 0x6: case 0x7:
+                case 0xE:
+                    return OP_STRAIGHT;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        case 0xE000:
+            switch (opcode & 0x00FF) {
+                case 0x9E:
+                case 0xA1:
+                    return OP_TERMINATOR;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x1E:
+                case 0x29:
+                case 0x65:
+                    return OP_STRAIGHT;
+
+                default:
+                    return OP_INTERPRET;
+            }
+
+        default:
+            return OP_INTERPRET;
+    }
+}
+
+}
+
+bool Chip8Jit::supported() {
+#if defined(__x86_64__) && defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+Chip8Jit::Chip8Jit(Chip8 &chip8) : chip8(chip8) {
+    void *buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        throw FormattedException("Could not allocate JIT code buffer\n");
+    }
+    code = (unsigned char *) buffer;
+
+    // Register offsets, so translated code can address them relative to rbx
+    char *base = (char *) &chip8;
+    offPc = (int) ((char *) &chip8.pc - base);
+    offOpcode = (int) ((char *) &chip8.opcode - base);
+    offV = (int) ((char *) chip8.V - base);
+    offI = (int) ((char *) &chip8.I - base);
+    offSp = (int) ((char *) &chip8.sp - base);
+    offStack = (int) ((char *) chip8.stack - base);
+    offPages = (int) ((char *) chip8.pages - base);
+    offKey = (int) ((char *) chip8.key - base);
+
+    Emitter e(code);
+
+    // Entry stub: JitEntry(chip8, budget, block)
+    e.byte(0x53);  // push rbx
+    e.bytes({0x41, 0x54});  // push r12
+    e.bytes({0x48, 0x89, 0xFB});  // mov rbx, rdi
+    e.bytes({0x49, 0x89, 0xF4});  // mov r12, rsi
+    for (int x = 0; x < REGISTERS; x++) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.loadByte(HOST_REGISTERS[x], offV + x);
+        }
+    }
+    e.bytes({0xFF, 0xE2});  // jmp rdx
+
+    // Exit stub, returns the remaining budget
+    exitStub = e.p;
+    for (int x = 0; x < REGISTERS; x++) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.storeByte(HOST_REGISTERS[x], offV + x);
+        }
+    }
+    e.bytes({0x4C, 0x89, 0xE0});  // mov rax, r12
+    e.bytes({0x41, 0x5C});  // pop r12
+    e.byte(0x5B);  // pop rbx
+    e.byte(0xC3);  // ret
+
+    codeBlocks = e.p;
+    flush();
+}
+
+Chip8Jit::~Chip8Jit() {
+    munmap(code, JIT_CODE_SIZE);
+}
+
+void Chip8Jit::flush() {
+    codeEnd = codeBlocks;
+    std::fill(blocks, blocks + MEMORY, (unsigned char *) NULL);
+    std::fill(untranslatable, untranslatable + MEMORY, false);
+    std::fill(covered, covered + MEMORY, false);
+    patches.clear();
+}
+
+void Chip8Jit::invalidate(unsigned short address) {
+    if (covered[address & ADDRESS_MASK]) {
+        // Self modifying code, start over
+        flush();
+    }
+}
+
+void Chip8Jit::run(unsigned long long cycles) {
+    JitEntry enter = (JitEntry) code;
+
+    while (cycles > 0) {
+        unsigned short pc = chip8.pc;
+        unsigned char *block = NULL;
+
+        // Both bytes of the opcode must be inside the ROM region
+        if (pc >= ROM_START && pc < ROM_END) {
+            block = blocks[pc];
+            if (block == NULL && !untranslatable[pc]) {
+                block = translate(pc);
+            }
+        }
+
+        if (block != NULL) {
+            unsigned long long left = enter(&chip8, cycles, block);
+            if (left < cycles) {
+                chip8.cycles += cycles - left;
+                chip8.advanceClock();
+                cycles = left;
+                continue;
+            }
+        }
+
+        // Not translatable, not enough budget left for the whole block, or a
+        // stack error the interpreter has to report. Waits are never
+        // translated, so they are fast-forwarded here.
+        if (block == NULL) {
+            unsigned long long skipped = chip8.skipIdle(chip8.cycles + cycles);
+            if (skipped > 0) {
+                cycles -= skipped;
+                continue;
+            }
+        }
+        chip8.emulateCycle();
+        cycles--;
+    }
+}
+
+unsigned char *Chip8Jit::translate(unsigned short start) {
+    // Count the instructions in the block, the budget is charged up front
+    unsigned short address = start;
+    int length = 0;
+    bool terminated = false;
+    while (length < JIT_MAX_BLOCK && address < ROM_END) {
+        int kind = classify(chip8.readMemory(address) << 8 | chip8.readMemory(address + 1));
+        if (kind == OP_INTERPRET) {
+            break;
+        }
+
+        length++;
+        address += 2;
+        if (kind == OP_TERMINATOR) {
+            terminated = true;
+            break;
+        }
+    }
+
+    if (length == 0) {
+        untranslatable[start] = true;
+        return NULL;
+    }
+
+    if (codeEnd + JIT_MAX_BLOCK_BYTES > code + JIT_CODE_SIZE) {
+        flush();
+    }
+
+    Emitter e(codeEnd);
+    unsigned char *entry = e.p;
+
+    // Reads V[x] into a scratch register
+    auto loadV = [&](int reg, int x) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.loadByteRegister(reg, HOST_REGISTERS[x]);
+        } else {
+            e.loadByte(reg, offV + x);
+        }
+    };
+
+    // Writes the low byte of a scratch register to V[x]
+    auto storeV = [&](int reg, int x) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.move(reg, HOST_REGISTERS[x]);
+        } else {
+            e.storeByte(reg, offV + x);
+        }
+    };
+
+    auto storeVImm = [&](int x, unsigned char imm) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.moveImm(HOST_REGISTERS[x], imm);
+        } else {
+            e.storeByteImm(offV + x, imm);
+        }
+    };
+
+    auto addVImm = [&](int x, unsigned char imm) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.addImm(HOST_REGISTERS[x], imm);
+        } else {
+            e.aluByteImm(0, offV + x, imm);
+        }
+    };
+
+    // Sets the flags as cmp V[x], imm8
+    auto compareVImm = [&](int x, unsigned char imm) {
+        if (HOST_REGISTERS[x] >= 0) {
+            e.aluByteRegisterImm(7, HOST_REGISTERS[x], imm);
+        } else {
+            e.aluByteImm(7, offV + x, imm);
+        }
+    };
+
+    // Stores a fixed next pc and leaves the block, chaining to the next block
+    // directly once it is translated
+    auto staticExit = [&](unsigned short target) {
+        e.storeWordImm(offPc, target);
+        unsigned char *rel = e.jmp();
+        if (target >= ROM_START && target < ROM_END && blocks[target] != NULL) {
+            Emitter::link(rel, blocks[target]);
+        } else {
+            Emitter::link(rel, exitStub);
+            if (target >= ROM_START && target < ROM_END && !untranslatable[target]) {
+                patches.push_back({target, rel});
+            }
+        }
+    };
+
+    // Leaves the block with the next pc in eax, already stored to pc.
+    // Continues in native code if the target block is translated.
+    auto dynamicExit = [&]() {
+        e.byte(0x3D);  // cmp eax, ROM_END
+        e.dword(ROM_END);
+        Emitter::link(e.jcc(CC_A), exitStub);
+        e.bytes({0x48, 0xB9});  // mov rcx, blocks
+        e.qword((unsigned long long) blocks);
+        e.bytes({0x48, 0x8B, 0x0C, 0xC1});  // mov rcx, [rcx + rax * 8]
+        e.bytes({0x48, 0x85, 0xC9});  // test rcx, rcx
+        Emitter::link(e.jcc(CC_E), exitStub);
+        e.bytes({0xFF, 0xE1});  // jmp rcx
+    };
+
+    // Gives back the cycle of the current instruction and leaves the block so
+    // that the interpreter runs it
+    auto bail = [&](unsigned short at) {
+        e.bytes({0x49, 0x83, 0xC4, 0x01});  // add r12, 1
+        e.storeWordImm(offPc, at);
+        Emitter::link(e.jmp(), exitStub);
+    };
+
+    // Skips the next instruction if the flags match cc
+    auto skipExit = [&](unsigned char cc, unsigned short at) {
+        unsigned char *skip = e.jcc(cc);
+        staticExit(at + 2);
+        Emitter::link(skip, e.p);
+        staticExit(at + 4);
+    };
+
+    // Charge the whole block to the budget, leave if it does not fit
+    e.bytes({0x49, 0x81, 0xFC});  // cmp r12, length
+    e.dword(length);
+    Emitter::link(e.jcc(CC_B), exitStub);
+    e.bytes({0x49, 0x81, 0xEC});  // sub r12, length
+    e.dword(length);
+
+    // Translations follow the quirks like the decoded handlers, a change of
+    // quirks flushes them
+    unsigned int quirks = chip8.quirks;
+
+    address = start;
+    for (int i = 0; i < length; i++, address += 2) {
+        unsigned short opcode = chip8.readMemory(address) << 8 | chip8.readMemory(address + 1);
+        unsigned short NNN = opcode & 0x0FFF;
+        unsigned char NN = opcode & 0x00FF;
+        int X = (opcode & 0x0F00) >> 8;
+        int Y = (opcode & 0x00F0) >> 4;
+        int shiftSource = quirks & CHIP8_QUIRK_SHIFT_VY ? Y : X;
+
+        covered[address] = true;
+        covered[address + 1] = true;
+
+        if (i == length - 1) {
+            // Every way out of the block that runs its last instruction
+            // passes here, and leaves opcode as the interpreter would. A
+            // stack error bails to the interpreter, which sets it again.
+            e.storeWordImm(offOpcode, opcode);
+        }
+
+        switch (opcode & 0xF000) {
+            case 0x0000: {
+                // 00EE, return from subroutine
+                unsigned char *underflow;
+                e.loadWord(EAX, offSp);
+                e.bytes({0x85, 0xC0});  // test eax, eax
+                underflow = e.jcc(CC_E);
+                e.bytes({0xFF, 0xC8});  // dec eax
+                e.storeWord(EAX, offSp);
+                e.bytes({0x0F, 0xB7, 0x84, 0x43});  // movzx eax, word [rbx + rax * 2 + stack]
+                e.dword(offStack);
+                e.bytes({0x83, 0xC0, 0x02});  // add eax, 2
+                e.storeWord(EAX, offPc);
+                dynamicExit();
+                Emitter::link(underflow, e.p);
+                bail(address);
+                break;
+            }
+
+            case 0x1000:
+                staticExit(NNN);
+                break;
+
+            case 0x2000: {
+                unsigned char *overflow;
+                e.loadWord(EAX, offSp);
+                e.bytes({0x83, 0xF8, STACK});  // cmp eax, STACK
+                overflow = e.jcc(CC_AE);
+                e.bytes({0x66, 0xC7, 0x84, 0x43});  // mov word [rbx + rax * 2 + stack], address
+                e.dword(offStack);
+                e.word(address);
+                e.bytes({0x66, 0xFF});  // inc word [rbx + sp]
+                e.state(0, offSp);
+                staticExit(NNN);
+                Emitter::link(overflow, e.p);
+                bail(address);
+                break;
+            }
+
+            case 0x3000:
+                compareVImm(X, NN);
+                skipExit(CC_E, address);
+                break;
+
+            case 0x4000:
+                compareVImm(X, NN);
+                skipExit(CC_NE, address);
+                break;
+
+            case 0x5000:
+                loadV(EAX, X);
+                loadV(ECX, Y);
+                e.bytes({0x38, 0xC8});  // cmp al, cl
+                skipExit(CC_E, address);
+                break;
+
+            case 0x6000:
+                storeVImm(X, NN);
+                break;
+
+            case 0x7000:
+                addVImm(X, NN);
+                break;
+
+            case 0x8000:
+                // Operands are reloaded after VF is written to match the
+                // interpreter when X or Y is F
+                switch (opcode & 0x000F) {
+                    case 0x0:
+                        loadV(EAX, Y);
+                        storeV(EAX, X);
+                        break;
+
+                    case 0x1:
+                    case 0x2:
+                    case 0x3: {
+                        static const unsigned char ops[] = {0x08, 0x20, 0x30};
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({ops[(opcode & 0x000F) - 1], 0xC8});  // or/and/xor al, cl
+                        storeV(EAX, X);
+                        if (quirks & CHIP8_QUIRK_VF_RESET) {
+                            storeVImm(0xF, 0);
+                        }
+                        break;
+                    }
+
+                    case 0x4:
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x00, 0xC8});  // add al, cl
+                        e.bytes({0x0F, 0x92, 0xC2});  // setc dl
+                        storeV(EDX, 0xF);
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x00, 0xC8});  // add al, cl
+                        storeV(EAX, X);
+                        break;
+
+                    case 0x5:
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x38, 0xC8});  // cmp al, cl
+                        e.bytes({0x0F, 0x93, 0xC2});  // setae dl
+                        storeV(EDX, 0xF);
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x28, 0xC8});  // sub al, cl
+                        storeV(EAX, X);
+                        break;
+
+                    case 0x6:
+                        loadV(EAX, shiftSource);
+                        e.bytes({0x83, 0xE0, 0x01});  // and eax, 1
+                        storeV(EAX, 0xF);
+                        loadV(EAX, shiftSource);
+                        e.bytes({0xD0, 0xE8});  // shr al, 1
+                        storeV(EAX, X);
+                        break;
+
+                    case 0x7:
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x38, 0xC1});  // cmp cl, al
+                        e.bytes({0x0F, 0x93, 0xC2});  // setae dl
+                        storeV(EDX, 0xF);
+                        loadV(EAX, X);
+                        loadV(ECX, Y);
+                        e.bytes({0x28, 0xC1});  // sub cl, al
+                        storeV(ECX, X);
+                        break;
+
+                    case 0xE:
+                        loadV(EAX, shiftSource);
+                        e.bytes({0xC0, 0xE8, 0x07});  // shr al, 7
+                        storeV(EAX, 0xF);
+                        loadV(EAX, shiftSource);
+                        e.bytes({0xD0, 0xE0});  // shl al, 1
+                        storeV(EAX, X);
+                        break;
+                }
+                break;
+
+            case 0x9000:
+                loadV(EAX, X);
+                loadV(ECX, Y);
+                e.bytes({0x38, 0xC8});  // cmp al, cl
+                skipExit(CC_NE, address);
+                break;
+
+            case 0xA000:
+                e.storeWordImm(offI, NNN);
+                break;
+
+            case 0xB000:
+                loadV(EAX, quirks & CHIP8_QUIRK_JUMP_VX ? X : 0);
+                e.byte(0x05);  // add eax, NNN
+                e.dword(NNN);
+                e.storeWord(EAX, offPc);
+                dynamicExit();
+                break;
+
+            case 0xE000:
+                loadV(EAX, X);
+                e.bytes({0x83, 0xE0, KEY_MASK});  // and eax, KEY_MASK
+                e.bytes({0x80, 0xBC, 0x03});  // cmp byte [rbx + rax + key], 0
+                e.dword(offKey);
+                e.byte(0x00);
+                skipExit(NN == 0x9E ? CC_NE : CC_E, address);
+                break;
+
+            case 0xF000:
+                switch (NN) {
+                    case 0x1E:
+                        loadV(EAX, X);
+                        e.bytes({0x66, 0x01});  // add word [I], ax
+                        e.state(EAX, offI);
+                        break;
+
+                    case 0x29:
+                        loadV(EAX, X);
+                        e.bytes({0x8D, 0x04, 0x80});  // lea eax, [rax + rax * 4]
+                        e.storeWord(EAX, offI);
+                        break;
+
+                    case 0x65:
+                        e.loadWord(EAX, offI);
+                        for (int r = 0; r <= (opcode & 0x0F00) >> 8; r++) {
+                            e.bytes({0x8D, 0x48, (unsigned char) r});  // lea ecx, [rax + r]
+                            e.bytes({0x81, 0xE1});  // and ecx, ADDRESS_MASK
+                            e.dword(ADDRESS_MASK);
+                            e.bytes({0x0F, 0xB6, 0xD5});  // movzx edx, ch, the 256 byte page
+                            e.bytes({0x48, 0x8B, 0x94, 0xD3});  // mov rdx, [rbx + rdx * 8 + pages]
+                            e.dword(offPages);
+                            e.bytes({0x0F, 0xB6, 0xC9});  // movzx ecx, cl
+                            e.bytes({0x0F, 0xB6, 0x0C, 0x0A});  // movzx ecx, byte [rdx + rcx]
+                            storeV(ECX, r);
+                        }
+                        if (quirks & CHIP8_QUIRK_MEMORY_I) {
+                            e.bytes({0x66, 0x83, 0x83});  // add word [I], X + 1
+                            e.dword(offI);
+                            e.byte(((opcode & 0x0F00) >> 8) + 1);
+                        }
+                        break;
+                }
+                break;
+        }
+    }
+
+    if (!terminated) {
+        // Continue with the instruction the interpreter has to run
+        staticExit(address);
+    }
+
+    codeEnd = e.p;
+    blocks[start] = entry;
+
+    // Chain blocks that were waiting for this one
+    for (size_t i = 0; i < patches.size();) {
+        if (patches[i].target == start) {
+            Emitter::link(patches[i].rel, entry);
+            patches[i] = patches.back();
+            patches.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    return entry;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file jit.h
+ * @brief Basic block recompiler from CHIP8 to x86-64 machine code
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <vector>
+
+#include "chip8.h"
+
+// Size of the executable code buffer. The whole buffer is flushed and
+// recompiled when it fills up.
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+
+// Maximum number of CHIP8 instructions translated into one block
+#define JIT_MAX_BLOCK 64
+
+/**
+ * @class Chip8Jit
+ * @brief Translates straight-line CHIP8 basic blocks into native code.
+ *
+ * A block ends at the first jump, call, return or skip. Blocks with a fixed
+ * successor are chained directly to each other once both are translated, and
+ * returns and computed jumps look their target up in the block table without
+ * leaving native code. Instructions that touch the display, timers, keypad
+ * waits, random numbers or write memory (00E0, DXYN, CXNN, FX07, FX0A, FX15,
+ * FX18, FX33, FX55) are never translated and run on the interpreter, so the
+ * translated code can only ever be invalidated between blocks.
+ *
+ * The CHIP8 registers live in the Chip8 object and are addressed relative
+ * to a pinned host register. V0 to V4 and VF are held in host registers
+ * while native code runs: the entry stub loads them and the exit stub
+ * stores them back, so chained blocks pass them along and the interpreter
+ * sees them in memory at every hand over.
+ */
+class Chip8Jit {
+private:
+    // Chaining site waiting for the block at target to be translated
+    struct Patch {
+        unsigned short target;
+        unsigned char *rel;  // rel32 operand of the jump to patch
+    };
+
+    Chip8 &chip8;
+
+    unsigned char *code;  // Executable buffer
+    unsigned char *codeEnd;  // Next free byte
+    unsigned char *codeBlocks;  // First byte after the entry/exit stubs
+    unsigned char *exitStub;  // Returns to run() with the remaining budget
+
+    // Native entry point of the block starting at each address, or NULL
+    unsigned char *blocks[MEMORY];
+    // Addresses known to start with an interpreter-only instruction
+    bool untranslatable[MEMORY];
+    // Bytes of CHIP8 memory that are part of a translated block
+    bool covered[MEMORY];
+    std::vector<Patch> patches;
+
+    // Offsets of the Chip8 registers from the start of the object
+    int offPc;
+    int offOpcode;
+    int offV;
+    int offI;
+    int offSp;
+    int offStack;
+    int offPages;
+    int offKey;
+
+    unsigned char *translate(unsigned short address);
+
+public:
+    /**
+     * @brief Returns true if the host can run translated code
+     */
+    static bool supported();
+
+    /**
+     * @brief Allocates the executable code buffer for a Chip8 instance.
+     *
+     * @throws FormattedException if executable memory cannot be allocated
+     */
+    Chip8Jit(Chip8 &chip8);
+
+    ~Chip8Jit();
+
+    /**
+     * @brief Runs a number of cycles, translating blocks as they are reached
+     * and interpreting everything that cannot be translated. Waits are
+     * fast-forwarded with Chip8::skipIdle() wherever they are reached.
+     *
+     * @param cycles : Number of instructions to execute
+     */
+    void run(unsigned long long cycles);
+
+    /**
+     * @brief Notifies the JIT that a byte of memory was written. Flushes all
+     * translated code if the byte is part of a translated block.
+     */
+    void invalidate(unsigned short address);
+
+    /**
+     * @brief Drops all translated code
+     */
+    void flush();
+};
+
+#endif
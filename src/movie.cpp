@@ -0,0 +1,199 @@
+/**
+ * @file movie.cpp
+ * @brief Implementation of movie files and input replay
+ */
+
+#include <string>
+
+#include "movie.h"
+
+// Header: magic, version, mode, quirks, seed, cycles per tick, ROM hash,
+// cycles, display hash and number of events. Version 2 has no quirks and
+// version 1 no mode either.
+static const char MOVIE_MAGIC[4] = { 'C', '8', 'M', 'V' };
+#define MOVIE_HEADER_SIZE 43
+#define MOVIE_V2_HEADER_SIZE 42
+#define MOVIE_V1_HEADER_SIZE 41
+
+// Key byte of an event: key in the low nibble, pressed in bit 4
+#define EVENT_PRESSED 0x10
+
+static void putBytes(std::string &out, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out += (char) (value >> (8 * i));
+    }
+}
+
+static unsigned long long getBytes(const unsigned char *&p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (unsigned long long) *p++ << (8 * i);
+    }
+    return value;
+}
+
+// Unsigned LEB128, 7 bits per byte, low bits first
+static void putVarint(std::string &out, unsigned long long value) {
+    while (value >= 0x80) {
+        out += (char) (value | 0x80);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+static bool getVarint(const unsigned char *&p, const unsigned char *end,
+        unsigned long long &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        unsigned char byte = *p++;
+        value |= (unsigned long long) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned long long hashRomFile(const char *path) {
+    std::ifstream infile(path, std::ios::in | std::ios::binary);
+    if (!infile) {
+        throw FormattedException("Could not open ROM file: %s\n", path);
+    }
+
+    // 64 bit FNV-1a
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    char byte;
+    while (infile.get(byte)) {
+        hash ^= (unsigned char) byte;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+void saveMovie(const char *path, const Chip8Movie &movie) {
+    std::string data(MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+    putBytes(data, CHIP8_MOVIE_VERSION, 1);
+    putBytes(data, movie.mode, 1);
+    putBytes(data, movie.quirks, 1);
+    putBytes(data, movie.seed, 4);
+    putBytes(data, movie.cyclesPerTick, 4);
+    putBytes(data, movie.romHash, 8);
+    putBytes(data, movie.cycles, 8);
+    putBytes(data, movie.gfxHash, 8);
+    putBytes(data, movie.events.size(), 4);
+
+    unsigned long long previous = 0;
+    for (const KeyEvent &event : movie.events) {
+        putVarint(data, event.cycle - previous);
+        putBytes(data, event.key | (event.pressed ? EVENT_PRESSED : 0), 1);
+        previous = event.cycle;
+    }
+
+    std::ofstream outfile(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    outfile.write(data.data(), data.size());
+    if (!outfile) {
+        throw FormattedException("Could not write movie: %s\n", path);
+    }
+}
+
+Chip8Movie loadMovie(const char *path) {
+    std::ifstream infile(path, std::ios::in | std::ios::binary);
+    if (!infile) {
+        throw FormattedException("Could not open movie: %s\n", path);
+    }
+    std::string data((std::istreambuf_iterator<char>(infile)),
+            std::istreambuf_iterator<char>());
+
+    const unsigned char *p = (const unsigned char *) data.data();
+    const unsigned char *end = p + data.size();
+    if (data.size() < MOVIE_V1_HEADER_SIZE ||
+            memcmp(p, MOVIE_MAGIC, sizeof(MOVIE_MAGIC)) != 0) {
+        throw FormattedException("Not a movie file: %s\n", path);
+    }
+    p += sizeof(MOVIE_MAGIC);
+
+    unsigned int version = getBytes(p, 1);
+    if (version < 1 || version > CHIP8_MOVIE_VERSION) {
+        throw FormattedException("Unsupported movie version %u: %s\n", version, path);
+    }
+
+    Chip8Movie movie;
+    movie.mode = CHIP8_MODE_CHIP8;
+    movie.quirks = 0;
+    if (version >= 2) {
+        unsigned int mode = getBytes(p, 1);
+        size_t headerSize = version == 2 ? MOVIE_V2_HEADER_SIZE : MOVIE_HEADER_SIZE;
+        if (data.size() < headerSize || mode > CHIP8_MODE_SCHIP) {
+            throw FormattedException("Corrupt movie: %s\n", path);
+        }
+        movie.mode = (Chip8Mode) mode;
+    }
+    if (version >= 3) {
+        movie.quirks = getBytes(p, 1);
+        if (movie.quirks & ~CHIP8_QUIRKS_ALL) {
+            throw FormattedException("Corrupt movie: %s\n", path);
+        }
+    }
+    movie.seed = getBytes(p, 4);
+    movie.cyclesPerTick = getBytes(p, 4);
+    movie.romHash = getBytes(p, 8);
+    movie.cycles = getBytes(p, 8);
+    movie.gfxHash = getBytes(p, 8);
+    unsigned long long count = getBytes(p, 4);
+    if (movie.cyclesPerTick == 0 || count > (unsigned long long) (end - p) / 2) {
+        throw FormattedException("Corrupt movie: %s\n", path);
+    }
+
+    movie.events.resize(count);
+    unsigned long long cycle = 0;
+    for (KeyEvent &event : movie.events) {
+        unsigned long long delta;
+        if (!getVarint(p, end, delta) || p >= end || (*p & ~(KEY_MASK | EVENT_PRESSED))) {
+            throw FormattedException("Corrupt movie: %s\n", path);
+        }
+        cycle += delta;
+        event.cycle = cycle;
+        event.key = *p & KEY_MASK;
+        event.pressed = *p & EVENT_PRESSED;
+        p++;
+    }
+
+    if (p != end || cycle > movie.cycles) {
+        throw FormattedException("Corrupt movie: %s\n", path);
+    }
+    return movie;
+}
+
+bool isMovieFile(const char *path) {
+    std::ifstream infile(path, std::ios::in | std::ios::binary);
+    char magic[sizeof(MOVIE_MAGIC)];
+    return infile.read(magic, sizeof(magic)) &&
+        memcmp(magic, MOVIE_MAGIC, sizeof(magic)) == 0;
+}
+
+void runWithInput(Chip8 &chip8, const std::vector<KeyEvent> &events,
+        unsigned long long cycles) {
+    // Run up to each input event, then apply it
+    size_t next = 0;
+    while (chip8.getCycles() < cycles) {
+        while (next < events.size() && events[next].cycle <= chip8.getCycles()) {
+            chip8.key[events[next].key] = events[next].pressed;
+            next++;
+        }
+
+        unsigned long long until = cycles;
+        if (next < events.size() && events[next].cycle < until) {
+            until = events[next].cycle;
+        }
+        chip8.runCycles(until - chip8.getCycles());
+    }
+}
+
+void replayMovie(Chip8 &chip8, const Chip8Movie &movie) {
+    chip8.setMode(movie.mode);
+    chip8.setQuirks(movie.quirks);
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setCyclesPerTick(movie.cyclesPerTick);
+    chip8.setSeed(movie.seed);
+    runWithInput(chip8, movie.events, movie.cycles);
+}
@@ -0,0 +1,100 @@
+/**
+ * @file movie.h
+ * @brief Input movies: every key change of a session with the instruction at
+ * which it happened, for exact replay without a display
+ */
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <vector>
+
+#include "chip8.h"
+
+#define CHIP8_MOVIE_VERSION 3
+
+/**
+ * @brief A change of one key, applied before the instruction with the given
+ * cycle number executes.
+ */
+struct KeyEvent {
+    unsigned long long cycle;
+    unsigned char key;
+    bool pressed;
+};
+
+/**
+ * @brief A recorded session. Replaying the events on the same ROM with the
+ * same seed and cycles per tick on the virtual clock reproduces the session
+ * exactly, ending on the same display.
+ */
+struct Chip8Movie {
+    Chip8Mode mode;  // CHIP8_MODE_CHIP8 in version 1 movies
+    unsigned int quirks;  // CHIP8_QUIRK_* flags, 0 before version 3
+    unsigned int seed;
+    unsigned int cyclesPerTick;
+    unsigned long long romHash;  // See hashRomFile()
+    unsigned long long cycles;  // Length of the session in instructions
+    unsigned long long gfxHash;  // Display at the end, see Chip8::hashGfx()
+    std::vector<KeyEvent> events;  // Sorted by cycle
+};
+
+/**
+ * @brief Hashes a ROM file with 64 bit FNV-1a, so a movie can be checked
+ * against the ROM it is replayed on.
+ *
+ * @param path : Path to the ROM file
+ * @throws FormattedException if the file cannot be read
+ */
+unsigned long long hashRomFile(const char *path);
+
+/**
+ * @brief Writes a movie file. Events are stored as the number of
+ * instructions since the previous event in a variable length integer plus
+ * one byte for the key, so most take 2 or 3 bytes.
+ *
+ * @param path : Path of the file to create or overwrite
+ * @param movie : Movie with events sorted by cycle
+ * @throws FormattedException if the file cannot be written
+ */
+void saveMovie(const char *path, const Chip8Movie &movie);
+
+/**
+ * @brief Reads a movie file written by saveMovie(), or of an older version:
+ * version 2 has no quirks and version 1 no mode either.
+ *
+ * @param path : Path of the movie
+ * @throws FormattedException if the file cannot be read, is invalid or of
+ * another version
+ */
+Chip8Movie loadMovie(const char *path);
+
+/**
+ * @brief Returns true if a file starts like a movie file
+ */
+bool isMovieFile(const char *path);
+
+/**
+ * @brief Runs a system until it has executed a number of instructions,
+ * applying each event before the instruction with its cycle number. Events
+ * before the current cycle are applied first. Runs as fast as possible with
+ * the selected execution engine.
+ *
+ * @param chip8 : System to run
+ * @param events : Events sorted by cycle
+ * @param cycles : Total number of instructions, not an additional count
+ */
+void runWithInput(Chip8 &chip8, const std::vector<KeyEvent> &events,
+        unsigned long long cycles);
+
+/**
+ * @brief Replays a movie on a system that has just loaded the ROM. Sets the
+ * mode, quirks, virtual clock, cycles per tick and seed of the movie, then
+ * runs it to its end.
+ *
+ * @param chip8 : Freshly constructed system with the ROM loaded
+ * @param movie : Movie to replay
+ */
+void replayMovie(Chip8 &chip8, const Chip8Movie &movie);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * @file pulse_sink.cpp
+ * @brief Implementation of the PulseAudio sink
+ */
+
+#include <pulse/error.h>
+#include <iostream>
+
+#include "pulse_sink.h"
+
+PulseSink::PulseSink() {
+    stream = NULL;
+    running = false;
+}
+
+PulseSink::~PulseSink() {
+    stop();
+}
+
+void PulseSink::start(AudioRing *ring) {
+    AudioSink::start(ring);
+
+    pa_sample_spec spec;
+    spec.format = PA_SAMPLE_S16NE;
+    spec.rate = AUDIO_SAMPLE_RATE;
+    spec.channels = 1;
+
+    // A short server buffer keeps the buzzer close to the picture
+    pa_buffer_attr attr;
+    attr.maxlength = (uint32_t) -1;
+    attr.tlength = PULSE_BUFFER * sizeof(int16_t);
+    attr.prebuf = (uint32_t) -1;
+    attr.minreq = PULSE_CHUNK * sizeof(int16_t);
+    attr.fragsize = (uint32_t) -1;
+
+    int error;
+    stream = pa_simple_new(NULL, "Chip8 Emulator", PA_STREAM_PLAYBACK, NULL, "Buzzer",
+            &spec, NULL, &attr, &error);
+    if (stream == NULL) {
+        throw FormattedException("Could not open audio output: %s\n", pa_strerror(error));
+    }
+
+    running = true;
+    player = std::thread(&PulseSink::playLoop, this);
+}
+
+void PulseSink::playLoop() {
+    int16_t samples[PULSE_CHUNK];
+    while (running) {
+        // Samples written now are heard after everything already queued
+        int error;
+        pa_usec_t queued = pa_simple_get_latency(stream, &error);
+        read(samples, PULSE_CHUNK, queued / 1000000.0, true);
+
+        // Blocks until the server has room, which paces the loop
+        if (pa_simple_write(stream, samples, sizeof(samples), &error) < 0) {
+            std::cerr << "Audio output failed: " << pa_strerror(error) << std::endl;
+            return;
+        }
+    }
+}
+
+void PulseSink::stop() {
+    running = false;
+    if (player.joinable()) {
+        player.join();
+    }
+
+    if (stream != NULL) {
+        pa_simple_free(stream);
+        stream = NULL;
+    }
+}
+
+unsigned int PulseSink::bufferSamples() const {
+    return PULSE_BUFFER;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file pulse_sink.h
+ * @brief Audio sink playing through PulseAudio, built when libpulse-simple
+ * is installed
+ */
+
+#ifndef PULSE_SINK_H
+#define PULSE_SINK_H
+
+#include <pulse/simple.h>
+#include <atomic>
+#include <thread>
+
+#include "audio.h"
+
+// Samples written to the server at a time, about 6ms
+#define PULSE_CHUNK 256
+// Samples the server buffers ahead of playback, about 23ms
+#define PULSE_BUFFER 1024
+
+/**
+ * @class PulseSink
+ * @brief Plays the sample ring on the default output device. A thread pulls
+ * PULSE_CHUNK samples whenever the server has room, so the emulation thread
+ * never blocks on the device. Gaps in the ring are played as silence.
+ */
+class PulseSink : public AudioSink {
+private:
+    pa_simple *stream;
+    std::thread player;
+    std::atomic<bool> running;
+
+    void playLoop();
+
+public:
+    PulseSink();
+    ~PulseSink();
+
+    /**
+     * @throws FormattedException if no PulseAudio server can be reached
+     */
+    void start(AudioRing *ring) override;
+    void stop() override;
+    unsigned int bufferSamples() const override;
+};
+
+#endif
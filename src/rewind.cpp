@@ -0,0 +1,199 @@
+/**
+ * @file rewind.cpp
+ * @brief Implementation of the rewind history
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "rewind.h"
+
+// A record in the ring is the encoded delta surrounded by its length, so it
+// can be walked from both ends, plus the size of the state it restores:
+// [length][state size][delta][length]
+#define RECORD_OVERHEAD 12
+
+// Zero bytes that end a literal run of the encoding. Shorter gaps are copied
+// as literals, which is smaller than starting a new run.
+#define MIN_ZERO_RUN 4
+
+static void putWord(unsigned char *p, unsigned int value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static unsigned int getWord(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+Chip8Rewind::Chip8Rewind(size_t capacity) {
+    if (capacity < sizeof(encoded) + RECORD_OVERHEAD) {
+        throw std::invalid_argument("Rewind capacity too small");
+    }
+
+    ring.resize(capacity);
+    clear();
+}
+
+void Chip8Rewind::clear() {
+    head = 0;
+    used = 0;
+    deltas = 0;
+    latestSize = 0;
+}
+
+size_t Chip8Rewind::frames() const {
+    return latestSize == 0 ? 0 : deltas + 1;
+}
+
+size_t Chip8Rewind::size() const {
+    return used;
+}
+
+void Chip8Rewind::record(const Chip8 &chip8) {
+    size_t stateSize = chip8.saveState(state, sizeof(state));
+    memset(state + stateSize, 0, sizeof(state) - stateSize);
+
+    if (latestSize == 0) {
+        memcpy(latest, state, sizeof(latest));
+        latestSize = stateSize;
+        return;
+    }
+
+    // The delta turns the new state back into the previous one
+    for (size_t i = 0; i < sizeof(latest); i++) {
+        latest[i] ^= state[i];
+    }
+    size_t length = encode(latest, encoded);
+
+    // Make room by forgetting the oldest frames
+    size_t recordSize = length + RECORD_OVERHEAD;
+    while (used + recordSize > ring.size()) {
+        dropOldest();
+    }
+
+    unsigned char header[8];
+    putWord(header, length);
+    putWord(header + 4, latestSize);
+
+    size_t tail = (head + used) % ring.size();
+    ringWrite(tail, header, 8);
+    ringWrite((tail + 8) % ring.size(), encoded, length);
+    ringWrite((tail + 8 + length) % ring.size(), header, 4);
+    used += recordSize;
+    deltas++;
+
+    memcpy(latest, state, sizeof(latest));
+    latestSize = stateSize;
+}
+
+bool Chip8Rewind::rewind(Chip8 &chip8) {
+    if (deltas == 0) {
+        return false;
+    }
+
+    // Walk the newest record backwards from its trailing length
+    size_t end = head + used;
+    unsigned char word[4];
+    ringRead((end - 4) % ring.size(), word, 4);
+    size_t length = getWord(word);
+    size_t start = end - length - RECORD_OVERHEAD;
+    ringRead((start + 4) % ring.size(), word, 4);
+    size_t stateSize = getWord(word);
+    ringRead((start + 8) % ring.size(), encoded, length);
+
+    decode(encoded, length, state);
+    for (size_t i = 0; i < sizeof(latest); i++) {
+        latest[i] ^= state[i];
+    }
+    latestSize = stateSize;
+    used -= length + RECORD_OVERHEAD;
+    deltas--;
+
+    chip8.loadState(latest, latestSize);
+    return true;
+}
+
+void Chip8Rewind::dropOldest() {
+    unsigned char word[4];
+    ringRead(head, word, 4);
+    size_t recordSize = getWord(word) + RECORD_OVERHEAD;
+
+    head = (head + recordSize) % ring.size();
+    used -= recordSize;
+    deltas--;
+}
+
+void Chip8Rewind::ringWrite(size_t offset, const unsigned char *data, size_t size) {
+    size_t first = std::min(size, ring.size() - offset);
+    memcpy(&ring[offset], data, first);
+    memcpy(&ring[0], data + first, size - first);
+}
+
+void Chip8Rewind::ringRead(size_t offset, unsigned char *data, size_t size) const {
+    size_t first = std::min(size, ring.size() - offset);
+    memcpy(data, &ring[offset], first);
+    memcpy(data + first, &ring[0], size - first);
+}
+
+size_t Chip8Rewind::encode(const unsigned char *delta, unsigned char *out) {
+    // Pairs of (zero bytes, literal bytes) as 16 bit counts, each followed
+    // by its literal bytes, covering all CHIP8_STATE_MAX_SIZE bytes
+    size_t in = 0;
+    size_t length = 0;
+
+    while (in < CHIP8_STATE_MAX_SIZE) {
+        size_t zeros = in;
+        // Skip unchanged bytes a word at a time
+        while (zeros + 8 <= CHIP8_STATE_MAX_SIZE) {
+            uint64_t word;
+            memcpy(&word, delta + zeros, 8);
+            if (word != 0) {
+                break;
+            }
+            zeros += 8;
+        }
+        while (zeros < CHIP8_STATE_MAX_SIZE && delta[zeros] == 0) {
+            zeros++;
+        }
+
+        // Literal run up to the next long enough run of zeros
+        size_t literal = zeros;
+        size_t gap = 0;
+        while (literal + gap < CHIP8_STATE_MAX_SIZE && gap < MIN_ZERO_RUN) {
+            if (delta[literal + gap] == 0) {
+                gap++;
+            } else {
+                literal += gap + 1;
+                gap = 0;
+            }
+        }
+
+        out[length] = zeros - in;
+        out[length + 1] = (zeros - in) >> 8;
+        out[length + 2] = literal - zeros;
+        out[length + 3] = (literal - zeros) >> 8;
+        memcpy(out + length + 4, delta + zeros, literal - zeros);
+        length += 4 + literal - zeros;
+        in = literal;
+    }
+
+    return length;
+}
+
+void Chip8Rewind::decode(const unsigned char *in, size_t size, unsigned char *delta) {
+    memset(delta, 0, CHIP8_STATE_MAX_SIZE);
+
+    size_t out = 0;
+    size_t i = 0;
+    while (i < size) {
+        size_t zeros = in[i] | in[i + 1] << 8;
+        size_t literal = in[i + 2] | in[i + 3] << 8;
+        out += zeros;
+        memcpy(delta + out, in + i + 4, literal);
+        out += literal;
+        i += 4 + literal;
+    }
+}
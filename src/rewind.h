@@ -0,0 +1,84 @@
+/**
+ * @file rewind.h
+ * @brief Rewind history of Chip8 states with delta compressed frames
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <vector>
+
+#include "chip8.h"
+
+// Default size of the history, about 10 minutes of typical gameplay
+#define REWIND_CAPACITY (4 * 1024 * 1024)
+
+/**
+ * @class Chip8Rewind
+ * @brief Fixed size ring buffer of save states, recorded once per frame.
+ *
+ * Only the newest state is kept whole. Every older state is stored as the
+ * XOR of itself with the state after it, run-length encoded, so a frame in
+ * which little changed takes a few bytes. Stepping back decodes the newest
+ * delta into the newest state. When the buffer is full the oldest frames are
+ * dropped. No allocation happens after construction.
+ */
+class Chip8Rewind {
+private:
+    std::vector<unsigned char> ring;
+    size_t head;  // Offset of the oldest record
+    size_t used;  // Bytes of records in the ring
+    size_t deltas;  // Number of records
+
+    // Newest state, padded with zeros to CHIP8_STATE_MAX_SIZE
+    unsigned char latest[CHIP8_STATE_MAX_SIZE];
+    size_t latestSize;  // 0 if nothing is recorded
+    unsigned char state[CHIP8_STATE_MAX_SIZE];
+    unsigned char encoded[2 * CHIP8_STATE_MAX_SIZE];
+
+    void ringWrite(size_t offset, const unsigned char *data, size_t size);
+    void ringRead(size_t offset, unsigned char *data, size_t size) const;
+    void dropOldest();
+
+    static size_t encode(const unsigned char *delta, unsigned char *out);
+    static void decode(const unsigned char *in, size_t size, unsigned char *delta);
+
+public:
+    /**
+     * @brief Creates an empty history.
+     *
+     * @param capacity : Bytes available for the deltas of older frames
+     * @throws invalid_argument if capacity cannot hold a single frame
+     */
+    Chip8Rewind(size_t capacity = REWIND_CAPACITY);
+
+    /**
+     * @brief Records the current state of a system as the newest frame
+     */
+    void record(const Chip8 &chip8);
+
+    /**
+     * @brief Drops the newest frame and restores the one before it.
+     *
+     * @param chip8 : System to restore
+     * @return false if there is no older frame, chip8 is unchanged
+     */
+    bool rewind(Chip8 &chip8);
+
+    /**
+     * @brief Forgets all recorded frames
+     */
+    void clear();
+
+    /**
+     * @brief Returns the number of frames that can be restored
+     */
+    size_t frames() const;
+
+    /**
+     * @brief Returns the number of bytes used by the deltas
+     */
+    size_t size() const;
+};
+
+#endif
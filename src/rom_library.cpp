@@ -0,0 +1,141 @@
+/**
+ * @file rom_library.cpp
+ * @brief Implementation of the ROM library
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include "rom_library.h"
+
+/**
+ * @brief An image and the mapping backing it
+ */
+struct RomLibrary::Mapping {
+    RomImage image;
+    void *address;  // MAP_FAILED if nothing is mapped
+    size_t length;
+
+    Mapping() : address(MAP_FAILED), length(0) {}
+
+    ~Mapping() {
+        if (address != MAP_FAILED) {
+            munmap(address, length);
+        }
+    }
+};
+
+static unsigned long long hashData(const unsigned char *data, size_t size) {
+    // 64 bit FNV-1a
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static Chip8Mode detectPlatform(const unsigned char *data, size_t size) {
+    // Follow the first instructions as they run, taking jumps, so data that
+    // a program jumps over is not mistaken for code
+    size_t offset = 0;
+    for (int i = 0; i < ROM_DETECT_INSTRUCTIONS && offset + 1 < size; i++) {
+        unsigned short opcode = data[offset] << 8 | data[offset + 1];
+        if (opcode == 0x00FE || opcode == 0x00FF) {
+            return CHIP8_MODE_SCHIP;
+        }
+
+        if ((opcode & 0xF000) == 0x1000) {
+            if ((opcode & 0x0FFF) < ROM_START) {
+                break;
+            }
+            offset = (opcode & 0x0FFF) - ROM_START;
+        } else {
+            offset += 2;
+        }
+    }
+    return CHIP8_MODE_CHIP8;
+}
+
+RomLibrary::RomLibrary() : count(0) {
+}
+
+// Out of line, where Mapping is complete
+RomLibrary::~RomLibrary() {
+}
+
+const RomImage &RomLibrary::load(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto known = paths.find(path);
+    if (known != paths.end()) {
+        return *known->second;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw FormattedException("Could not open ROM file: %s\n", path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        throw FormattedException("Could not open ROM file: %s\n", path);
+    }
+    if (info.st_size > ROM_END - ROM_START) {
+        close(fd);
+        throw std::invalid_argument("ROM file too big");
+    }
+
+    std::unique_ptr<Mapping> mapping(new Mapping());
+    mapping->length = info.st_size;
+    if (mapping->length > 0) {
+        // Private and read-only, the file is never written through it
+        mapping->address = mmap(NULL, mapping->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping->length > 0 && mapping->address == MAP_FAILED) {
+        throw FormattedException("Could not map ROM file: %s\n", path);
+    }
+
+    RomImage &image = mapping->image;
+    image.data = mapping->length > 0 ? (const unsigned char *) mapping->address : NULL;
+    image.size = mapping->length;
+    image.hash = hashData(image.data, image.size);
+    image.platform = detectPlatform(image.data, image.size);
+    image.path = path;
+
+    // Copies of a ROM share the image loaded first. The hash only narrows
+    // the search, the contents have to match.
+    const RomImage *shared = NULL;
+    std::vector<std::unique_ptr<Mapping>> &candidates = images[image.hash];
+    for (const std::unique_ptr<Mapping> &same : candidates) {
+        const RomImage &other = same->image;
+        // Empty images have no data to compare
+        if (other.size == image.size &&
+                (image.size == 0 || memcmp(other.data, image.data, image.size) == 0)) {
+            shared = &other;
+            break;
+        }
+    }
+    if (shared == NULL) {
+        shared = &image;
+        candidates.push_back(std::move(mapping));
+        count++;
+    }
+    paths.emplace(path, shared);
+    return *shared;
+}
+
+const RomImage *RomLibrary::find(unsigned long long hash) const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto image = images.find(hash);
+    return image != images.end() ? &image->second.front()->image : NULL;
+}
+
+size_t RomLibrary::size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return count;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file rom_library.h
+ * @brief ROM library: ROM files memory-mapped once and shared read-only by
+ * every instance that runs them
+ */
+
+#ifndef ROM_LIBRARY_H
+#define ROM_LIBRARY_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chip8.h"
+
+// SUPER-CHIP programs switch resolution with 00FE/00FF almost immediately,
+// so only the first instructions executed are looked at
+#define ROM_DETECT_INSTRUCTIONS 16
+
+/**
+ * @brief A ROM file mapped into memory. The data stays valid and unchanged
+ * for the lifetime of the library that loaded it.
+ */
+struct RomImage {
+    const unsigned char *data;  // Read-only, NULL if the file is empty
+    size_t size;
+    unsigned long long hash;  // 64 bit FNV-1a of the data, as hashRomFile()
+    Chip8Mode platform;  // Detected instruction set, see RomLibrary::load()
+    std::string path;  // File the image was first loaded from
+};
+
+/**
+ * @class RomLibrary
+ * @brief Maps each ROM file once and indexes the images by content hash, so
+ * copies of a ROM under other paths share one image. Instances are loaded
+ * from an image with Chip8::loadRom(data, size), a memcpy without any file
+ * access. Safe to use from several threads.
+ */
+class RomLibrary {
+private:
+    struct Mapping;
+
+    mutable std::mutex lock;
+    // By hash, in load order
+    std::unordered_map<unsigned long long, std::vector<std::unique_ptr<Mapping>>> images;
+    size_t count;  // Of images, over all hashes
+    std::unordered_map<std::string, const RomImage *> paths;
+
+public:
+    RomLibrary();
+    ~RomLibrary();
+
+    // Owns the mappings, so copies are not allowed
+    RomLibrary(const RomLibrary &) = delete;
+    RomLibrary &operator=(const RomLibrary &) = delete;
+
+    /**
+     * @brief Returns the image of a ROM file, mapping it on first use of the
+     * path. A file with the same content as an image already loaded is
+     * unmapped again and shares that image; files whose hashes collide keep
+     * images of their own. The platform is
+     * CHIP8_MODE_SCHIP if one of the first ROM_DETECT_INSTRUCTIONS
+     * instructions is 00FE or 00FF, following jumps from ROM_START.
+     *
+     * @param path : Path to the ROM file
+     * @return Image, valid until the library is destroyed
+     * @throws FormattedException if the file cannot be opened or mapped
+     * @throws invalid_argument if the ROM file is greater than the allocated memory
+     */
+    const RomImage &load(const char *path);
+
+    /**
+     * @brief Looks up a loaded image by content hash
+     *
+     * @return Image, the first one loaded if the hashes of several collide,
+     * or NULL if no loaded file has this hash
+     */
+    const RomImage *find(unsigned long long hash) const;
+
+    /**
+     * @brief Returns the number of distinct images loaded
+     */
+    size_t size() const;
+};
+
+#endif
@@ -0,0 +1,440 @@
+/**
+ * @file run.cpp
+ * @brief Headless batch runner. Executes a ROM for a fixed number of cycles or
+ * frames as fast as possible and reports throughput and the final display hash.
+ * With -b, runs every job of a manifest in parallel and reports one line each.
+ * With -l, runs many instances of one ROM in lockstep on the batch engine.
+ * With -r, replays a recorded movie and checks that it ends on the recorded
+ * display. With -a, also renders the buzzer into a WAV file. With -A, runs
+ * ahead every frame like the emulator and reports what it costs. With -s, runs
+ * the ROM as SUPER-CHIP. With -q, runs it with the behaviour of another
+ * interpreter where they disagree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "audio.h"
+#include "batch.h"
+#include "chip8.h"
+#include "chip8_batch.h"
+#include "movie.h"
+#include "run_ahead.h"
+#include "thread_pool.h"
+
+#define DEFAULT_CYCLES 1000000ULL
+
+// Profiling builds can write the execution counters of a single ROM run
+#ifdef CHIP8_PROFILE
+#define OPTIONS "c:f:t:m:b:j:l:r:a:A:sq:p:"
+#else
+#define OPTIONS "c:f:t:m:b:j:l:r:a:A:sq:"
+#endif
+
+static void usage() {
+    std::cerr << "Usage: chip8-run [-c cycles | -f frames] [-t cycles_per_tick] "
+        "[-m interpreter|threaded|jit|aot | -l lanes] [-a audio.wav] [-A run_ahead_frames] "
+        "[-s] [-q quirks] romfile.rom" << std::endl;
+#ifdef CHIP8_PROFILE
+    std::cerr << "       chip8-run -p profile.txt [-c cycles | -f frames] "
+        "[-t cycles_per_tick] [-s] [-q quirks] romfile.rom" << std::endl;
+#endif
+    std::cerr << "       chip8-run -b manifest [-j threads] [-t cycles_per_tick] "
+        "[-m interpreter|threaded|jit|aot] [-q quirks]" << std::endl;
+    std::cerr << "       chip8-run -r movie [-m interpreter|threaded|jit|aot] romfile.rom" << std::endl;
+    std::cerr << "quirks: none, cosmac, schip or a comma separated list of "
+        "shift_vy, memory_i, jump_vx, clip, vf_reset" << std::endl;
+}
+
+static bool parseCore(const char *name, Chip8Core *core) {
+    if (strcmp(name, "interpreter") == 0) {
+        *core = CHIP8_CORE_INTERPRETER;
+    } else if (strcmp(name, "threaded") == 0) {
+        *core = CHIP8_CORE_THREADED;
+    } else if (strcmp(name, "jit") == 0) {
+        *core = CHIP8_CORE_JIT;
+    } else if (strcmp(name, "aot") == 0) {
+        *core = CHIP8_CORE_AOT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static int runBatch(const char *manifest, unsigned int threads, Chip8Core core,
+        unsigned int cyclesPerTick, unsigned int quirks) {
+    std::vector<BatchJob> jobs;
+    try {
+        jobs = loadManifest(manifest, quirks);
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return -1;
+    }
+
+    std::vector<BatchResult> results(jobs.size());
+    unsigned int workers;
+    // Each ROM file is read once, however many jobs run it
+    RomLibrary library;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(threads);
+        workers = pool.size();
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&jobs, &results, &library, i, core, cyclesPerTick] {
+                runBatchJob(jobs[i], library, core, cyclesPerTick, results[i]);
+            });
+        }
+        pool.wait();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    // Report in manifest order regardless of which job finished first
+    int failed = 0;
+    unsigned long long executed = 0;
+    printf("# rom\tseed\tcycles\tseconds\tgfx_hash\terror\n");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchResult &result = results[i];
+        printf("%s\t%u\t%llu\t%.6f\t%016llx\t%s\n", jobs[i].rom.c_str(),
+                jobs[i].seed, result.cycles, result.seconds, result.gfxHash,
+                result.error.empty() ? "-" : result.error.c_str());
+        executed += result.cycles;
+        if (!result.error.empty()) {
+            failed++;
+        }
+    }
+
+    printf("# jobs: %zu\n", jobs.size());
+    printf("# roms: %zu\n", library.size());
+    printf("# failed: %d\n", failed);
+    printf("# threads: %u\n", workers);
+    printf("# seconds: %.6f\n", seconds);
+    printf("# instructions_per_second: %.0f\n", seconds > 0 ? executed / seconds : 0.0);
+
+    return failed > 0 ? 1 : 0;
+}
+
+static int runLanes(const char *rom, unsigned int lanes, unsigned long long cycles,
+        unsigned int cyclesPerTick) {
+    Chip8Batch batch(lanes);
+    double seconds;
+
+    try {
+        // Lane i is seeded with i, like a Chip8 with setSeed(i)
+        batch.setCyclesPerTick(cyclesPerTick);
+        for (unsigned int lane = 0; lane < lanes; lane++) {
+            batch.setSeed(lane, lane);
+        }
+        batch.loadRom(rom);
+
+        auto start = std::chrono::steady_clock::now();
+        batch.runCycles(cycles);
+        auto end = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(end - start).count();
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return 1;
+    }
+
+    int failed = 0;
+    unsigned long long executed = 0;
+    for (unsigned int lane = 0; lane < lanes; lane++) {
+        executed += batch.getCycles(lane);
+        if (!batch.getError(lane).empty()) {
+            failed++;
+        }
+    }
+
+    printf("rom: %s\n", rom);
+    printf("lanes: %u\n", lanes);
+    printf("failed: %d\n", failed);
+    printf("cycles: %llu\n", executed);
+    printf("seconds: %.6f\n", seconds);
+    printf("instructions_per_second: %.0f\n", seconds > 0 ? executed / seconds : 0.0);
+    for (unsigned int lane = 0; lane < lanes; lane++) {
+        printf("gfx_hash[%u]: %016llx %s\n", lane, batch.hashGfx(lane),
+                batch.getError(lane).c_str());
+    }
+
+    return failed > 0 ? 1 : 0;
+}
+
+static int runMovie(const char *rom, const char *path, Chip8Core core) {
+    Chip8 *chip8 = new Chip8();
+    Chip8Movie movie;
+    double seconds;
+
+    try {
+        movie = loadMovie(path);
+        if (hashRomFile(rom) != movie.romHash) {
+            throw FormattedException("%s was not recorded on %s\n", path, rom);
+        }
+        chip8->setCore(core);
+        chip8->loadRom(rom);
+
+        auto start = std::chrono::steady_clock::now();
+        replayMovie(*chip8, movie);
+        auto end = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(end - start).count();
+    } catch (const std::exception &e) {
+        std::cerr << "Error after " << chip8->getCycles() << " cycles: " << e.what();
+        delete chip8;
+        return 1;
+    }
+
+    unsigned long long executed = chip8->getCycles();
+    bool match = chip8->hashGfx() == movie.gfxHash;
+    printf("rom: %s\n", rom);
+    printf("movie: %s\n", path);
+    printf("events: %zu\n", movie.events.size());
+    printf("cycles: %llu\n", executed);
+    printf("frames: %llu\n", executed / movie.cyclesPerTick);
+    printf("seconds: %.6f\n", seconds);
+    printf("instructions_per_second: %.0f\n", seconds > 0 ? executed / seconds : 0.0);
+    printf("gfx_hash: %016llx\n", chip8->hashGfx());
+    printf("replay: %s\n", match ? "match" : "desync");
+
+    delete chip8;
+    return match ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long cycles = DEFAULT_CYCLES;
+    unsigned long long frames = 0;
+    unsigned int cyclesPerTick = CYCLES_PER_FRAME;
+    Chip8Core core = CHIP8_CORE_INTERPRETER;
+    const char *manifest = NULL;
+    unsigned int threads = 0;
+    unsigned int lanes = 0;
+    const char *profile = NULL;
+    const char *movie = NULL;
+    const char *audioPath = NULL;
+    unsigned int runAheadFrames = 0;
+    Chip8Mode mode = CHIP8_MODE_CHIP8;
+    unsigned int quirks = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+            case 'c':
+                cycles = strtoull(optarg, NULL, 0);
+                frames = 0;
+                break;
+
+            case 'f':
+                frames = strtoull(optarg, NULL, 0);
+                break;
+
+            case 't':
+                cyclesPerTick = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'm':
+                if (!parseCore(optarg, &core)) {
+                    usage();
+                    return -1;
+                }
+                break;
+
+            case 'b':
+                manifest = optarg;
+                break;
+
+            case 'j':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'l':
+                lanes = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'r':
+                movie = optarg;
+                break;
+
+            case 'p':
+                profile = optarg;
+                break;
+
+            case 'a':
+                audioPath = optarg;
+                break;
+
+            case 'A':
+                runAheadFrames = strtoul(optarg, NULL, 0);
+                if (runAheadFrames > RUN_AHEAD_MAX_FRAMES) {
+                    usage();
+                    return -1;
+                }
+                break;
+
+            case 's':
+                mode = CHIP8_MODE_SCHIP;
+                break;
+
+            case 'q':
+                if (!chip8ParseQuirks(optarg, &quirks)) {
+                    usage();
+                    return -1;
+                }
+                break;
+
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    // The batch engine and batch jobs only run CHIP-8, movies set their
+    // own mode
+    if (mode == CHIP8_MODE_SCHIP && (manifest || lanes > 0 || movie)) {
+        usage();
+        return -1;
+    }
+
+    // The batch engine has no quirks and movies record their own
+    if (quirks != 0 && (lanes > 0 || movie)) {
+        usage();
+        return -1;
+    }
+
+    if (manifest) {
+        if (optind != argc) {
+            usage();
+            return -1;
+        }
+        return runBatch(manifest, threads, core, cyclesPerTick, quirks);
+    }
+
+    if (optind != argc - 1) {
+        // Must specify exactly one ROM
+        usage();
+        return -1;
+    }
+
+    char *rom = argv[optind];
+
+    if (frames > 0) {
+        // A frame is one 60Hz tick of the virtual clock
+        cycles = frames * cyclesPerTick;
+    }
+
+    if (lanes > 0) {
+        return runLanes(rom, lanes, cycles, cyclesPerTick);
+    }
+
+    if (movie) {
+        // The movie sets its own length, seed and cycles per tick
+        return runMovie(rom, movie, core);
+    }
+
+    Chip8 *chip8 = new Chip8();
+    unsigned long long executed = 0;
+    double seconds;
+    int status = 0;
+    WavSink wav(audioPath ? audioPath : "");
+    Chip8Audio *audio = NULL;
+    Chip8RunAhead runAhead(runAheadFrames);
+
+    try {
+        // Virtual clock so that runs are reproducible
+        chip8->setClockMode(CHIP8_CLOCK_VIRTUAL);
+        chip8->setCyclesPerTick(cyclesPerTick);
+        chip8->setCore(core);
+        chip8->setMode(mode);
+        chip8->setQuirks(quirks);
+        chip8->loadRom(rom);
+
+        if (audioPath) {
+            audio = new Chip8Audio(*chip8, &wav);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (audio || runAheadFrames > 0) {
+            // Frame by frame, so the audio ring never fills up and run-ahead
+            // happens where the emulator would do it
+            while (chip8->getCycles() < cycles) {
+                chip8->runCycles(std::min<unsigned long long>(cyclesPerTick,
+                            cycles - chip8->getCycles()));
+                if (audio) {
+                    audio->renderFrame(*chip8);
+                }
+                runAhead.run(*chip8);
+            }
+            if (audio) {
+                audio->stop();
+            }
+        } else {
+            chip8->runCycles(cycles);
+        }
+        auto end = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(end - start).count();
+        executed = chip8->getCycles();
+    } catch (const std::exception &e) {
+        executed = chip8->getCycles();
+        std::cerr << "Error after " << executed << " cycles: " << e.what();
+        status = 1;
+    }
+
+#ifdef CHIP8_PROFILE
+    if (profile) {
+        try {
+            chip8->dumpProfile(profile);
+        } catch (const std::exception &e) {
+            std::cerr << e.what();
+            status = 1;
+        }
+    }
+#else
+    (void) profile;
+#endif
+
+    if (status != 0) {
+        delete audio;
+        delete chip8;
+        return status;
+    }
+
+    printf("rom: %s\n", rom);
+    printf("cycles: %llu\n", executed);
+    printf("frames: %llu\n", executed / cyclesPerTick);
+    printf("seconds: %.6f\n", seconds);
+    printf("instructions_per_second: %.0f\n", seconds > 0 ? executed / seconds : 0.0);
+    printf("gfx_hash: %016llx\n", chip8->hashGfx());
+
+    if (core == CHIP8_CORE_THREADED) {
+        // Sequences that ran as one handler, and the dispatches that saved
+        // at most
+        const unsigned long long *fusions = chip8->getFusions();
+        for (int i = 0; i < CHIP8_FUSIONS; i++) {
+            printf("fused[%s]: %llu\n", CHIP8_FUSION_NAMES[i], fusions[i]);
+        }
+    }
+
+    if (runAheadFrames > 0) {
+        // Run-ahead is included in seconds above
+        double perRun = runAhead.secondsPerRun();
+        printf("run_ahead_frames: %u\n", runAheadFrames);
+        printf("run_ahead_us_per_frame: %.3f\n", perRun * 1e6);
+        printf("run_ahead_us_per_extra_frame: %.3f\n", perRun * 1e6 / runAheadFrames);
+    }
+
+    if (audio) {
+        AudioStats stats = audio->getStats();
+        printf("audio_samples: %llu\n", stats.rendered);
+        printf("audio_dropped: %llu\n", stats.dropped);
+        printf("audio_ring_samples: %u\n", stats.ringSamples);
+        printf("audio_buzzer_starts: %llu\n", stats.starts);
+        printf("audio_latency_ms_mean: %.3f\n", stats.latencyMean * 1000);
+        printf("audio_latency_ms_max: %.3f\n", stats.latencyMax * 1000);
+        delete audio;
+    }
+
+    delete chip8;
+    return 0;
+}
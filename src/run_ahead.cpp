@@ -0,0 +1,60 @@
+/**
+ * @file run_ahead.cpp
+ * @brief Implementation of run-ahead
+ */
+
+#include <chrono>
+#include <stdexcept>
+
+#include "run_ahead.h"
+
+Chip8RunAhead::Chip8RunAhead(unsigned int frames) {
+    if (frames > RUN_AHEAD_MAX_FRAMES) {
+        throw std::invalid_argument("Too many frames to run ahead");
+    }
+
+    this->frames = frames;
+    memset(gfx, 0, sizeof(gfx));
+    runs = 0;
+    seconds = 0;
+}
+
+bool Chip8RunAhead::run(Chip8 &chip8) {
+    if (frames == 0) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t size = chip8.saveState(state, sizeof(state));
+    chip8.saveCounters(counters);
+    bool ok = true;
+    try {
+        chip8.runCycles((unsigned long long) frames * chip8.getCyclesPerTick());
+        if (chip8.getMode() == CHIP8_MODE_SCHIP) {
+            memcpy(gfx, chip8.getSchipGfx(), SCHIP_GFX_WORDS * sizeof(uint64_t));
+        } else {
+            memcpy(gfx, chip8.getGfx(), GFX_Y * sizeof(uint64_t));
+        }
+    } catch (const std::exception &) {
+        ok = false;
+    }
+    chip8.loadState(state, size);
+    chip8.loadCounters(counters);
+    auto end = std::chrono::steady_clock::now();
+
+    runs++;
+    seconds += std::chrono::duration<double>(end - start).count();
+    return ok;
+}
+
+const uint64_t *Chip8RunAhead::getGfx() const {
+    return gfx;
+}
+
+unsigned int Chip8RunAhead::getFrames() const {
+    return frames;
+}
+
+double Chip8RunAhead::secondsPerRun() const {
+    return runs > 0 ? seconds / runs : 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file run_ahead.h
+ * @brief Run-ahead: shows the display a few frames in the future to hide
+ * the frames a game takes to react to input
+ */
+
+#ifndef RUN_AHEAD_H
+#define RUN_AHEAD_H
+
+#include "chip8.h"
+
+// Most games react within a few frames, more only adds cost
+#define RUN_AHEAD_MAX_FRAMES 8
+
+/**
+ * @class Chip8RunAhead
+ * @brief Runs a system a number of frames ahead with its current keys, keeps
+ * the display it reaches, then restores the system from an in-memory save
+ * state. The system ends exactly as it started, so movies, rewind, audio and
+ * the statistics of the system only ever see the real frames. No allocation
+ * happens after construction.
+ */
+class Chip8RunAhead {
+private:
+    unsigned int frames;
+    unsigned char state[CHIP8_STATE_MAX_SIZE];
+    Chip8Counters counters;  // Restored too, so statistics skip the frames ahead
+    uint64_t gfx[SCHIP_GFX_WORDS];  // Large enough for either mode
+
+    unsigned long long runs;
+    double seconds;  // Spent in run(), saving and restoring included
+
+public:
+    /**
+     * @param frames : Frames to run ahead, 0 to disable
+     * @throws invalid_argument if frames is above RUN_AHEAD_MAX_FRAMES
+     */
+    Chip8RunAhead(unsigned int frames);
+
+    /**
+     * @brief Runs the system ahead and restores it. Frames are ticks of the
+     * virtual clock. If the system fails ahead, the error is left for the
+     * real run to report and the current display is kept.
+     *
+     * @return false if disabled or the system failed ahead
+     */
+    bool run(Chip8 &chip8);
+
+    /**
+     * @brief Returns the display reached by the last run(), laid out like
+     * Chip8::getGfx() or Chip8::getSchipGfx() depending on the mode
+     */
+    const uint64_t *getGfx() const;
+
+    /**
+     * @brief Returns the number of frames run ahead, 0 if disabled
+     */
+    unsigned int getFrames() const;
+
+    /**
+     * @brief Returns the mean time of a run() in seconds, the extra cost per
+     * displayed frame
+     */
+    double secondsPerRun() const;
+};
+
+#endif
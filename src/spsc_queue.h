@@ -0,0 +1,118 @@
+/**
+ * @file spsc_queue.h
+ * @brief Lock-free bounded queue between one producer and one consumer thread
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+
+/**
+ * @class SpscQueue
+ * @brief Fixed size ring of values. One thread pushes and one other thread
+ * pops, without locks. Each side only writes its own index.
+ *
+ * @tparam T : Value type, copied in and out
+ * @tparam N : Capacity, a power of 2
+ */
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of 2");
+
+private:
+    T items[N];
+    // Running counts of pushed and popped values, wrapped into items by N.
+    // Padded apart instead of alignas, which C++14 does not honour for new.
+    char padItems[64];
+    std::atomic<size_t> tail;
+    char padTail[64];
+    std::atomic<size_t> head;
+
+public:
+    SpscQueue() : tail(0), head(0) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    /**
+     * @brief Appends a value. Producer thread only.
+     *
+     * @return false if the queue is full, the value is dropped
+     */
+    bool push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Removes the oldest value. Consumer thread only.
+     *
+     * @return false if the queue is empty, item is unchanged
+     */
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Appends as many values of an array as fit. Producer thread only.
+     *
+     * @return Number of values appended, the rest are dropped
+     */
+    size_t push(const T *values, size_t count) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        count = std::min(count, N - (t - head.load(std::memory_order_acquire)));
+        for (size_t i = 0; i < count; i++) {
+            items[(t + i) & (N - 1)] = values[i];
+        }
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @brief Removes up to count of the oldest values. Consumer thread only.
+     *
+     * @return Number of values removed
+     */
+    size_t pop(T *values, size_t count) {
+        size_t h = head.load(std::memory_order_relaxed);
+        count = std::min(count, tail.load(std::memory_order_acquire) - h);
+        for (size_t i = 0; i < count; i++) {
+            values[i] = items[(h + i) & (N - 1)];
+        }
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @brief Returns the number of values waiting. The other side may change
+     * it at any time, so it is a lower bound on the consumer thread and an
+     * upper bound on the producer thread.
+     */
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Returns true if there is nothing to pop. Consumer thread only.
+     */
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) ==
+            tail.load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * @file thread_pool.cpp
+ * @brief Implementation of the work-stealing thread pool
+ */
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        if (threads == 0) {
+            threads = 1;
+        }
+    }
+
+    queued = 0;
+    pending = 0;
+    next = 0;
+    stopping = false;
+
+    for (unsigned int i = 0; i < threads; i++) {
+        workers.emplace_back(new Worker());
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        this->threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+
+    {
+        std::lock_guard<std::mutex> guard(stateLock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    unsigned int target;
+    {
+        // Counted before it is pushed so that queued never underflows. A
+        // worker woken early just retries until the push lands.
+        std::lock_guard<std::mutex> guard(stateLock);
+        target = next;
+        next = (next + 1) % workers.size();
+        pending++;
+        queued++;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(workers[target]->lock);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> guard(stateLock);
+    idle.wait(guard, [this] { return pending == 0; });
+}
+
+unsigned int ThreadPool::size() const {
+    return workers.size();
+}
+
+bool ThreadPool::take(unsigned int self, std::function<void()> &task) {
+    // Newest task from our own deque first, it is most likely still cached
+    {
+        Worker &own = *workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Otherwise steal the oldest task of another worker
+    for (unsigned int i = 1; i < workers.size(); i++) {
+        Worker &victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::workerLoop(unsigned int self) {
+    for (;;) {
+        std::function<void()> task;
+        if (take(self, task)) {
+            {
+                std::lock_guard<std::mutex> guard(stateLock);
+                queued--;
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> guard(stateLock);
+            if (--pending == 0) {
+                idle.notify_all();
+            }
+            continue;
+        }
+
+        // Nothing to run or steal, sleep until more work is queued
+        std::unique_lock<std::mutex> guard(stateLock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/**
+ * @file thread_pool.h
+ * @brief Work-stealing thread pool for running independent jobs on all cores
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @class ThreadPool
+ * @brief Fixed set of worker threads, each with its own task deque. Workers
+ * run their own tasks newest first and steal the oldest task of another
+ * worker when they run out, so uneven jobs still keep every core busy.
+ */
+class ThreadPool {
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex stateLock;
+    std::condition_variable wake;  // Signalled when tasks are queued
+    std::condition_variable idle;  // Signalled when all tasks are done
+    unsigned long queued;  // Tasks waiting in a deque
+    unsigned long pending;  // Tasks queued or running
+    unsigned int next;  // Worker receiving the next submitted task
+    bool stopping;
+
+    bool take(unsigned int self, std::function<void()> &task);
+    void workerLoop(unsigned int self);
+
+public:
+    /**
+     * @brief Starts the worker threads.
+     *
+     * @param threads : Number of workers, 0 for one per hardware thread
+     */
+    ThreadPool(unsigned int threads = 0);
+
+    /**
+     * @brief Waits for all submitted tasks and stops the workers
+     */
+    ~ThreadPool();
+
+    /**
+     * @brief Queues a task. Tasks must not throw.
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     * @brief Blocks until every submitted task has finished
+     */
+    void wait();
+
+    /**
+     * @brief Returns the number of worker threads
+     */
+    unsigned int size() const;
+};
+
+#endif
@@ -0,0 +1,81 @@
+/**
+ * @file triple_buffer.h
+ * @brief Lock-free triple buffer for handing frames from one thread to another
+ */
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+/**
+ * @class TripleBuffer
+ * @brief Three copies of a value shared by one writer and one reader. The
+ * writer fills the back copy and publishes it by swapping it with the middle
+ * one; the reader swaps the middle copy with its front one when a newer
+ * value was published. Neither side ever waits for the other, and the reader
+ * always sees a complete value, skipping values it was too slow to read.
+ */
+template <typename T>
+class TripleBuffer {
+private:
+    // The middle index carries a flag set when it holds an unread value
+    static const unsigned int INDEX_MASK = 3;
+    static const unsigned int FRESH = 4;
+
+    // Padded apart so the writer and the reader do not share cache lines.
+    // Padding instead of alignas, which C++14 does not honour for new.
+    T slots[3];
+    unsigned int back;  // Writer only
+    char padBack[64];
+    std::atomic<unsigned int> middle;
+    char padMiddle[64];
+    unsigned int front;  // Reader only
+
+public:
+    /**
+     * @brief Creates a buffer with three value-initialized copies
+     */
+    TripleBuffer() : slots(), back(0), middle(1), front(2) {}
+
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+    /**
+     * @brief Returns the copy the writer fills next. Writer thread only.
+     */
+    T &writeBuffer() {
+        return slots[back];
+    }
+
+    /**
+     * @brief Makes the write buffer the newest value. The next write buffer
+     * holds an older value and must be filled completely. Writer thread only.
+     */
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    /**
+     * @brief Moves the newest published value to the read buffer. Reader
+     * thread only.
+     *
+     * @return true if a value was published since the last update
+     */
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+    /**
+     * @brief Returns the value taken by the last update(). Reader thread only.
+     */
+    const T &readBuffer() const {
+        return slots[front];
+    }
+};
+
+#endif
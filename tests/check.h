@@ -0,0 +1,149 @@
+/**
+ * @file check.h
+ * @brief Helpers shared by the tests of make check. Each test is a program
+ * that prints its failures and exits with 1 if there were any.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+static unsigned int checkFailures = 0;
+
+/**
+ * @brief Counts a failure and prints it with its location, without stopping
+ * the test
+ */
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            checkFailures++; \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+        } \
+    } while (0)
+
+/**
+ * @brief Prints the result of a test to stderr, returns the exit status of
+ * main()
+ */
+static inline int checkResult(const char *name) {
+    if (checkFailures > 0) {
+        fprintf(stderr, "%s: %u failures\n", name, checkFailures);
+        return 1;
+    }
+    fprintf(stderr, "%s: ok\n", name);
+    return 0;
+}
+
+/**
+ * @brief Snapshot of a Chip8 instance, compared byte for byte
+ */
+struct CheckState {
+    unsigned char data[CHIP8_STATE_MAX_SIZE];
+    size_t size;
+
+    explicit CheckState(const Chip8 &chip8) {
+        size = chip8.saveState(data, sizeof(data));
+    }
+
+    bool operator==(const CheckState &other) const {
+        return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+
+    bool operator!=(const CheckState &other) const {
+        return !(*this == other);
+    }
+};
+
+/**
+ * @brief ROM run by a test
+ */
+struct TestRom {
+    std::string name;
+    std::vector<unsigned char> data;
+};
+
+/**
+ * @brief Reads a ROM file given on the command line, returns false if it
+ * cannot be opened
+ */
+static inline bool checkReadRom(const char *path, TestRom &rom) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    unsigned char buffer[ROM_END - ROM_START + 1];
+    size_t size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+    rom.name = path;
+    rom.data.assign(buffer, buffer + size);
+    return true;
+}
+
+/**
+ * @brief Runs an instance and returns the message of the exception it
+ * stopped on, empty if it ran all cycles
+ */
+static inline std::string checkRun(Chip8 &chip8, unsigned long long cycles) {
+    try {
+        chip8.runCycles(cycles);
+    } catch (const std::exception &e) {
+        return e.what();
+    }
+    return std::string();
+}
+
+/**
+ * @brief Temporary file, removed when the test is done with it
+ */
+class CheckFile {
+private:
+    char path[32];
+
+public:
+    CheckFile(const void *data, size_t size) {
+        strcpy(path, "/tmp/chip8-test-XXXXXX");
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot create a temporary file");
+        }
+        bool written = write(fd, data, size) == (ssize_t) size;
+        close(fd);
+        if (!written) {
+            unlink(path);
+            throw std::runtime_error("Cannot write a temporary file");
+        }
+    }
+
+    CheckFile(const std::string &contents) : CheckFile(contents.data(), contents.size()) {}
+
+    CheckFile(const std::vector<unsigned char> &contents) :
+        CheckFile(contents.data(), contents.size()) {}
+
+    ~CheckFile() {
+        unlink(path);
+    }
+
+    const char *getPath() const {
+        return path;
+    }
+};
+
+/**
+ * @brief Loads a ROM built into a test
+ */
+static inline void checkLoadRom(Chip8 &chip8, const std::vector<unsigned char> &data) {
+    chip8.loadRom(data.data(), data.size());
+}
+
+#endif
@@ -0,0 +1,185 @@
+/**
+ * @file test_audio.cpp
+ * @brief Tests of the buzzer audio: a ROM that beeps for a known time is
+ * rendered to a WAV file, which must hold the tone for exactly that time
+ * and silence around it. A real time sink asked for no samples returns at
+ * once.
+ */
+
+#include <algorithm>
+
+#include "check.h"
+#include "audio.h"
+
+// Counts to 8, then sets the sound timer to 30 ticks, half a second, with
+// its 26th instruction, in the second tick, and loops
+static const std::vector<unsigned char> beepRom = { 0x60, 0x1E, 0x61, 0x00, 0x71, 0x01,
+    0x31, 0x08, 0x12, 0x04, 0xF0, 0x18, 0x12, 0x0C };
+#define BEEP_TICKS 30
+#define BEEP_CYCLE 26
+#define BEEP_START (BEEP_CYCLE * AUDIO_SAMPLES_PER_TICK / CYCLES_PER_FRAME)
+#define BEEP_END ((1 + BEEP_TICKS) * AUDIO_SAMPLES_PER_TICK)
+
+// A buzzer change lands on the sample of the instruction before or after it
+#define EDGE_SAMPLES (AUDIO_SAMPLES_PER_TICK / CYCLES_PER_FRAME + 1)
+
+/**
+ * @brief Samples of a WAV file written by WavSink
+ */
+static bool readWav(const char *path, std::vector<int16_t> &samples) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    unsigned char header[44];
+    bool valid = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+        memcmp(header, "RIFF", 4) == 0 && memcmp(header + 36, "data", 4) == 0;
+    unsigned int dataSize = header[40] | header[41] << 8 | header[42] << 16 |
+        (unsigned int) header[43] << 24;
+
+    samples.clear();
+    unsigned char bytes[2];
+    while (valid && fread(bytes, 1, 2, file) == 2) {
+        samples.push_back((int16_t) (bytes[0] | bytes[1] << 8));
+    }
+    fclose(file);
+    return valid && dataSize == samples.size() * 2;
+}
+
+/**
+ * @brief Checks that samples first to last - 1 are a square wave of the
+ * buzzer tone and every other sample is silent
+ */
+static void checkTone(const std::vector<int16_t> &samples, size_t first, size_t last,
+        const char *name) {
+    size_t loud = 0;
+    size_t loudFirst = samples.size();
+    size_t loudLast = 0;
+    size_t flips = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        int16_t sample = samples[i];
+        CHECK(sample == 0 || sample == AUDIO_AMPLITUDE || sample == -AUDIO_AMPLITUDE,
+            "%s: sample %zu is %d", name, i, sample);
+        if (sample != 0) {
+            loud++;
+            loudFirst = std::min(loudFirst, i);
+            loudLast = i + 1;
+            if (i > 0 && samples[i - 1] == -sample) {
+                flips++;
+            }
+        }
+    }
+
+    CHECK(loudFirst + EDGE_SAMPLES >= first && loudFirst <= first + EDGE_SAMPLES &&
+        loudLast + EDGE_SAMPLES >= last && loudLast <= last + EDGE_SAMPLES,
+        "%s: tone from sample %zu to %zu, expected %zu to %zu", name, loudFirst, loudLast,
+        first, last);
+    CHECK(loud == loudLast - loudFirst, "%s: tone has gaps", name);
+
+    // Two flips per period of the tone
+    size_t expected = (last - first) * 2 * AUDIO_TONE_HZ / AUDIO_SAMPLE_RATE;
+    CHECK(flips + 2 >= expected && flips <= expected + 2, "%s: %zu flips, expected %zu", name,
+        flips, expected);
+}
+
+/**
+ * @brief Renders frames after running the system for each, as the front
+ * end does
+ */
+static void renderFrames(Chip8 &chip8, Chip8Audio &audio, int frames) {
+    for (int i = 0; i < frames; i++) {
+        chip8.runCycles(CYCLES_PER_FRAME);
+        audio.renderFrame(chip8);
+    }
+}
+
+/**
+ * @brief Real time sink pulled by the test, as a device pulls its sink
+ */
+class PullSink : public AudioSink {
+public:
+    size_t pull(int16_t *out, size_t count) {
+        return read(out, count, 0, true);
+    }
+};
+
+/**
+ * @brief A device asking for no samples gets none, also with more samples
+ * queued than a real time sink lets through
+ */
+static void testEmptyRead() {
+    AudioRing ring;
+    PullSink sink;
+    sink.start(&ring);
+    for (unsigned int i = 0; i <= AUDIO_MAX_QUEUED; i++) {
+        ring.samples.push(AUDIO_AMPLITUDE);
+    }
+
+    int16_t sample = 0;
+    CHECK(sink.pull(&sample, 0) == 0 && sample == 0, "empty read took samples");
+    CHECK(ring.samples.size() == AUDIO_MAX_QUEUED + 1, "empty read left %zu samples queued",
+        ring.samples.size());
+    CHECK(sink.pull(&sample, 1) == 1 && sample == AUDIO_AMPLITUDE, "read after it failed");
+
+    AudioStats stats = {};
+    sink.addStats(stats);
+    CHECK(stats.skipped == 1 && stats.underruns == 0, "skipped %llu, underruns %llu",
+        stats.skipped, stats.underruns);
+}
+
+static void testBeep() {
+    Chip8 chip8;
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    checkLoadRom(chip8, beepRom);
+
+    CheckFile file("");
+    WavSink sink(file.getPath());
+    Chip8Audio audio(chip8, &sink);
+    renderFrames(chip8, audio, 2 * BEEP_TICKS);
+    audio.stop();
+
+    std::vector<int16_t> samples;
+    CHECK(readWav(file.getPath(), samples), "beep: invalid WAV file");
+    CHECK(samples.size() == 2 * BEEP_TICKS * AUDIO_SAMPLES_PER_TICK,
+        "beep: %zu samples, expected %d", samples.size(),
+        2 * BEEP_TICKS * AUDIO_SAMPLES_PER_TICK);
+    checkTone(samples, BEEP_START, BEEP_END, "beep");
+
+    AudioStats stats = audio.getStats();
+    CHECK(stats.rendered == samples.size() && stats.dropped == 0 && stats.skipped == 0 &&
+        stats.underruns == 0, "beep: rendered %llu, dropped %llu, skipped %llu, underruns %llu",
+        stats.rendered, stats.dropped, stats.skipped, stats.underruns);
+    CHECK(stats.starts == 1, "beep: %llu buzzer starts, expected 1", stats.starts);
+}
+
+/**
+ * @brief Frames run between reset() calls are not rendered, the tone picks
+ * up where the system is
+ */
+static void testReset() {
+    Chip8 chip8;
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    checkLoadRom(chip8, beepRom);
+
+    CheckFile file("");
+    WavSink sink(file.getPath());
+    Chip8Audio audio(chip8, &sink);
+    renderFrames(chip8, audio, BEEP_TICKS / 3);
+    chip8.runCycles(BEEP_TICKS / 3 * CYCLES_PER_FRAME);
+    audio.reset(chip8);
+    renderFrames(chip8, audio, BEEP_TICKS);
+    audio.stop();
+
+    std::vector<int16_t> samples;
+    CHECK(readWav(file.getPath(), samples), "reset: invalid WAV file");
+    CHECK(samples.size() == (BEEP_TICKS / 3 + BEEP_TICKS) * AUDIO_SAMPLES_PER_TICK,
+        "reset: %zu samples", samples.size());
+    checkTone(samples, BEEP_START, BEEP_END - BEEP_TICKS / 3 * AUDIO_SAMPLES_PER_TICK, "reset");
+}
+
+int main() {
+    testEmptyRead();
+    testBeep();
+    testReset();
+    return checkResult("test_audio");
+}
@@ -0,0 +1,205 @@
+/**
+ * @file test_batch.cpp
+ * @brief Tests of the batch runner: the thread pool runs every task once,
+ * manifests and input scripts parse, and jobs give the same results whatever
+ * the number of threads, sharing one ROM library.
+ */
+
+#include <atomic>
+
+#include "check.h"
+#include "batch.h"
+#include "thread_pool.h"
+
+#define POOL_TASKS 10000
+#define JOB_CYCLES 200000
+
+/**
+ * @brief Every task runs exactly once, including tasks submitted while the
+ * workers are busy and tasks submitted from other tasks
+ */
+static void testThreadPool(unsigned int threads) {
+    std::vector<std::atomic<int>> runs(POOL_TASKS * 2);
+    {
+        ThreadPool pool(threads);
+        CHECK(pool.size() == threads, "pool has %u threads, expected %u", pool.size(),
+            threads);
+
+        for (int i = 0; i < POOL_TASKS; i++) {
+            pool.submit([&runs, &pool, i] {
+                runs[i]++;
+                if (i % 2 == 0) {
+                    pool.submit([&runs, i] { runs[POOL_TASKS + i]++; });
+                }
+            });
+        }
+        pool.wait();
+
+        int missing = 0;
+        for (int i = 0; i < POOL_TASKS * 2; i++) {
+            bool expected = i < POOL_TASKS || (i - POOL_TASKS) % 2 == 0;
+            missing += runs[i] != (expected ? 1 : 0);
+        }
+        CHECK(missing == 0, "%u threads: %d tasks did not run exactly once", threads,
+            missing);
+
+        // The destructor waits for tasks still queued
+        for (int i = 0; i < POOL_TASKS; i++) {
+            pool.submit([&runs, i] { runs[i]++; });
+        }
+    }
+
+    int missing = 0;
+    for (int i = 0; i < POOL_TASKS; i++) {
+        missing += runs[i] != 2;
+    }
+    CHECK(missing == 0, "%u threads: %d tasks lost when the pool stopped", threads, missing);
+}
+
+static void testManifest() {
+    CheckFile manifest(
+        "# rom seed cycles [input [quirks]]\n"
+        "\n"
+        "a.rom 1 1000\n"
+        "   \t\n"
+        "  b.rom 42 5000000000 keys.txt\n"
+        "\t# indented comment\n"
+        "c.rom 3 2000 - cosmac\n"
+        "d.rom 4 3000 keys.txt clip,jump_vx\n");
+    std::vector<BatchJob> jobs = loadManifest(manifest.getPath(), CHIP8_QUIRK_VF_RESET);
+
+    CHECK(jobs.size() == 4, "manifest has %zu jobs, expected 4", jobs.size());
+    if (jobs.size() == 4) {
+        CHECK(jobs[0].rom == "a.rom" && jobs[0].seed == 1 && jobs[0].cycles == 1000 &&
+            jobs[0].input.empty() && jobs[0].quirks == CHIP8_QUIRK_VF_RESET,
+            "first job parsed wrong");
+        CHECK(jobs[1].rom == "b.rom" && jobs[1].seed == 42 &&
+            jobs[1].cycles == 5000000000ULL && jobs[1].input == "keys.txt" &&
+            jobs[1].quirks == CHIP8_QUIRK_VF_RESET, "second job parsed wrong");
+
+        unsigned int cosmac;
+        chip8ParseQuirks("cosmac", &cosmac);
+        CHECK(jobs[2].rom == "c.rom" && jobs[2].input.empty() && jobs[2].quirks == cosmac,
+            "job with quirks and no input parsed wrong");
+        CHECK(jobs[3].input == "keys.txt" &&
+            jobs[3].quirks == (CHIP8_QUIRK_CLIP | CHIP8_QUIRK_JUMP_VX),
+            "job with input and quirks parsed wrong");
+    }
+
+    CheckFile missingCycles("a.rom 1\n");
+    bool threw = false;
+    try {
+        loadManifest(missingCycles.getPath());
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "manifest line without cycles was accepted");
+
+    CheckFile unknownQuirk("a.rom 1 1000 - wrap\n");
+    threw = false;
+    try {
+        loadManifest(unknownQuirk.getPath());
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "manifest line with an unknown quirk was accepted");
+
+    threw = false;
+    try {
+        loadManifest("/nonexistent/manifest");
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "missing manifest was accepted");
+}
+
+static void testInputScript() {
+    CheckFile script(
+        "# cycle key pressed\n"
+        "300 a 1\n"
+        "100 F 1\n"
+        "300 a 0\n"
+        "200 0 0\n");
+    std::vector<KeyEvent> events = loadInputScript(script.getPath());
+
+    // Sorted by cycle, events of the same cycle keep their order
+    const KeyEvent expected[] = {
+        { 100, 0xF, true }, { 200, 0x0, false }, { 300, 0xA, true }, { 300, 0xA, false }
+    };
+    CHECK(events.size() == 4, "input script has %zu events, expected 4", events.size());
+    for (size_t i = 0; i < events.size() && i < 4; i++) {
+        CHECK(events[i].cycle == expected[i].cycle && events[i].key == expected[i].key &&
+            events[i].pressed == expected[i].pressed, "event %zu parsed wrong", i);
+    }
+
+    CheckFile badKey("100 10 1\n");
+    bool threw = false;
+    try {
+        loadInputScript(badKey.getPath());
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "input script with key 0x10 was accepted");
+}
+
+/**
+ * @brief Runs one job per ROM and seed on one thread, then all of them at
+ * once on a pool, and compares the results
+ */
+static void testJobs(int count, char **roms) {
+    CheckFile script("1000 5 1\n20000 5 0\n40000 4 1\n60000 4 0\n");
+
+    std::vector<BatchJob> jobs;
+    for (int i = 0; i < count; i++) {
+        for (unsigned int seed = 1; seed <= 2; seed++) {
+            jobs.push_back({ roms[i], seed, JOB_CYCLES, seed == 2 ? script.getPath() : "" });
+        }
+    }
+    jobs.push_back({ "/nonexistent/rom", 1, JOB_CYCLES, "" });
+
+    std::vector<BatchResult> serial(jobs.size());
+    {
+        RomLibrary library;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            runBatchJob(jobs[i], library, CHIP8_CORE_INTERPRETER, CYCLES_PER_FRAME, serial[i]);
+        }
+    }
+
+    // The workers share one library
+    std::vector<BatchResult> parallel(jobs.size());
+    RomLibrary library;
+    {
+        ThreadPool pool(4);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&jobs, &library, &parallel, i] {
+                runBatchJob(jobs[i], library, CHIP8_CORE_INTERPRETER, CYCLES_PER_FRAME,
+                    parallel[i]);
+            });
+        }
+    }
+    CHECK(library.size() == (size_t) count, "%zu ROMs mapped for %d files", library.size(),
+        count);
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const char *rom = jobs[i].rom.c_str();
+        CHECK(serial[i].error == parallel[i].error && serial[i].cycles == parallel[i].cycles &&
+            serial[i].gfxHash == parallel[i].gfxHash,
+            "%s seed %u: differs when run on the pool", rom, jobs[i].seed);
+        CHECK(!serial[i].error.empty() || serial[i].cycles == JOB_CYCLES,
+            "%s seed %u: ran %llu cycles without an error", rom, jobs[i].seed,
+            serial[i].cycles);
+    }
+    CHECK(!serial.back().error.empty(), "job with a missing ROM reported no error");
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    testThreadPool(1);
+    testThreadPool(4);
+    testManifest();
+    testInputScript();
+    testJobs(argc - 1, argv + 1);
+    return checkResult("test_batch");
+}
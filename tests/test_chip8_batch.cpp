@@ -0,0 +1,137 @@
+/**
+ * @file test_chip8_batch.cpp
+ * @brief Differential test of the lockstep engine. Runs every ROM given on
+ * the command line and a few synthetic ROMs on a batch of lanes with their
+ * own seeds and key presses, then each lane again on a Chip8, and compares
+ * them after every chunk of cycles. The batch loads each ROM from memory,
+ * the instances from a file.
+ */
+
+#include <random>
+
+#include "check.h"
+#include "chip8_batch.h"
+
+#define LANES 8
+#define CHUNKS 100
+#define CHUNK_MAX_CYCLES 5000
+
+// Lanes that leave the shared program: CXNN and held keys pick the branch,
+// the lanes that draw 1 rewrite the instruction at 0x21E for good, and the
+// other ROM runs its lanes into the stack at different times
+static const TestRom syntheticRoms[] = {
+    { "diverging", { 0xC1, 0x0F, 0xE1, 0x9E, 0x12, 0x0A, 0x72, 0x01, 0x12, 0x0C,
+        0x73, 0x01, 0xA2, 0x30, 0xF3, 0x33, 0xD1, 0x23, 0xC4, 0x01, 0x60, 0x72,
+        0xA2, 0x1E, 0x34, 0x01, 0x12, 0x1E, 0xF0, 0x55, 0x73, 0x01, 0x12, 0x00 } },
+    { "stack overflow", { 0xC0, 0x07, 0x30, 0x00, 0x12, 0x00, 0x22, 0x06 } }
+};
+
+/**
+ * @brief Key that changes before a chunk
+ */
+struct KeyChange {
+    int key;
+    bool pressed;
+};
+
+/**
+ * @brief State of one lane or instance after a chunk
+ */
+struct LaneResult {
+    std::string error;
+    unsigned long long cycles;
+    unsigned long long gfx;
+};
+
+static std::vector<unsigned long long> randomChunks(std::mt19937 &random) {
+    std::vector<unsigned long long> chunks;
+    for (int i = 0; i < CHUNKS; i++) {
+        chunks.push_back(1 + random() % CHUNK_MAX_CYCLES);
+    }
+    return chunks;
+}
+
+static std::vector<KeyChange> randomKeys(unsigned int lane) {
+    std::mt19937 random(lane);
+    std::vector<KeyChange> keys;
+    for (int i = 0; i < CHUNKS; i++) {
+        keys.push_back({ (int) (random() % KEYS), random() % 2 == 0 });
+    }
+    return keys;
+}
+
+// Errors of a Chip8 end with a newline, those of a lane do not
+static std::string trimError(std::string error) {
+    error.erase(error.find_last_not_of("\n") + 1);
+    return error;
+}
+
+static void compareLanes(const TestRom &rom, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::vector<unsigned long long> chunks = randomChunks(random);
+    std::vector<std::vector<KeyChange>> keys;
+    for (unsigned int lane = 0; lane < LANES; lane++) {
+        keys.push_back(randomKeys(seed * LANES + lane));
+    }
+
+    CheckFile file(rom.data);
+    Chip8Batch batch(LANES);
+    batch.loadRom(rom.data.data(), rom.data.size());
+    for (unsigned int lane = 0; lane < LANES; lane++) {
+        batch.setSeed(lane, lane + 1);
+    }
+
+    // results[lane][chunk]
+    std::vector<std::vector<LaneResult>> results(LANES);
+    for (int chunk = 0; chunk < CHUNKS; chunk++) {
+        for (unsigned int lane = 0; lane < LANES; lane++) {
+            batch.setKey(lane, keys[lane][chunk].key, keys[lane][chunk].pressed);
+        }
+        batch.runCycles(chunks[chunk]);
+        for (unsigned int lane = 0; lane < LANES; lane++) {
+            results[lane].push_back({ batch.getError(lane), batch.getCycles(lane),
+                batch.hashGfx(lane) });
+        }
+    }
+
+    for (unsigned int lane = 0; lane < LANES; lane++) {
+        Chip8 chip8;
+        chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+        chip8.setSeed(lane + 1);
+        chip8.loadRom(file.getPath());
+
+        std::string error;
+        for (int chunk = 0; chunk < CHUNKS; chunk++) {
+            chip8.key[keys[lane][chunk].key] = keys[lane][chunk].pressed;
+            if (error.empty()) {
+                error = trimError(checkRun(chip8, chunks[chunk]));
+            }
+
+            const LaneResult &result = results[lane][chunk];
+            if (result.error != error || result.cycles != chip8.getCycles() ||
+                    result.gfx != chip8.hashGfx()) {
+                CHECK(false, "%s lane %u: differs after chunk %d, errors '%s' and '%s'",
+                    rom.name.c_str(), lane, chunk, error.c_str(), result.error.c_str());
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    for (int i = 1; i < argc; i++) {
+        TestRom rom;
+        if (!checkReadRom(argv[i], rom)) {
+            CHECK(false, "Cannot read %s", argv[i]);
+            continue;
+        }
+        compareLanes(rom, i);
+    }
+    for (const TestRom &rom : syntheticRoms) {
+        compareLanes(rom, 1);
+    }
+    return checkResult("test_chip8_batch");
+}
@@ -0,0 +1,351 @@
+/**
+ * @file test_cores.cpp
+ * @brief Differential test of the execution engines. Runs every ROM given on
+ * the command line, a few synthetic ROMs and random programs, in CHIP-8 and
+ * SUPER-CHIP mode with several quirk profiles, on the interpreter and on each
+ * other engine side by side, with the same key presses, and compares the
+ * full saved state after every chunk of cycles. The ROMs in roms/ are linked
+ * in translated ahead of time, with no quirks, for the AOT engine. Short ROMs
+ * then check that every engine fast-forwards waits and what each quirk does
+ * on it.
+ */
+
+#include <chrono>
+#include <random>
+
+#include "check.h"
+
+#define CHUNKS 200
+#define CHUNK_MAX_CYCLES 5000
+#define RANDOM_PROGRAMS 64
+#define RANDOM_PROGRAM_WORDS 256
+#define SCHIP_FAMILIES 8
+#define IDLE_CYCLES 1000000000ULL
+#define IDLE_MAX_SECONDS 1.0
+
+// Sequences the threaded core ran as one handler, over every run
+static unsigned long long fusions[CHIP8_FUSIONS];
+
+// Offsets of the registers in a save state, see Chip8::saveState()
+#define STATE_PC 7
+#define STATE_I 11
+#define STATE_V 14
+
+/**
+ * @brief Mode and quirks a ROM is run in
+ */
+struct TestConfig {
+    const char *name;
+    Chip8Mode mode;
+    const char *quirks;  // As given to chip8ParseQuirks()
+};
+
+static const TestConfig configs[] = {
+    { "chip8", CHIP8_MODE_CHIP8, "none" },
+    { "cosmac", CHIP8_MODE_CHIP8, "cosmac" },
+    { "schip", CHIP8_MODE_SCHIP, "schip" }
+};
+
+/**
+ * @brief ROM whose result after a few cycles depends on one quirk
+ */
+struct QuirkRom {
+    const char *quirk;
+    std::vector<unsigned char> data;
+    unsigned long long cycles;
+    int offset;  // Of the result in the save state
+    unsigned int without;
+    unsigned int with;
+};
+
+static const QuirkRom quirkRoms[] = {
+    // V0 = 3, V1 = 5, 8016
+    { "shift_vy", { 0x60, 0x03, 0x61, 0x05, 0x80, 0x16 }, 3, STATE_V, 1, 2 },
+    // I = 0x300, F255
+    { "memory_i", { 0xA3, 0x00, 0xF2, 0x55 }, 2, STATE_I, 0x300, 0x303 },
+    // V0 = 2, V2 = 4, B210
+    { "jump_vx", { 0x60, 0x02, 0x62, 0x04, 0xB2, 0x10 }, 3, STATE_PC, 0x212, 0x214 },
+    // The 0 of the font at x 62, where it wraps onto x 0 and 1, then at x 0
+    { "clip", { 0x60, 0x3E, 0x61, 0x00, 0xA0, 0x00, 0xD0, 0x15, 0x62, 0x00, 0xD2, 0x15 },
+        6, STATE_V + 0xF, 1, 0 },
+    // VF = 5, 8011
+    { "vf_reset", { 0x6F, 0x05, 0x80, 0x11 }, 2, STATE_V + 0xF, 5, 0 }
+};
+
+// Corner cases of the engines: code that rewrites itself, including the
+// middle of a fused sequence and code at odd addresses, the stack running
+// over and under, halting, and the waiting loops the virtual clock
+// fast-forwards
+static const TestRom syntheticRoms[] = {
+    { "self-modifying", { 0x60, 0x70, 0x61, 0x02, 0x75, 0x01, 0x76, 0x01, 0x36, 0x05,
+        0x12, 0x04, 0xA2, 0x06, 0xF1, 0x55, 0x66, 0x00, 0x12, 0x04 } },
+    { "rewrites fused", { 0x60, 0x05, 0x61, 0x07, 0x72, 0x01, 0xA2, 0x03, 0x80, 0x20,
+        0xF0, 0x55, 0x63, 0x00, 0x73, 0x01, 0x33, 0x10, 0x12, 0x0E, 0x32, 0x05, 0x12, 0x00,
+        0x12, 0x02 } },
+    { "odd rewrites", { 0x12, 0x03, 0x00, 0x60, 0x05, 0x61, 0x07, 0x72, 0x01, 0xA2, 0x06,
+        0x80, 0x20, 0xF0, 0x55, 0x32, 0x05, 0x12, 0x03, 0x12, 0x13 } },
+    { "stack overflow", { 0x70, 0x01, 0x22, 0x00 } },
+    { "stack underflow", { 0x70, 0x01, 0x00, 0xEE } },
+    { "halt", { 0x00, 0xFF, 0x60, 0x05, 0xF0, 0x18, 0x61, 0x03, 0xA0, 0x00, 0xD1, 0x15,
+        0x00, 0xFD } },
+    { "delay wait", { 0x60, 0x10, 0xF0, 0x15, 0xF0, 0x07, 0x30, 0x00, 0x12, 0x04, 0x71, 0x01,
+        0xF1, 0x18, 0x12, 0x00 } },
+    { "key wait", { 0xF0, 0x0A, 0x70, 0x01, 0xA3, 0x00, 0xF0, 0x33, 0x12, 0x00 } }
+};
+
+// Opcode families of the random programs: a template and the operand bits
+// that are random. Jumps, calls and I stay inside the program so it runs for
+// a while and writes over its own code.
+struct OpcodeFamily {
+    unsigned short base;
+    unsigned short mask;
+    bool address;  // Operand is an address within the program
+};
+
+static const OpcodeFamily families[] = {
+    { 0x00E0, 0x0000, false }, { 0x00EE, 0x0000, false }, { 0x1000, 0x0000, true },
+    { 0x2000, 0x0000, true }, { 0x3000, 0x0FFF, false }, { 0x4000, 0x0FFF, false },
+    { 0x5000, 0x0FF0, false }, { 0x6000, 0x0FFF, false }, { 0x7000, 0x0FFF, false },
+    { 0x8000, 0x0FF0, false }, { 0x8001, 0x0FF0, false }, { 0x8002, 0x0FF0, false },
+    { 0x8003, 0x0FF0, false }, { 0x8004, 0x0FF0, false }, { 0x8005, 0x0FF0, false },
+    { 0x8006, 0x0FF0, false }, { 0x8007, 0x0FF0, false }, { 0x800E, 0x0FF0, false },
+    { 0x9000, 0x0FF0, false }, { 0xA000, 0x0000, true }, { 0xB000, 0x0000, true },
+    { 0xC000, 0x0FFF, false }, { 0xD000, 0x0FFF, false }, { 0xE09E, 0x0F00, false },
+    { 0xE0A1, 0x0F00, false }, { 0xF007, 0x0F00, false }, { 0xF00A, 0x0F00, false },
+    { 0xF015, 0x0F00, false }, { 0xF018, 0x0F00, false }, { 0xF01E, 0x0F00, false },
+    { 0xF029, 0x0F00, false }, { 0xF033, 0x0F00, false }, { 0xF055, 0x0F00, false },
+    { 0xF065, 0x0F00, false },
+    // SUPER-CHIP, only in programs for CHIP8_MODE_SCHIP
+    { 0x00C0, 0x000F, false }, { 0x00FB, 0x0000, false }, { 0x00FC, 0x0000, false },
+    { 0x00FE, 0x0000, false }, { 0x00FF, 0x0000, false }, { 0xF030, 0x0F00, false },
+    { 0xF075, 0x0700, false }, { 0xF085, 0x0700, false }
+};
+
+/**
+ * @brief Engines compared with the interpreter. The interpreter itself is
+ * compared with a copy that runs one instruction per call, which never
+ * fast-forwards a wait.
+ */
+static const struct {
+    Chip8Core core;
+    const char *name;
+} cores[] = {
+    { CHIP8_CORE_INTERPRETER, "interpreter" },
+    { CHIP8_CORE_THREADED, "threaded" },
+    { CHIP8_CORE_JIT, "jit" },
+    { CHIP8_CORE_AOT, "aot" }
+};
+
+#define CORES (sizeof(cores) / sizeof(cores[0]))
+
+static TestRom randomProgram(unsigned int seed, Chip8Mode mode) {
+    TestRom rom;
+    rom.name = "random program " + std::to_string(seed);
+    std::mt19937 random(seed);
+    size_t count = sizeof(families) / sizeof(families[0]);
+    if (mode != CHIP8_MODE_SCHIP) {
+        count -= SCHIP_FAMILIES;
+    }
+    for (int i = 0; i < RANDOM_PROGRAM_WORDS; i++) {
+        const OpcodeFamily &family = families[random() % count];
+        unsigned short opcode = family.base | (random() & family.mask);
+        if (family.address) {
+            opcode |= ROM_START + (random() % (RANDOM_PROGRAM_WORDS * 2));
+            if (family.base == 0x1000 || family.base == 0x2000 || family.base == 0xB000) {
+                opcode &= ~1;
+            }
+        }
+        rom.data.push_back(opcode >> 8);
+        rom.data.push_back(opcode & 0xFF);
+    }
+    return rom;
+}
+
+static void setUp(Chip8 &chip8, const TestConfig &config, const TestRom &rom) {
+    unsigned int quirks = 0;
+    chip8ParseQuirks(config.quirks, &quirks);
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setMode(config.mode);
+    chip8.setQuirks(quirks);
+    chip8.setSeed(7);
+    checkLoadRom(chip8, rom.data);
+}
+
+/**
+ * @brief Runs an instance one instruction per call and returns the message
+ * of the exception it stopped on, empty if it ran all cycles
+ */
+static std::string stepCycles(Chip8 &chip8, unsigned long long cycles) {
+    for (unsigned long long i = 0; i < cycles; i++) {
+        std::string error = checkRun(chip8, 1);
+        if (!error.empty()) {
+            return error;
+        }
+    }
+    return std::string();
+}
+
+/**
+ * @brief Runs a ROM on the interpreter and on an engine with the same keys,
+ * comparing states and errors after each chunk. Returns false if the engine
+ * is not available on this host.
+ */
+static bool compareCore(const TestRom &rom, const TestConfig &config, Chip8Core core,
+        const char *coreName, unsigned int seed) {
+    bool stepped = core == CHIP8_CORE_INTERPRETER;
+    Chip8 reference, tested;
+    setUp(reference, config, rom);
+    setUp(tested, config, rom);
+    try {
+        tested.setCore(core);
+    } catch (const std::exception &) {
+        return false;
+    }
+
+    std::mt19937 random(seed);
+    for (int chunk = 0; chunk < CHUNKS; chunk++) {
+        unsigned long long cycles = 1 + random() % CHUNK_MAX_CYCLES;
+        int key = random() % KEYS;
+        bool pressed = random() % 3 == 0;
+        reference.key[key] = pressed;
+        tested.key[key] = pressed;
+
+        std::string referenceError = stepped ? stepCycles(reference, cycles) :
+            checkRun(reference, cycles);
+        std::string testedError = checkRun(tested, cycles);
+        if (referenceError != testedError || CheckState(reference) != CheckState(tested)) {
+            CHECK(false, "%s (%s) on %s: differs after chunk %d, cycle %llu, "
+                "errors '%s' and '%s'", rom.name.c_str(), config.name, coreName, chunk,
+                reference.getCycles(), referenceError.c_str(), testedError.c_str());
+            break;
+        }
+        if (!referenceError.empty()) {
+            break;
+        }
+    }
+
+    if (core == CHIP8_CORE_THREADED) {
+        for (int i = 0; i < CHIP8_FUSIONS; i++) {
+            fusions[i] += tested.getFusions()[i];
+        }
+    }
+    return true;
+}
+
+static void compareCores(const TestRom &rom, const TestConfig &config, unsigned int seed,
+        bool *ran) {
+    for (size_t i = 0; i < CORES; i++) {
+        ran[i] |= compareCore(rom, config, cores[i].core, cores[i].name, seed);
+    }
+}
+
+/**
+ * @brief Waits reached after some instructions ran, which an engine must
+ * fast-forward wherever they are and not only where a run starts. Run one
+ * instruction at a time, they would take many seconds.
+ */
+static void testIdle(Chip8Core core, const char *coreName) {
+    static const struct {
+        TestRom rom;
+        Chip8Mode mode;
+    } waits[] = {
+        { { "key wait after code", { 0x60, 0x01, 0x70, 0x01, 0xF0, 0x0A } }, CHIP8_MODE_CHIP8 },
+        { { "00FD after code", { 0x60, 0x01, 0x70, 0x01, 0x00, 0xFD } }, CHIP8_MODE_SCHIP }
+    };
+
+    for (const auto &wait : waits) {
+        Chip8 chip8;
+        chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+        chip8.setMode(wait.mode);
+        chip8.setCore(core);
+        checkLoadRom(chip8, wait.rom.data);
+
+        auto start = std::chrono::steady_clock::now();
+        std::string error = checkRun(chip8, IDLE_CYCLES);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        CHECK(error.empty() && chip8.getCycles() == IDLE_CYCLES,
+            "%s on %s: ran %llu cycles, error '%s'", wait.rom.name.c_str(), coreName,
+            chip8.getCycles(), error.c_str());
+        CHECK(elapsed.count() < IDLE_MAX_SECONDS, "%s on %s: not fast-forwarded, took %.1fs",
+            wait.rom.name.c_str(), coreName, elapsed.count());
+    }
+}
+
+/**
+ * @brief Runs each quirk ROM with and without its quirk on an engine and
+ * checks the result
+ */
+static void testQuirks(Chip8Core core, const char *coreName) {
+    for (const QuirkRom &rom : quirkRoms) {
+        unsigned int quirk = 0;
+        CHECK(chip8ParseQuirks(rom.quirk, &quirk), "quirk %s not parsed", rom.quirk);
+        for (int enabled = 0; enabled < 2; enabled++) {
+            Chip8 chip8;
+            chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+            chip8.setCore(core);
+            chip8.setQuirks(enabled ? quirk : 0);
+            checkLoadRom(chip8, rom.data);
+            checkRun(chip8, rom.cycles);
+
+            CheckState state(chip8);
+            unsigned int result = state.data[rom.offset];
+            if (rom.offset == STATE_PC || rom.offset == STATE_I) {
+                result |= state.data[rom.offset + 1] << 8;
+            }
+            unsigned int expected = enabled ? rom.with : rom.without;
+            CHECK(result == expected, "%s %s on %s: result %#x, expected %#x", rom.quirk,
+                enabled ? "on" : "off", coreName, result, expected);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on, which most random programs do
+    freopen("/dev/null", "w", stdout);
+
+    bool ran[CORES] = {};
+    for (const TestConfig &config : configs) {
+        for (int i = 1; i < argc; i++) {
+            TestRom rom;
+            if (!checkReadRom(argv[i], rom)) {
+                CHECK(false, "Cannot read %s", argv[i]);
+                continue;
+            }
+            compareCores(rom, config, i, ran);
+        }
+        for (const TestRom &rom : syntheticRoms) {
+            compareCores(rom, config, 1, ran);
+        }
+        for (unsigned int seed = 1; seed <= RANDOM_PROGRAMS; seed++) {
+            compareCores(randomProgram(seed, config.mode), config, seed, ran);
+        }
+    }
+
+    for (size_t i = 0; i < CORES; i++) {
+        if (ran[i]) {
+            testIdle(cores[i].core, cores[i].name);
+            testQuirks(cores[i].core, cores[i].name);
+        }
+    }
+
+#ifndef CHIP8_NO_FUSION
+    // Each sequence is common enough to show up somewhere
+    for (int i = 0; i < CHIP8_FUSIONS; i++) {
+        CHECK(fusions[i] > 0, "%s never fused", CHIP8_FUSION_NAMES[i]);
+    }
+#endif
+
+    unsigned int quirks = 0;
+    CHECK(!chip8ParseQuirks("clip,bogus", &quirks), "unknown quirk parsed");
+    CHECK(chip8ParseQuirks("schip,shift_vy", &quirks) &&
+        quirks == (CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP | CHIP8_QUIRK_SHIFT_VY),
+        "profile and quirk parsed as %#x", quirks);
+
+    for (size_t i = 0; i < CORES; i++) {
+        if (!ran[i]) {
+            fprintf(stderr, "test_cores: %s is not available on this host, skipped\n",
+                cores[i].name);
+        }
+    }
+    return checkResult("test_cores");
+}
@@ -0,0 +1,185 @@
+/**
+ * @file test_fork.cpp
+ * @brief Tests of Chip8::fork(). Parents and children that write memory with
+ * FX33 and FX55 and draw with DXYN must not see each other's writes, and a
+ * child must end in the same state as a fresh instance loaded with the
+ * parent's state, in both modes and also when forks run on several threads
+ * at once.
+ */
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+#define STRESS_FORKS 16
+#define STRESS_WARMUP 20000
+#define STRESS_CYCLES 30000
+
+// Writes the page it runs in and another one on every iteration. Key 5
+// selects what is written:
+//   200: 6000  V0 = 0
+//   202: 6100  V1 = 0
+//   204: 7001  V0 += 1
+//   206: 6205  V2 = 5
+//   208: E29E  skip if key 5 pressed
+//   20A: 7101  V1 += 1
+//   20C: A300  I = 0x300
+//   20E: F033  BCD of V0 at 0x300
+//   210: A310  I = 0x310
+//   212: F155  V0 and V1 at 0x310
+//   214: A300  I = 0x300
+//   216: 6308  V3 = 8
+//   218: 6408  V4 = 8
+//   21A: D343  draw the BCD digits at (8, 8)
+//   21C: A221  I = 0x221
+//   21E: F055  V0 into the operand of the next instruction
+//   220: 6F00  VF = operand
+//   222: 1204  loop
+static const unsigned char writerRom[] = {
+    0x60, 0x00, 0x61, 0x00, 0x70, 0x01, 0x62, 0x05, 0xE2, 0x9E, 0x71, 0x01,
+    0xA3, 0x00, 0xF0, 0x33, 0xA3, 0x10, 0xF1, 0x55, 0xA3, 0x00, 0x63, 0x08,
+    0x64, 0x08, 0xD3, 0x43, 0xA2, 0x21, 0xF0, 0x55, 0x6F, 0x00, 0x12, 0x04
+};
+
+#define WRITER_KEY 5
+
+static void setUp(Chip8 &chip8, Chip8Core core, Chip8Mode mode) {
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setMode(mode);
+    chip8.setSeed(3);
+    chip8.setCore(core);
+}
+
+/**
+ * @brief Runs a parent and its child with different keys and checks that
+ * neither changes the other, and that both end like fresh instances loaded
+ * with the state they forked from. The display written is the one of the
+ * mode.
+ */
+static void testIsolation(Chip8Core core, Chip8Mode mode, const char *coreName) {
+    Chip8 parent;
+    setUp(parent, core, mode);
+    parent.loadRom(writerRom, sizeof(writerRom));
+    parent.runCycles(1000);
+    CheckState forked(parent);
+
+    std::unique_ptr<Chip8> child = parent.fork();
+    CHECK(CheckState(*child) == forked, "%s: child differs from its parent", coreName);
+
+    // The child writes first: memory and display shared with the parent
+    child->key[WRITER_KEY] = true;
+    child->runCycles(1000);
+    CHECK(CheckState(parent) == forked, "%s: child writes reached the parent", coreName);
+    CheckState childState(*child);
+
+    // Then the parent, which still shares nothing the child wrote
+    parent.runCycles(1000);
+    CHECK(CheckState(*child) == childState, "%s: parent writes reached the child", coreName);
+    CHECK(CheckState(parent) != childState, "%s: parent and child did not diverge", coreName);
+
+    Chip8 freshChild, freshParent;
+    setUp(freshChild, core, mode);
+    setUp(freshParent, core, mode);
+    freshChild.loadState(forked.data, forked.size);
+    freshParent.loadState(forked.data, forked.size);
+    freshChild.key[WRITER_KEY] = true;
+    freshChild.runCycles(1000);
+    freshParent.runCycles(1000);
+    CHECK(CheckState(freshChild) == childState, "%s: child differs from a fresh instance",
+        coreName);
+    CHECK(CheckState(freshParent) == CheckState(parent),
+        "%s: parent differs from a fresh instance", coreName);
+
+    // The parent writes first on a second fork
+    std::unique_ptr<Chip8> second = parent.fork();
+    CheckState secondForked(*second);
+    parent.key[WRITER_KEY] = true;
+    parent.runCycles(1000);
+    CHECK(CheckState(*second) == secondForked, "%s: parent writes reached the second child",
+        coreName);
+    second->runCycles(1000);
+    CHECK(CheckState(*second) != CheckState(parent), "%s: second child did not diverge",
+        coreName);
+}
+
+/**
+ * @brief Forks a running ROM many times and runs the children, each with a
+ * grandchild, on their own threads with different keys
+ */
+static void testThreads(const char *path, Chip8Core core, const char *coreName) {
+    Chip8 parent;
+    setUp(parent, core, CHIP8_MODE_CHIP8);
+    parent.loadRom(path);
+    if (!checkRun(parent, STRESS_WARMUP).empty()) {
+        return;
+    }
+    CheckState forked(parent);
+
+    std::vector<std::unique_ptr<Chip8>> children;
+    for (int i = 0; i < STRESS_FORKS; i++) {
+        children.push_back(parent.fork());
+    }
+
+    std::vector<int> matched(STRESS_FORKS, 0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < STRESS_FORKS; i++) {
+        threads.emplace_back([&, i] {
+            Chip8 &child = *children[i];
+            int key = i % KEYS;
+            child.key[key] = true;
+            std::unique_ptr<Chip8> grandchild = child.fork();
+            checkRun(child, STRESS_CYCLES);
+            child.key[key] = false;
+            checkRun(child, STRESS_CYCLES);
+            checkRun(*grandchild, STRESS_CYCLES / 4);
+
+            Chip8 fresh;
+            setUp(fresh, core, CHIP8_MODE_CHIP8);
+            fresh.loadState(forked.data, forked.size);
+            fresh.key[key] = true;
+            checkRun(fresh, STRESS_CYCLES);
+            fresh.key[key] = false;
+            checkRun(fresh, STRESS_CYCLES);
+            matched[i] = CheckState(child) == CheckState(fresh);
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < STRESS_FORKS; i++) {
+        CHECK(matched[i], "%s on %s: child %d differs from a fresh instance", path, coreName, i);
+    }
+    CHECK(CheckState(parent) == forked, "%s on %s: children changed the parent", path,
+        coreName);
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    static const struct {
+        Chip8Core core;
+        const char *name;
+    } cores[] = {
+        { CHIP8_CORE_INTERPRETER, "interpreter" },
+        { CHIP8_CORE_THREADED, "threaded" },
+        { CHIP8_CORE_JIT, "jit" }
+    };
+
+    for (const auto &core : cores) {
+        try {
+            Chip8().setCore(core.core);
+        } catch (const std::exception &) {
+            continue;
+        }
+        testIsolation(core.core, CHIP8_MODE_CHIP8, core.name);
+        testIsolation(core.core, CHIP8_MODE_SCHIP, core.name);
+        for (int i = 1; i < argc; i++) {
+            testThreads(argv[i], core.core, core.name);
+        }
+    }
+    return checkResult("test_fork");
+}
@@ -0,0 +1,131 @@
+/**
+ * @file test_movie.cpp
+ * @brief Records synthetic sessions the way the GTK front end does, with
+ * random key changes, rewinds and frames caught up in one run, in CHIP-8
+ * mode for some ROMs and SUPER-CHIP mode for the others and with other
+ * quirks for each, saves them as movies and checks that replaying each
+ * movie on every engine ends in the state the session ended in.
+ */
+
+#include <random>
+
+#include "check.h"
+#include "movie.h"
+#include "rewind.h"
+
+#define SESSION_FRAMES 1500
+#define SESSION_SEED 11
+
+/**
+ * @brief Plays a ROM for a number of frames with random input and records
+ * the session into a movie. Returns false if the ROM stopped on an error.
+ */
+static bool recordSession(const char *path, unsigned int seed, Chip8 &chip8,
+        Chip8Movie &movie) {
+    movie.mode = seed % 2 == 0 ? CHIP8_MODE_SCHIP : CHIP8_MODE_CHIP8;
+    movie.quirks = seed * 7 % (CHIP8_QUIRKS_ALL + 1);
+    movie.seed = SESSION_SEED;
+    movie.cyclesPerTick = CYCLES_PER_FRAME;
+    movie.romHash = hashRomFile(path);
+    movie.events.clear();
+
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setMode(movie.mode);
+    chip8.setQuirks(movie.quirks);
+    chip8.setCyclesPerTick(movie.cyclesPerTick);
+    chip8.setSeed(movie.seed);
+    chip8.loadRom(path);
+
+    Chip8Rewind history;
+    std::mt19937 random(seed);
+    for (int frame = 0; frame < SESSION_FRAMES; frame++) {
+        int action = random() % 100;
+        if (action < 10) {
+            // A key changes, only changes are recorded
+            unsigned char key = random() % KEYS;
+            bool pressed = !chip8.key[key];
+            movie.events.push_back({ chip8.getCycles(), key, pressed });
+            chip8.key[key] = pressed;
+        } else if (action < 13) {
+            // Rewind, key changes of the undone frames never happened
+            for (int i = random() % 30; i > 0 && history.rewind(chip8); i--) {
+            }
+            while (!movie.events.empty() && movie.events.back().cycle >= chip8.getCycles()) {
+                movie.events.pop_back();
+            }
+            continue;
+        }
+
+        // Frames missed while idle are caught up in one run
+        unsigned int frames = action < 15 ? 1 + random() % 120 : 1;
+        if (!checkRun(chip8, (unsigned long long) frames * movie.cyclesPerTick).empty()) {
+            return false;
+        }
+        history.record(chip8);
+    }
+
+    movie.cycles = chip8.getCycles();
+    movie.gfxHash = chip8.hashGfx();
+    return true;
+}
+
+static void testSession(const char *path, unsigned int seed) {
+    Chip8 session;
+    Chip8Movie recorded;
+    if (!recordSession(path, seed, session, recorded)) {
+        return;
+    }
+
+    CheckFile file("");
+    saveMovie(file.getPath(), recorded);
+    Chip8Movie movie = loadMovie(file.getPath());
+
+    bool same = movie.events.size() == recorded.events.size();
+    for (size_t i = 0; same && i < movie.events.size(); i++) {
+        same = movie.events[i].cycle == recorded.events[i].cycle &&
+            movie.events[i].key == recorded.events[i].key &&
+            movie.events[i].pressed == recorded.events[i].pressed;
+    }
+    CHECK(same && movie.mode == recorded.mode &&
+        movie.quirks == recorded.quirks && movie.seed == recorded.seed && movie.cyclesPerTick == recorded.cyclesPerTick &&
+        movie.cycles == recorded.cycles && movie.gfxHash == recorded.gfxHash &&
+        movie.romHash == recorded.romHash, "%s: movie changed when saved and loaded", path);
+
+    static const struct {
+        Chip8Core core;
+        const char *name;
+    } cores[] = {
+        { CHIP8_CORE_INTERPRETER, "interpreter" },
+        { CHIP8_CORE_THREADED, "threaded" },
+        { CHIP8_CORE_JIT, "jit" }
+    };
+
+    for (const auto &core : cores) {
+        Chip8 replay;
+        try {
+            replay.setCore(core.core);
+        } catch (const std::exception &) {
+            continue;
+        }
+        replay.loadRom(path);
+        std::string error;
+        try {
+            replayMovie(replay, movie);
+        } catch (const std::exception &e) {
+            error = e.what();
+        }
+        CHECK(error.empty() && replay.hashGfx() == movie.gfxHash &&
+            CheckState(replay) == CheckState(session),
+            "%s on %s: replay differs from the session %s", path, core.name, error.c_str());
+    }
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    for (int i = 1; i < argc; i++) {
+        testSession(argv[i], i);
+    }
+    return checkResult("test_movie");
+}
@@ -0,0 +1,139 @@
+/**
+ * @file test_queues.cpp
+ * @brief Two thread stress tests of the primitives the GTK front end hands
+ * frames and audio between threads with. make check-tsan builds it with
+ * ThreadSanitizer to have data races reported as well.
+ */
+
+#include <stdint.h>
+#include <thread>
+
+#include "check.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
+
+#define QUEUE_ITEMS 1000000ULL
+#define QUEUE_BATCH 37
+#define FRAMES 100000ULL
+#define FRAME_WORDS 64
+
+/**
+ * @brief Value of a triple buffer in which every word is derived from the
+ * sequence number, so a torn read shows
+ */
+struct Frame {
+    uint64_t sequence;
+    uint64_t words[FRAME_WORDS];
+};
+
+static uint64_t frameWord(uint64_t sequence, int index) {
+    return sequence * 0x9E3779B97F4A7C15ULL + index;
+}
+
+/**
+ * @brief Pushes and pops a numbered sequence, alternating single and batch
+ * calls on both sides, and checks that every item arrives once and in order
+ */
+static void testQueue() {
+    static SpscQueue<uint64_t, 1024> queue;
+
+    std::thread producer([] {
+        uint64_t next = 0;
+        uint64_t batch[QUEUE_BATCH];
+        while (next < QUEUE_ITEMS) {
+            size_t pushed;
+            if (next % 2 == 0) {
+                pushed = queue.push(next) ? 1 : 0;
+            } else {
+                size_t count = 0;
+                while (count < QUEUE_BATCH && next + count < QUEUE_ITEMS) {
+                    batch[count] = next + count;
+                    count++;
+                }
+                pushed = queue.push(batch, count);
+            }
+            // Lets the consumer run when both share one CPU
+            if (pushed == 0) {
+                std::this_thread::yield();
+            }
+            next += pushed;
+        }
+    });
+
+    uint64_t expected = 0;
+    uint64_t errors = 0;
+    uint64_t batch[QUEUE_BATCH];
+    while (expected < QUEUE_ITEMS) {
+        size_t count;
+        if (expected % 3 == 0) {
+            count = queue.pop(batch[0]) ? 1 : 0;
+        } else {
+            count = queue.pop(batch, QUEUE_BATCH);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (batch[i] != expected + i) {
+                errors++;
+            }
+        }
+        if (count == 0) {
+            std::this_thread::yield();
+        }
+        expected += count;
+    }
+    producer.join();
+
+    CHECK(errors == 0, "SpscQueue: %llu items out of order", (unsigned long long) errors);
+    CHECK(queue.empty() && queue.size() == 0, "SpscQueue: not empty at the end");
+}
+
+/**
+ * @brief Publishes numbered frames as fast as possible and checks that the
+ * reader only sees complete frames, in increasing order, and the last one
+ */
+static void testTripleBuffer() {
+    static TripleBuffer<Frame> buffer;
+
+    std::thread writer([] {
+        for (uint64_t sequence = 1; sequence <= FRAMES; sequence++) {
+            Frame &frame = buffer.writeBuffer();
+            frame.sequence = sequence;
+            for (int i = 0; i < FRAME_WORDS; i++) {
+                frame.words[i] = frameWord(sequence, i);
+            }
+            buffer.publish();
+        }
+    });
+
+    uint64_t last = 0;
+    uint64_t torn = 0;
+    uint64_t backwards = 0;
+    while (last < FRAMES) {
+        if (!buffer.update()) {
+            std::this_thread::yield();
+            continue;
+        }
+        const Frame &frame = buffer.readBuffer();
+        for (int i = 0; i < FRAME_WORDS; i++) {
+            if (frame.words[i] != frameWord(frame.sequence, i)) {
+                torn++;
+                break;
+            }
+        }
+        if (frame.sequence <= last) {
+            backwards++;
+        }
+        last = frame.sequence;
+    }
+    writer.join();
+
+    CHECK(torn == 0, "TripleBuffer: %llu torn frames", (unsigned long long) torn);
+    CHECK(backwards == 0, "TripleBuffer: %llu frames not newer than the previous one",
+        (unsigned long long) backwards);
+    CHECK(!buffer.update(), "TripleBuffer: a frame is left after the last one");
+}
+
+int main() {
+    testQueue();
+    testTripleBuffer();
+    return checkResult("test_queues");
+}
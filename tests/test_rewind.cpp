@@ -0,0 +1,139 @@
+/**
+ * @file test_rewind.cpp
+ * @brief Tests of the rewind history: stepping back restores every recorded
+ * frame exactly, newest first, also once the oldest frames were dropped or
+ * after rewinding and playing on.
+ */
+
+#include <random>
+
+#include "check.h"
+#include "rewind.h"
+
+#define FRAMES 600
+#define SMALL_CAPACITY (16 * 1024)
+
+static void setUp(Chip8 &chip8, const TestRom &rom) {
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setSeed(7);
+    checkLoadRom(chip8, rom.data);
+}
+
+/**
+ * @brief Runs frames with random key presses, recording each one, and keeps
+ * their states. Returns false if the ROM stopped on an error.
+ */
+static bool playFrames(Chip8 &chip8, Chip8Rewind &history, std::mt19937 &random,
+        int frames, std::vector<CheckState> &states) {
+    for (int i = 0; i < frames; i++) {
+        if (random() % 8 == 0) {
+            chip8.key[random() % KEYS] = random() % 2 == 0;
+        }
+        if (!checkRun(chip8, CYCLES_PER_FRAME).empty()) {
+            return false;
+        }
+        history.record(chip8);
+        states.push_back(CheckState(chip8));
+    }
+    return true;
+}
+
+/**
+ * @brief Rewinds until the history runs out, checking each restored frame
+ * against the newest kept states
+ */
+static void rewindAll(Chip8 &chip8, Chip8Rewind &history, std::vector<CheckState> &states,
+        const std::string &name) {
+    size_t expected = history.frames();
+    CHECK(expected <= states.size(), "%s: %zu frames recorded, only %zu played",
+        name.c_str(), expected, states.size());
+
+    size_t rewound = 0;
+    while (history.rewind(chip8)) {
+        rewound++;
+        states.pop_back();
+        if (CheckState(chip8) != states.back()) {
+            CHECK(false, "%s: wrong state %zu frames back", name.c_str(), rewound);
+            return;
+        }
+    }
+    CHECK(rewound + 1 == expected, "%s: rewound %zu of %zu frames", name.c_str(), rewound,
+        expected);
+    CHECK(history.frames() == 1, "%s: %zu frames left after rewinding all", name.c_str(),
+        history.frames());
+
+    // Nothing older to go back to, the system stays as it is
+    CheckState oldest(chip8);
+    CHECK(!history.rewind(chip8) && CheckState(chip8) == oldest,
+        "%s: rewound past the oldest frame", name.c_str());
+}
+
+static void testRom(const TestRom &rom, unsigned int seed) {
+    // Everything fits
+    {
+        Chip8 chip8;
+        setUp(chip8, rom);
+        Chip8Rewind history;
+        std::mt19937 random(seed);
+        std::vector<CheckState> states;
+        if (!playFrames(chip8, history, random, FRAMES, states)) {
+            return;
+        }
+        CHECK(history.frames() == FRAMES, "%s: %zu frames kept of %d", rom.name.c_str(),
+            history.frames(), FRAMES);
+
+        // Go back half way, play on with other keys and rewind through both
+        for (int i = 0; i < FRAMES / 2; i++) {
+            history.rewind(chip8);
+            states.pop_back();
+        }
+        CHECK(CheckState(chip8) == states.back(), "%s: wrong state half way back",
+            rom.name.c_str());
+        if (!playFrames(chip8, history, random, FRAMES / 2, states)) {
+            return;
+        }
+        rewindAll(chip8, history, states, rom.name);
+
+        history.clear();
+        CHECK(history.frames() == 0 && !history.rewind(chip8),
+            "%s: frames left after clear()", rom.name.c_str());
+    }
+
+    // The oldest frames are dropped
+    {
+        Chip8 chip8;
+        setUp(chip8, rom);
+        Chip8Rewind history(SMALL_CAPACITY);
+        std::mt19937 random(seed);
+        std::vector<CheckState> states;
+        if (!playFrames(chip8, history, random, FRAMES, states)) {
+            return;
+        }
+        CHECK(history.size() <= SMALL_CAPACITY, "%s: %zu bytes used of %d", rom.name.c_str(),
+            history.size(), SMALL_CAPACITY);
+        rewindAll(chip8, history, states, rom.name + " (small)");
+    }
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    for (int i = 1; i < argc; i++) {
+        TestRom rom;
+        if (!checkReadRom(argv[i], rom)) {
+            CHECK(false, "Cannot read %s", argv[i]);
+            continue;
+        }
+        testRom(rom, i);
+    }
+
+    bool threw = false;
+    try {
+        Chip8Rewind tiny(CHIP8_STATE_MAX_SIZE);
+    } catch (const std::invalid_argument &) {
+        threw = true;
+    }
+    CHECK(threw, "history too small for a frame was created");
+    return checkResult("test_rewind");
+}
@@ -0,0 +1,143 @@
+/**
+ * @file test_rom_library.cpp
+ * @brief Tests of the ROM library: each file is mapped once, copies of a ROM
+ * share one image, ROMs that only share a hash do not, and an image runs
+ * exactly as the file it came from.
+ */
+
+#include "check.h"
+#include "movie.h"
+#include "rom_library.h"
+
+#define RUN_CYCLES 100000
+
+// Jumps over data holding 00 FF, then switches to high resolution
+static const std::vector<unsigned char> schipRom = { 0x12, 0x04, 0x00, 0xFF, 0x00, 0xFF,
+    0x12, 0x06 };
+
+// Two ROMs with the same 64 bit FNV-1a hash, 0x069D3B25617EF03A
+static const std::vector<unsigned char> collidingRoms[2] = {
+    { 0x2E, 0xC7, 0xD7, 0xAA, 0xAB, 0x52, 0x51, 0x5F },
+    { 0xC4, 0xA3, 0x2E, 0xC5, 0xA0, 0x4E, 0x78, 0xC7 }
+};
+
+/**
+ * @brief An image holds the file, has its hash and runs as the file does
+ */
+static void testImage(RomLibrary &library, const char *path) {
+    TestRom rom;
+    if (!checkReadRom(path, rom)) {
+        CHECK(false, "Cannot read %s", path);
+        return;
+    }
+
+    const RomImage &image = library.load(path);
+    CHECK(image.size == rom.data.size() && memcmp(image.data, rom.data.data(), image.size) == 0,
+        "%s: image differs from the file", path);
+    CHECK(image.hash == hashRomFile(path), "%s: hash differs from hashRomFile()", path);
+    CHECK(&library.load(path) == &image, "%s: loaded twice", path);
+    CHECK(library.find(image.hash) == &image, "%s: not found by hash", path);
+
+    Chip8 fromFile, fromImage;
+    fromFile.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    fromImage.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    fromFile.loadRom(path);
+    fromImage.loadRom(image.data, image.size);
+    std::string fileError = checkRun(fromFile, RUN_CYCLES);
+    std::string imageError = checkRun(fromImage, RUN_CYCLES);
+    CHECK(fileError == imageError && CheckState(fromFile) == CheckState(fromImage),
+        "%s: runs differently from its image", path);
+}
+
+static void testSharing() {
+    RomLibrary library;
+    std::vector<unsigned char> data = { 0x60, 0x01, 0x12, 0x00 };
+    CheckFile first(data), copy(data);
+    const RomImage &image = library.load(first.getPath());
+    CHECK(&library.load(copy.getPath()) == &image && library.size() == 1,
+        "copies of a ROM do not share one image");
+    CHECK(image.path == first.getPath(), "image path is %s", image.path.c_str());
+
+    data[1] = 0x02;
+    CheckFile other(data);
+    CHECK(&library.load(other.getPath()) != &image && library.size() == 2,
+        "another ROM shares an image");
+    CHECK(library.find(image.hash ^ 1) == NULL, "unknown hash found");
+
+    CheckFile empty("");
+    const RomImage &nothing = library.load(empty.getPath());
+    CHECK(nothing.data == NULL && nothing.size == 0, "empty ROM has %zu bytes", nothing.size);
+    CheckFile otherEmpty("");
+    CHECK(&library.load(otherEmpty.getPath()) == &nothing, "empty ROMs do not share one image");
+}
+
+/**
+ * @brief ROMs whose hashes collide keep images of their own
+ */
+static void testCollision() {
+    RomLibrary library;
+    CheckFile first(collidingRoms[0]), second(collidingRoms[1]);
+    const RomImage &firstImage = library.load(first.getPath());
+    const RomImage &secondImage = library.load(second.getPath());
+    CHECK(firstImage.hash == secondImage.hash, "test ROMs do not collide");
+    CHECK(&firstImage != &secondImage && library.size() == 2,
+        "ROMs with the same hash share an image");
+    CHECK(secondImage.size == collidingRoms[1].size() &&
+        memcmp(secondImage.data, collidingRoms[1].data(), secondImage.size) == 0,
+        "image differs from the ROM loaded second");
+    CHECK(library.find(firstImage.hash) == &firstImage, "hash does not find the first image");
+
+    // Copies still share the image of their own content
+    CheckFile copy(collidingRoms[1]);
+    CHECK(&library.load(copy.getPath()) == &secondImage && library.size() == 2,
+        "copy of a colliding ROM does not share its image");
+}
+
+static void testPlatform() {
+    RomLibrary library;
+    CheckFile schip(schipRom);
+    CHECK(library.load(schip.getPath()).platform == CHIP8_MODE_SCHIP,
+        "SUPER-CHIP ROM detected as CHIP-8");
+
+    // The same data is never executed without the jump
+    std::vector<unsigned char> data = { 0x12, 0x06, 0x00, 0xFF, 0x00, 0xFF, 0x12, 0x06 };
+    CheckFile chip8(data);
+    CHECK(library.load(chip8.getPath()).platform == CHIP8_MODE_CHIP8,
+        "data jumped over detected as SUPER-CHIP");
+}
+
+static void testErrors() {
+    RomLibrary library;
+    bool threw = false;
+    try {
+        library.load("/nonexistent/rom");
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "missing ROM was loaded");
+
+    CheckFile big(std::vector<unsigned char>(ROM_END - ROM_START + 1));
+    threw = false;
+    try {
+        library.load(big.getPath());
+    } catch (const std::invalid_argument &) {
+        threw = true;
+    }
+    CHECK(threw, "ROM too big for the memory was loaded");
+    CHECK(library.size() == 0, "failed loads left %zu images", library.size());
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    RomLibrary library;
+    for (int i = 1; i < argc; i++) {
+        testImage(library, argv[i]);
+    }
+    testSharing();
+    testCollision();
+    testPlatform();
+    testErrors();
+    return checkResult("test_rom_library");
+}
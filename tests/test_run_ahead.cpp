@@ -0,0 +1,130 @@
+/**
+ * @file test_run_ahead.cpp
+ * @brief Tests of run-ahead: each run shows the display a copy of the
+ * system reaches that many frames later, and leaves the system exactly as
+ * it was.
+ */
+
+#include <random>
+
+#include "check.h"
+#include "run_ahead.h"
+
+#define FRAMES 300
+
+static void setUp(Chip8 &chip8, const TestRom &rom) {
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setSeed(7);
+    checkLoadRom(chip8, rom.data);
+}
+
+/**
+ * @brief Plays a ROM with random key presses, running ahead after every
+ * frame, next to a copy that never runs ahead
+ */
+static void testRom(const TestRom &rom, unsigned int frames, unsigned int seed) {
+    Chip8 chip8, plain;
+    setUp(chip8, rom);
+    setUp(plain, rom);
+    Chip8RunAhead runAhead(frames);
+    std::mt19937 random(seed);
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        if (random() % 8 == 0) {
+            int key = random() % KEYS;
+            bool pressed = random() % 2 == 0;
+            chip8.key[key] = pressed;
+            plain.key[key] = pressed;
+        }
+
+        std::string error = checkRun(chip8, CYCLES_PER_FRAME);
+        std::string plainError = checkRun(plain, CYCLES_PER_FRAME);
+        if (error != plainError || CheckState(chip8) != CheckState(plain)) {
+            CHECK(false, "%s, %u frames ahead: system differs at frame %d", rom.name.c_str(),
+                frames, frame);
+            return;
+        }
+        if (!error.empty()) {
+            return;
+        }
+
+        // What the system shows the given number of frames from now
+        Chip8 future;
+        unsigned char state[CHIP8_STATE_MAX_SIZE];
+        future.loadState(state, plain.saveState(state, sizeof(state)));
+        bool futureOk = checkRun(future, frames * CYCLES_PER_FRAME).empty();
+
+        CheckState before(chip8);
+        bool ok = runAhead.run(chip8);
+        CHECK(CheckState(chip8) == before, "%s, %u frames ahead: not restored at frame %d",
+            rom.name.c_str(), frames, frame);
+        CHECK(ok == futureOk, "%s, %u frames ahead: run returned %d at frame %d",
+            rom.name.c_str(), frames, ok, frame);
+        if (ok && memcmp(runAhead.getGfx(), future.getGfx(), GFX_Y * sizeof(uint64_t)) != 0) {
+            CHECK(false, "%s, %u frames ahead: wrong display at frame %d", rom.name.c_str(),
+                frames, frame);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief The fusion counts of the threaded core leave out the frames run
+ * ahead
+ */
+static void testCounters(const TestRom &rom) {
+    Chip8 chip8;
+    setUp(chip8, rom);
+    chip8.setCore(CHIP8_CORE_THREADED);
+    Chip8RunAhead runAhead(RUN_AHEAD_MAX_FRAMES);
+
+    unsigned long long fusions[CHIP8_FUSIONS];
+    for (int frame = 0; frame < FRAMES; frame++) {
+        if (!checkRun(chip8, CYCLES_PER_FRAME).empty()) {
+            return;
+        }
+        memcpy(fusions, chip8.getFusions(), sizeof(fusions));
+        runAhead.run(chip8);
+        if (memcmp(chip8.getFusions(), fusions, sizeof(fusions)) != 0) {
+            CHECK(false, "%s: fusions run ahead were counted at frame %d", rom.name.c_str(),
+                frame);
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    // Runs into the stack after a few frames
+    TestRom overflow = { "stack overflow", { 0x70, 0x01, 0x30, 0x00, 0x12, 0x00, 0x22, 0x06 } };
+    std::vector<TestRom> roms(1, overflow);
+    for (int i = 1; i < argc; i++) {
+        TestRom rom;
+        if (!checkReadRom(argv[i], rom)) {
+            CHECK(false, "Cannot read %s", argv[i]);
+            continue;
+        }
+        roms.push_back(rom);
+    }
+
+    for (size_t i = 0; i < roms.size(); i++) {
+        testRom(roms[i], 1, i);
+        testRom(roms[i], RUN_AHEAD_MAX_FRAMES, i);
+        testCounters(roms[i]);
+    }
+
+    Chip8 chip8;
+    Chip8RunAhead disabled(0);
+    CHECK(!disabled.run(chip8) && disabled.getFrames() == 0, "run-ahead of 0 frames ran");
+
+    bool threw = false;
+    try {
+        Chip8RunAhead tooFar(RUN_AHEAD_MAX_FRAMES + 1);
+    } catch (const std::invalid_argument &) {
+        threw = true;
+    }
+    CHECK(threw, "run-ahead beyond RUN_AHEAD_MAX_FRAMES was created");
+    return checkResult("test_run_ahead");
+}
@@ -0,0 +1,193 @@
+/**
+ * @file test_state.cpp
+ * @brief Tests of save states: a restored state runs on exactly as the
+ * original did, on any engine, and invalid states leave the machine as it
+ * was.
+ */
+
+#include "check.h"
+
+#define SAVE_CYCLES 50000
+#define RUN_CYCLES 100000
+
+// Offsets in a state of the quirks and of the SUPER-CHIP resolution and
+// flags, which older versions do not have, see Chip8::saveState()
+#define STATE_QUIRKS 6
+#define STATE_HIRES (CHIP8_STATE_FIXED_SIZE - 2 - GFX_Y * 8 - RPL_FLAGS - 1)
+
+static void setUp(Chip8 &chip8, const TestRom &rom, Chip8Mode mode) {
+    chip8.setClockMode(CHIP8_CLOCK_VIRTUAL);
+    chip8.setMode(mode);
+    chip8.setSeed(7);
+    checkLoadRom(chip8, rom.data);
+}
+
+/**
+ * @brief Saves a state part way through a ROM, then checks that the
+ * original, the same instance rewound to the state and a fresh instance
+ * loaded with it reach the same state
+ */
+static void testRoundTrip(const TestRom &rom, Chip8Mode mode) {
+    Chip8 original;
+    setUp(original, rom, mode);
+    original.key[5] = true;
+    std::string error = checkRun(original, SAVE_CYCLES);
+    if (!error.empty()) {
+        return;
+    }
+
+    unsigned char saved[CHIP8_STATE_MAX_SIZE];
+    size_t size = original.saveState(saved, sizeof(saved));
+    CheckState atSave(original);
+
+    std::string originalError = checkRun(original, RUN_CYCLES);
+    CheckState expected(original);
+
+    // Back in time on the same instance
+    original.loadState(saved, size);
+    CHECK(CheckState(original) == atSave, "%s: state differs after loading it",
+        rom.name.c_str());
+    std::string rewoundError = checkRun(original, RUN_CYCLES);
+    CHECK(rewoundError == originalError && CheckState(original) == expected,
+        "%s: differs after running on from a loaded state", rom.name.c_str());
+
+    // On a fresh instance with another engine. The file goes through
+    // saveStateFile() and loadStateFile().
+    CheckFile file("");
+    original.loadState(saved, size);
+    original.saveStateFile(file.getPath());
+
+    Chip8 restored;
+    try {
+        restored.setCore(CHIP8_CORE_JIT);
+    } catch (const std::exception &) {
+        // The interpreter then runs both
+    }
+    restored.loadStateFile(file.getPath());
+    std::string restoredError = checkRun(restored, RUN_CYCLES);
+    CHECK(restoredError == originalError && CheckState(restored) == expected,
+        "%s: differs after running on from a state file", rom.name.c_str());
+}
+
+/**
+ * @brief Checks that a state is rejected and the machine kept as it was
+ */
+static void checkRejected(Chip8 &chip8, const unsigned char *state, size_t size,
+        const char *what) {
+    CheckState before(chip8);
+    bool threw = false;
+    try {
+        chip8.loadState(state, size);
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "%s was loaded", what);
+    CHECK(CheckState(chip8) == before, "%s changed the machine", what);
+}
+
+/**
+ * @brief Turns a CHIP-8 state without quirks into the same state of version
+ * 2 and version 1, which a machine in another mode and with quirks restores
+ * as the original
+ */
+static void testOldVersions(const TestRom &rom) {
+    Chip8 original;
+    setUp(original, rom, CHIP8_MODE_CHIP8);
+    checkRun(original, SAVE_CYCLES);
+    CheckState expected(original);
+
+    std::vector<unsigned char> v2(expected.data, expected.data + expected.size);
+    v2.erase(v2.begin() + STATE_QUIRKS);
+    v2[4] = 2;
+    std::vector<unsigned char> v1(v2);
+    v1.erase(v1.begin() + STATE_HIRES - 1, v1.begin() + STATE_HIRES + RPL_FLAGS);
+    v1.erase(v1.begin() + 5);
+    v1[4] = 1;
+
+    const std::vector<unsigned char> *states[] = { &v2, &v1 };
+    for (const std::vector<unsigned char> *state : states) {
+        Chip8 restored;
+        restored.setMode(CHIP8_MODE_SCHIP);
+        restored.setQuirks(CHIP8_QUIRKS_ALL);
+        try {
+            restored.loadState(state->data(), state->size());
+        } catch (const std::exception &e) {
+            CHECK(false, "%s: version %d state not loaded: %s", rom.name.c_str(),
+                (*state)[4], e.what());
+            continue;
+        }
+        CHECK(CheckState(restored) == expected, "%s: version %d state restored differently",
+            rom.name.c_str(), (*state)[4]);
+    }
+
+    std::vector<unsigned char> v0(v1);
+    v0[4] = 0;
+    checkRejected(original, v0.data(), v0.size(), "state of version 0");
+}
+
+static void testInvalid(const TestRom &rom) {
+    Chip8 chip8;
+    setUp(chip8, rom, CHIP8_MODE_CHIP8);
+    checkRun(chip8, SAVE_CYCLES);
+
+    unsigned char state[CHIP8_STATE_MAX_SIZE + 1];
+    size_t size = chip8.saveState(state, sizeof(state));
+
+    bool threw = false;
+    try {
+        unsigned char small[CHIP8_STATE_FIXED_SIZE];
+        chip8.saveState(small, sizeof(small));
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "state was saved to a buffer that is too small");
+
+    // Run on so that a wrongly loaded state would show
+    checkRun(chip8, SAVE_CYCLES);
+
+    checkRejected(chip8, state, size - 1, "truncated state");
+    state[size] = 0;
+    checkRejected(chip8, state, size + 1, "state with trailing bytes");
+    checkRejected(chip8, state, 3, "state shorter than its header");
+
+    std::vector<unsigned char> broken(state, state + size);
+    broken[0] = 'X';
+    checkRejected(chip8, broken.data(), size, "state with a bad magic");
+
+    broken.assign(state, state + size);
+    broken[4] = CHIP8_STATE_VERSION + 1;
+    checkRejected(chip8, broken.data(), size, "state of a future version");
+
+    threw = false;
+    try {
+        chip8.loadStateFile("/nonexistent/state");
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    CHECK(threw, "missing state file was loaded");
+}
+
+int main(int argc, char **argv) {
+    // The cores print the opcode they stop on
+    freopen("/dev/null", "w", stdout);
+
+    std::vector<TestRom> roms;
+    for (int i = 1; i < argc; i++) {
+        TestRom rom;
+        if (!checkReadRom(argv[i], rom)) {
+            CHECK(false, "Cannot read %s", argv[i]);
+            continue;
+        }
+        roms.push_back(rom);
+    }
+
+    for (const TestRom &rom : roms) {
+        testRoundTrip(rom, CHIP8_MODE_CHIP8);
+        testRoundTrip(rom, CHIP8_MODE_SCHIP);
+    }
+    if (!roms.empty()) {
+        testOldVersions(roms[0]);
+        testInvalid(roms[0]);
+    }
+    return checkResult("test_state");
+}